@@ -25,9 +25,9 @@
 	<doc>
 	<h1>Buffer</h1>
 	<p>
-	A buffer can store any value as a string and will only allocate the total
-	needed space when requested. It makes a copy of each value when stored so
-	modifying them after is not a problem.
+	A buffer can store any value as a string. It makes a copy of each value
+	when stored so modifying them after is not a problem. The storage grows
+	as needed and is kept when the buffer is reset.
 	</p>
 	</doc>
 **/
@@ -94,11 +94,11 @@ static value buffer_string( value b ) {
 
 /**
 	buffer_reset : 'buffer -> void
-	<doc>Make the buffer empty</doc>
+	<doc>Make the buffer empty, keeping its allocated storage</doc>
 **/
 static value buffer_reset( value b ) {
 	val_check_kind(b,k_buffer);
-	val_data(b) = alloc_buffer(NULL);
+	buffer_clear( (buffer)val_data(b) );
 	return val_true;
 }
 
@@ -0,0 +1,115 @@
+/*
+ * Copyright (C)2005-2022 Haxe Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <neko_vm.h>
+
+/**
+	<doc>
+	<h1>Fiber</h1>
+	<p>
+	Cooperative fibers : each fiber runs a function on its own stack and
+	can suspend itself with [fiber_yield], until it is resumed again by
+	[fiber_resume]. Fibers run on the thread which resumes them, so they
+	are much cheaper than threads.
+	</p>
+	</doc>
+**/
+
+/**
+	fiber_create : f:function:1 -> 'fiber
+	<doc>
+	Creates a fiber that will run [f(v)] where [v] is the value passed to
+	the first [fiber_resume]. The fiber does not start until it is resumed.
+	Once started, a fiber keeps its stack and everything it references
+	until it returns : a fiber which is dropped while suspended must be
+	released with [fiber_dispose] or it leaks.
+	</doc>
+**/
+static value fiber_create( value f ) {
+	val_check_function(f,1);
+	return neko_fiber_alloc(f,0);
+}
+
+/**
+	fiber_resume : 'fiber -> v:any -> any
+	<doc>
+	Runs the fiber until it yields or returns. The value [v] is returned
+	by the [fiber_yield] which suspended it. Returns the value passed to
+	[fiber_yield] or the value returned by the fiber function. An exception
+	raised in the fiber is raised again by [fiber_resume].
+	</doc>
+**/
+static value fiber_resume( value f, value v ) {
+	val_check_kind(f,neko_kind_fiber);
+	return neko_fiber_resume(f,v);
+}
+
+/**
+	fiber_yield : v:any -> any
+	<doc>
+	Suspends the current fiber, its [fiber_resume] returns [v]. Returns
+	the value passed to the next [fiber_resume].
+	</doc>
+**/
+static value fiber_yield( value v ) {
+	return neko_fiber_yield(v);
+}
+
+/**
+	fiber_dispose : 'fiber -> void
+	<doc>
+	Releases the stack of a fiber that will not be resumed again. The code
+	after its pending [fiber_yield] never runs and the fiber is marked as
+	returned. Disposing a fiber which has returned does nothing.
+	</doc>
+**/
+static value fiber_dispose( value f ) {
+	val_check_kind(f,neko_kind_fiber);
+	neko_fiber_dispose(f);
+	return val_null;
+}
+
+/**
+	fiber_current : void -> 'fiber?
+	<doc>Returns the running fiber or [null] if not called from a fiber</doc>
+**/
+static value fiber_current() {
+	return neko_fiber_current();
+}
+
+/**
+	fiber_status : 'fiber -> int
+	<doc>
+	Returns the state of the fiber : 0 if it has not been started, 1 if it
+	is suspended, 2 if it is running and 3 if it has returned.
+	</doc>
+**/
+static value fiber_status( value f ) {
+	val_check_kind(f,neko_kind_fiber);
+	return alloc_int(neko_fiber_status(f));
+}
+
+DEFINE_PRIM(fiber_create,1);
+DEFINE_PRIM(fiber_resume,2);
+DEFINE_PRIM(fiber_yield,1);
+DEFINE_PRIM(fiber_dispose,1);
+DEFINE_PRIM(fiber_current,0);
+DEFINE_PRIM(fiber_status,1);
@@ -43,6 +43,7 @@ extern vkind k_file;
 extern vkind k_socket;
 extern vkind k_buffer;
 extern vkind k_thread;
+extern void socket_loop_init();
 
 void std_main() {
 	id_h = val_id("h");
@@ -65,6 +66,7 @@ void std_main() {
 	kind_share(&k_socket,"socket");
 	kind_share(&k_buffer,"buffer");
 	kind_share(&k_thread,"thread");
+	socket_loop_init();
 }
 
 /* ************************************************************************ */
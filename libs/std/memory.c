@@ -79,6 +79,10 @@ static int mem_size_rec( value v,  vtree **l ) {
 	case VAL_NULL:
 		return 0;
 	case VAL_FLOAT:
+#		ifdef NEKO_IMMEDIATE_FLOATS
+		if( val_is_imm_float(v) )
+			return 0;
+#		endif
 		if( mem_cache(v,l) )
 			return 0;
 		return sizeof(vfloat);
@@ -138,9 +142,14 @@ static int mem_size_rec( value v,  vtree **l ) {
 				vhash *h = (vhash*)val_data(v);
 				int i;
 				t += sizeof(vhash);
-				t += sizeof(hcell*) * h->ncells;
+				t += (sizeof(hcell) + 1) * h->ncells;
 				for(i=0;i<h->ncells;i++) {
-					hcell *c = h->cells[i];
+					hcell *c;
+					if( h->ctrl[i] & 0x80 )
+						continue;
+					t += mem_size_rec(h->cells[i].key,l);
+					t += mem_size_rec(h->cells[i].val,l);
+					c = h->cells[i].next;
 					while( c != NULL ) {
 						t += sizeof(hcell);
 						t += mem_size_rec(c->key,l);
@@ -160,7 +169,7 @@ static int mem_size_rec( value v,  vtree **l ) {
 
 static void mem_obj_field( value v, field f, void *_p ) {
 	vparams *p = (vparams*)_p;
-	p->s += sizeof(objcell);
+	p->s += sizeof(value);
 	p->s += mem_size_rec(v,p->t);
 }
 
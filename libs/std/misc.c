@@ -124,16 +124,41 @@ static value run_gc( value b ) {
 }
 
 /**
-	gc_stats : void -> { heap => int, free => int }
-	<doc>Return the size of the GC heap and the among of free space, in bytes</doc>
+	gc_stats : void -> { heap => int, free => int, pauses => int array, max_pause => int }
+	<doc>Return the size of the GC heap and the among of free space, in bytes.
+	[pauses] is an histogram of the collection pauses : the first cell counts
+	the pauses under 1ms, the cell [i] the pauses between 2^(i-1) and 2^i ms
+	and the last one all the longer pauses. [max_pause] is in microseconds.</doc>
 **/
 static value gc_stats() {
-	int heap, free;
-	value o;
+	int heap, free, max_pause, i;
+	int pauses[NEKO_GC_PAUSE_BUCKETS];
+	value o, a;
 	neko_gc_stats(&heap,&free);
+	neko_gc_pause_stats(pauses,&max_pause);
+	a = alloc_array(NEKO_GC_PAUSE_BUCKETS);
+	for(i=0;i<NEKO_GC_PAUSE_BUCKETS;i++)
+		val_array_ptr(a)[i] = alloc_int(pauses[i]);
 	o = alloc_object(NULL);
 	alloc_field(o,val_id("heap"),alloc_int(heap));
 	alloc_field(o,val_id("free"),alloc_int(free));
+	alloc_field(o,val_id("pauses"),a);
+	alloc_field(o,val_id("max_pause"),alloc_int(max_pause));
+	return o;
+}
+
+/**
+	gc_thread_stats : void -> { allocs => int, refills => int }
+	<doc>Return the number of small blocks allocated by the current thread
+	and how many times its free lists had to be refilled from the GC</doc>
+**/
+static value gc_thread_stats() {
+	int allocs, refills;
+	value o;
+	neko_gc_vm_stats(neko_vm_current(),&allocs,&refills);
+	o = alloc_object(NULL);
+	alloc_field(o,val_id("allocs"),alloc_int(allocs));
+	alloc_field(o,val_id("refills"),alloc_int(refills));
 	return o;
 }
 
@@ -364,6 +389,7 @@ DEFINE_PRIM(float_of_bytes,2);
 DEFINE_PRIM(double_of_bytes,2);
 DEFINE_PRIM(run_gc,1);
 DEFINE_PRIM(gc_stats,0);
+DEFINE_PRIM(gc_thread_stats,0);
 DEFINE_PRIM(enable_jit,1);
 DEFINE_PRIM(test,0);
 DEFINE_PRIM(print_redirect,1);
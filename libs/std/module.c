@@ -121,7 +121,7 @@ static value module_read_path( value path, value name, value loader ) {
 		buffer_append(b,mname);
 		bfailure(b);
 	}
-	m = neko_read_module(neko_file_reader,f,loader);
+	m = neko_read_module_file(f,val_string(fname),loader);
 	fclose(f);
 	if( m == NULL ) {
 		buffer b = alloc_buffer("Invalid module : ");
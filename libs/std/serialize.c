@@ -21,6 +21,7 @@
  */
 #include <string.h>
 #include <neko_mod.h>
+#include <neko_vm.h>
 
 #define BUF_SIZE	4096
 #define ERROR()		val_throw(alloc_string("Invalid serialized data"))
@@ -189,8 +190,11 @@ void serialize_rec( sbuffer *b, value o ) {
 		write_int(b,val_int(o));
 		break;
 	case VAL_FLOAT:
-		write_char(b,'f');
-		write_str(b,sizeof(tfloat),&val_float(o));
+		{
+			tfloat f = val_float(o);
+			write_char(b,'f');
+			write_str(b,sizeof(tfloat),&f);
+		}
 		break;
 	case VAL_STRING:
 		if( !write_ref(b,o,NULL) ) {
@@ -272,9 +276,10 @@ void serialize_rec( sbuffer *b, value o ) {
 			write_int(b,h->ncells);
 			write_int(b,h->nitems);
 			for(i=0;i<h->ncells;i++) {
-				hcell *c = h->cells[i];
+				hcell *c = h->ctrl[i] & 0x80 ? NULL : &h->cells[i];
 				while( c != NULL ) {
-					write_int(b,c->hkey);
+					// older versions trust the stored hash
+					write_int(b,neko_val_hash_compat(c->key));
 					serialize_rec(b,c->key);
 					serialize_rec(b,c->val);
 					c = c->next;
@@ -520,23 +525,18 @@ static value unserialize_rec( sbuffer *b, value loader ) {
 	case 'h':
 		{
 			int i;
-			vhash *h = (vhash*)alloc(sizeof(vhash));
-			h->ncells = read_int(b);
-			h->nitems = read_int(b);
-			h->cells = (hcell**)alloc(sizeof(hcell*)*h->ncells);
-			for(i=0;i<h->ncells;i++)
-				h->cells[i] = NULL;
-			for(i=0;i<h->nitems;i++) {
-				hcell **p;
-				hcell *c = (hcell*)alloc(sizeof(hcell));
-				c->hkey = read_int(b);
-				c->key = unserialize_rec(b,loader);
-				c->val = unserialize_rec(b,loader);
-				c->next = NULL;
-				p = &h->cells[c->hkey % h->ncells];
-				while( *p != NULL )
-					p = &(*p)->next;
-				*p = c;
+			vhash *h;
+			int ncells = read_int(b);
+			int nitems = read_int(b);
+			h = neko_hash_alloc(nitems > ncells ? nitems : ncells);
+			for(i=0;i<nitems;i++) {
+				value key, val;
+				// the hash might have been computed with another seed
+				read_int(b);
+				key = unserialize_rec(b,loader);
+				val = unserialize_rec(b,loader);
+				// masked bindings are stored after the one masking them
+				neko_hash_add(h,val_hash(key),key,val,true);
 			}
 			return alloc_abstract(k_hash,h);
 		}
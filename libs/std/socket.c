@@ -35,6 +35,7 @@
 #	include <sys/types.h>
 #	include <sys/socket.h>
 #	include <sys/time.h>
+#	include <time.h>
 #	include <netinet/in.h>
 #	include <netinet/tcp.h>
 #	include <arpa/inet.h>
@@ -65,12 +66,17 @@
 #	define MSG_NOSIGNAL 0
 #endif
 
+#ifndef MSG_DONTWAIT
+#	define MSG_DONTWAIT 0
+#endif
+
 #define NRETRYS	20
 
 typedef struct {
 	SOCKET sock;
 	char *buf;
 	int size;
+	int flags;
 	int ret;
 } sock_tmp;
 
@@ -136,6 +142,319 @@ static value block_error() {
 	return val_true;
 }
 
+/*
+	Reactor : the fibers spawned in a 'loop are resumed by socket_loop_run.
+	When a socket operation of such a fiber would block, the fiber is
+	suspended until the socket is ready (epoll when available, poll
+	otherwise) instead of raising "Blocking", so it reads like blocking
+	code. Waits and sleeps can have a timeout, kept in a binary heap.
+*/
+
+#define LOOP_READ		1
+#define LOOP_WRITE		2
+#define LOOP_EVENTS		256
+
+typedef struct {
+	value fiber;
+	value f;
+	value param;
+	value arg;
+	value exc;
+	int fd;
+	int events;
+	int wait;
+	int result;
+} lfiber;
+
+typedef struct {
+	double time;
+	int wait;
+	lfiber *f;
+} ltimer;
+
+typedef struct {
+	lfiber **readers;
+	lfiber **writers;
+	int nfds;
+	int nwaits;
+	ltimer *timers;
+	int ntimers;
+	int maxtimers;
+	lfiber **ready;
+	int rhead;
+	int rcount;
+	int rsize;
+	lfiber *running;
+	int count;
+	int waits;
+	value main;
+#	ifdef HAS_EPOLL
+	int epollfd;
+	struct epoll_event *events;
+#	endif
+} vloop;
+
+DEFINE_KIND(k_loop);
+DEFINE_KIND(k_loop_fiber);
+
+#define val_loop(o)		((vloop*)val_data(o))
+
+#ifndef NEKO_WINDOWS
+static mt_local *loop_current = NULL;
+
+void socket_loop_init() {
+	loop_current = alloc_local();
+}
+
+static double loop_time() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC,&t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// the loop which resumed the current fiber, NULL if there is none
+static vloop *loop_active() {
+	vloop *l = (vloop*)local_get(loop_current);
+	if( l == NULL || l->running == NULL || l->running->fiber != neko_fiber_current() )
+		return NULL;
+	return l;
+}
+
+static void loop_ready( vloop *l, lfiber *f ) {
+	if( l->rcount == l->rsize ) {
+		int i, size = l->rsize ? l->rsize * 2 : 16;
+		lfiber **r = (lfiber**)alloc(sizeof(lfiber*) * size);
+		for(i=0;i<l->rcount;i++)
+			r[i] = l->ready[(l->rhead + i) % l->rsize];
+		l->ready = r;
+		l->rhead = 0;
+		l->rsize = size;
+	}
+	l->ready[(l->rhead + l->rcount++) % l->rsize] = f;
+}
+
+static void timer_push( vloop *l, double time, lfiber *f ) {
+	int i;
+	if( l->ntimers == l->maxtimers ) {
+		int size = l->maxtimers ? l->maxtimers * 2 : 16;
+		ltimer *t = (ltimer*)alloc(sizeof(ltimer) * size);
+		memcpy(t,l->timers,sizeof(ltimer) * l->ntimers);
+		l->timers = t;
+		l->maxtimers = size;
+	}
+	i = l->ntimers++;
+	while( i > 0 && l->timers[(i - 1) >> 1].time > time ) {
+		l->timers[i] = l->timers[(i - 1) >> 1];
+		i = (i - 1) >> 1;
+	}
+	l->timers[i].time = time;
+	l->timers[i].wait = f->wait;
+	l->timers[i].f = f;
+}
+
+static void timer_pop( vloop *l ) {
+	ltimer last = l->timers[--l->ntimers];
+	int i = 0;
+	while( true ) {
+		int c = (i << 1) + 1;
+		if( c >= l->ntimers )
+			break;
+		if( c + 1 < l->ntimers && l->timers[c + 1].time < l->timers[c].time )
+			c++;
+		if( last.time <= l->timers[c].time )
+			break;
+		l->timers[i] = l->timers[c];
+		i = c;
+	}
+	l->timers[i] = last;
+	l->timers[l->ntimers].f = NULL;
+}
+
+static void loop_register( vloop *l, int fd ) {
+#	ifdef HAS_EPOLL
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT | (l->readers[fd] ? EPOLLIN : 0) | (l->writers[fd] ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	// closed sockets are removed from the epoll set, their fd can be reused
+	if( epoll_ctl(l->epollfd,EPOLL_CTL_MOD,fd,&ev) != 0 && (errno != ENOENT || epoll_ctl(l->epollfd,EPOLL_CTL_ADD,fd,&ev) != 0) )
+		val_throw(alloc_int(errno));
+#	endif
+}
+
+static void loop_wake( vloop *l, lfiber *f, int result ) {
+	if( f->fd >= 0 ) {
+		if( l->readers[f->fd] == f )
+			l->readers[f->fd] = NULL;
+		if( l->writers[f->fd] == f )
+			l->writers[f->fd] = NULL;
+		f->fd = -1;
+		l->nwaits--;
+	}
+	f->wait = 0;
+	f->result = result;
+	loop_ready(l,f);
+}
+
+static void loop_events( vloop *l, int fd, int events ) {
+	lfiber *r, *w;
+	if( fd >= l->nfds )
+		return;
+	r = l->readers[fd];
+	w = l->writers[fd];
+	if( r && (events & LOOP_READ) )
+		loop_wake(l,r,1);
+	if( w && (events & LOOP_WRITE) )
+		loop_wake(l,w,1);
+	// the other side is still waiting
+	if( l->readers[fd] || l->writers[fd] )
+		loop_register(l,fd);
+}
+
+static void loop_poll( vloop *l, int timeout ) {
+#	ifdef HAS_EPOLL
+	int i, n = epoll_wait(l->epollfd,l->events,LOOP_EVENTS,timeout);
+	for(i=0;i<n;i++) {
+		int e = l->events[i].events;
+		int ev = 0;
+		if( e & (EPOLLIN | EPOLLERR | EPOLLHUP) )
+			ev |= LOOP_READ;
+		if( e & (EPOLLOUT | EPOLLERR | EPOLLHUP) )
+			ev |= LOOP_WRITE;
+		loop_events(l,l->events[i].data.fd,ev);
+	}
+#	else
+	struct pollfd *fds = (struct pollfd*)malloc(sizeof(struct pollfd) * (l->nwaits + 1));
+	int i, n = 0;
+	for(i=0;i<l->nfds && n < l->nwaits;i++)
+		if( l->readers[i] || l->writers[i] ) {
+			fds[n].fd = i;
+			fds[n].events = (l->readers[i] ? POLLIN : 0) | (l->writers[i] ? POLLOUT : 0);
+			fds[n].revents = 0;
+			n++;
+		}
+	if( poll(fds,n,timeout) > 0 )
+		for(i=0;i<n;i++) {
+			int e = fds[i].revents;
+			int ev = 0;
+			if( e & (POLLIN | POLLERR | POLLHUP) )
+				ev |= LOOP_READ;
+			if( e & (POLLOUT | POLLERR | POLLHUP) )
+				ev |= LOOP_WRITE;
+			if( ev )
+				loop_events(l,fds[i].fd,ev);
+		}
+	free(fds);
+#	endif
+}
+
+static void loop_timers( vloop *l ) {
+	double now;
+	if( l->ntimers == 0 )
+		return;
+	now = loop_time();
+	while( l->ntimers > 0 && l->timers[0].time <= now ) {
+		lfiber *f = l->timers[0].f;
+		int wait = l->timers[0].wait;
+		timer_pop(l);
+		// the fiber might have been woken up by its socket already
+		if( f->wait == wait )
+			loop_wake(l,f,0);
+	}
+}
+
+/*
+	Suspends the running fiber of the loop until the socket [fd] is ready
+	for [events] or the timeout (in seconds, negative for none) expires.
+	Returns 1 if the socket is ready, 0 on timeout and LOOP_CLOSED if the
+	socket was closed meanwhile.
+*/
+#define LOOP_CLOSED	(-1)
+
+static int loop_wait( vloop *l, int fd, int events, double timeout ) {
+	lfiber *f = l->running;
+	if( fd >= l->nfds ) {
+		int size = l->nfds ? l->nfds : 64;
+		lfiber **r, **w;
+		while( size <= fd )
+			size <<= 1;
+		r = (lfiber**)alloc(sizeof(lfiber*) * size);
+		w = (lfiber**)alloc(sizeof(lfiber*) * size);
+		memcpy(r,l->readers,sizeof(lfiber*) * l->nfds);
+		memcpy(w,l->writers,sizeof(lfiber*) * l->nfds);
+		l->readers = r;
+		l->writers = w;
+		l->nfds = size;
+	}
+	if( fd >= 0 ) {
+		lfiber **slot = (events == LOOP_READ) ? &l->readers[fd] : &l->writers[fd];
+		if( *slot != NULL )
+			val_throw(alloc_string("Socket is already waited by another fiber"));
+		*slot = f;
+		loop_register(l,fd);
+		l->nwaits++;
+	}
+	f->fd = fd;
+	f->events = events;
+	if( ++l->waits == 0 )
+		l->waits = 1;
+	f->wait = l->waits;
+	if( timeout >= 0 )
+		timer_push(l,loop_time() + timeout,f);
+	neko_fiber_yield(val_null);
+	return f->result;
+}
+
+// called after an error : waits for the socket if it would block in a loop fiber
+static int loop_block( SOCKET s, int events ) {
+	vloop *l;
+	if( errno != EAGAIN && errno != EWOULDBLOCK )
+		return 0;
+	l = loop_active();
+	if( l == NULL )
+		return 0;
+	if( loop_wait(l,s,events,-1) == LOOP_CLOSED ) {
+		errno = EBADF;
+		return 0;
+	}
+	return 1;
+}
+
+// closing a socket removes it from epoll : wake up the fibers waiting for it
+static void loop_close( SOCKET s ) {
+	vloop *l = loop_current ? (vloop*)local_get(loop_current) : NULL;
+	if( l == NULL || (int)s < 0 || (int)s >= l->nfds )
+		return;
+	if( l->readers[s] )
+		loop_wake(l,l->readers[s],LOOP_CLOSED);
+	if( l->writers[s] )
+		loop_wake(l,l->writers[s],LOOP_CLOSED);
+}
+
+// loop fibers don't block the thread, even with blocking sockets
+static int loop_flags() {
+	return loop_active() ? MSG_DONTWAIT : 0;
+}
+
+static void loop_nonblocking( SOCKET s ) {
+	int rights;
+	if( loop_active() == NULL )
+		return;
+	rights = fcntl(s,F_GETFL);
+	if( rights != -1 && !(rights & O_NONBLOCK) )
+		fcntl(s,F_SETFL,rights | O_NONBLOCK);
+}
+
+#	define LOOP_BLOCK(s,events,label)	if( loop_block(val_sock(s),events) ) goto label
+#else
+#	define LOOP_BLOCK(s,events,label)
+#	define loop_flags()	0
+#	define loop_nonblocking(s)
+#	define loop_close(s)
+
+void socket_loop_init() {
+}
+#endif
+
 /**
 	socket_init : void -> void
 	<doc>
@@ -188,6 +507,7 @@ static value socket_new( value udp ) {
 **/
 static value socket_close( value o ) {
 	val_check_kind(o,k_socket);
+	loop_close(val_sock(o));
 	POSIX_LABEL(close_again);
 	if( closesocket(val_sock(o)) ) {
 		HANDLE_EINTR(close_again);
@@ -210,8 +530,9 @@ static value socket_send_char( value o, value v ) {
 		neko_error();
 	cc = (unsigned char)c;
 	POSIX_LABEL(send_char_again);
-	if( send(val_sock(o),&cc,1,MSG_NOSIGNAL) == SOCKET_ERROR ) {
+	if( send(val_sock(o),&cc,1,MSG_NOSIGNAL | loop_flags()) == SOCKET_ERROR ) {
 		HANDLE_EINTR(send_char_again);
+		LOOP_BLOCK(o,LOOP_WRITE,send_char_again);
 		return block_error();
 	}
 	return val_true;
@@ -234,9 +555,10 @@ static value socket_send( value o, value data, value pos, value len ) {
 	if( p < 0 || l < 0 || p > dlen || p + l > dlen )
 		neko_error();
 	POSIX_LABEL(send_again);
-	dlen = send(val_sock(o), val_string(data) + p , l, MSG_NOSIGNAL);
+	dlen = send(val_sock(o), val_string(data) + p , l, MSG_NOSIGNAL | loop_flags());
 	if( dlen == SOCKET_ERROR ) {
 		HANDLE_EINTR(send_again);
+		LOOP_BLOCK(o,LOOP_WRITE,send_again);
 		return block_error();
 	}
 	return alloc_int(dlen);
@@ -244,7 +566,7 @@ static value socket_send( value o, value data, value pos, value len ) {
 
 static void tmp_recv( void *_t ) {
 	sock_tmp *t = (sock_tmp*)_t;
-	t->ret = recv(t->sock,t->buf,t->size,MSG_NOSIGNAL);
+	t->ret = recv(t->sock,t->buf,t->size,t->flags);
 }
 
 /**
@@ -255,6 +577,7 @@ static void tmp_recv( void *_t ) {
 static value socket_recv( value o, value data, value pos, value len ) {
 	int p,l,dlen,ret;
 	int retry = 0;
+	int flags = MSG_NOSIGNAL | loop_flags();
 	val_check_kind(o,k_socket);
 	val_check(data,string);
 	val_check(pos,int);
@@ -270,12 +593,14 @@ static value socket_recv( value o, value data, value pos, value len ) {
 		t.sock = val_sock(o);
 		t.buf = val_string(data) + p;
 		t.size = l;
+		t.flags = flags;
 		neko_thread_blocking(tmp_recv,&t);
 		ret = t.ret;
 	} else
-		ret = recv(val_sock(o), val_string(data) + p , l, MSG_NOSIGNAL);
+		ret = recv(val_sock(o), val_string(data) + p , l, flags);
 	if( ret == SOCKET_ERROR ) {
 		HANDLE_EINTR(recv_again);
+		LOOP_BLOCK(o,LOOP_READ,recv_again);
 		return block_error();
 	}
 	return alloc_int(ret);
@@ -288,6 +613,7 @@ static value socket_recv( value o, value data, value pos, value len ) {
 static value socket_recv_char( value o ) {
 	int ret;
 	int retry = 0;
+	int flags = MSG_NOSIGNAL | loop_flags();
 	unsigned char cc;
 	val_check_kind(o,k_socket);
 	POSIX_LABEL(recv_char_again);
@@ -296,12 +622,14 @@ static value socket_recv_char( value o ) {
 		t.sock = val_sock(o);
 		t.buf = (char*)&cc;
 		t.size = 1;
+		t.flags = flags;
 		neko_thread_blocking(tmp_recv,&t);
 		ret = t.ret;
 	} else
-		ret = recv(val_sock(o),&cc,1,MSG_NOSIGNAL);
+		ret = recv(val_sock(o),&cc,1,flags);
 	if( ret == SOCKET_ERROR ) {
 		HANDLE_EINTR(recv_char_again);
+		LOOP_BLOCK(o,LOOP_READ,recv_char_again);
 		return block_error();
 	}
 	if( ret == 0 )
@@ -317,15 +645,17 @@ static value socket_recv_char( value o ) {
 static value socket_write( value o, value data ) {
 	const char *cdata;
 	int datalen, slen;
+	int flags = MSG_NOSIGNAL | loop_flags();
 	val_check_kind(o,k_socket);
 	val_check(data,string);
 	cdata = val_string(data);
 	datalen = val_strlen(data);
 	while( datalen > 0 ) {
 		POSIX_LABEL(write_again);
-		slen = send(val_sock(o),cdata,datalen,MSG_NOSIGNAL);
+		slen = send(val_sock(o),cdata,datalen,flags);
 		if( slen == SOCKET_ERROR ) {
 			HANDLE_EINTR(write_again);
+			LOOP_BLOCK(o,LOOP_WRITE,write_again);
 			return block_error();
 		}
 		cdata += slen;
@@ -345,13 +675,15 @@ static value socket_read( value o ) {
 	buffer b;
 	char buf[256];
 	int len;
+	int flags = MSG_NOSIGNAL | loop_flags();
 	val_check_kind(o,k_socket);
 	b = alloc_buffer(NULL);
 	while( true ) {
 		POSIX_LABEL(read_again);
-		len = recv(val_sock(o),buf,256,MSG_NOSIGNAL);
+		len = recv(val_sock(o),buf,256,flags);
 		if( len == SOCKET_ERROR ) {
 			HANDLE_EINTR(read_again);
+			LOOP_BLOCK(o,LOOP_READ,read_again);
 			return block_error();
 		}
 		if( len == 0 )
@@ -443,8 +775,22 @@ static value socket_connect( value o, value host, value port ) {
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(val_int(port));
 	*(int*)&addr.sin_addr.s_addr = val_int32(host);
-	if( connect(val_sock(o),(struct sockaddr*)&addr,sizeof(addr)) != 0 )
+	loop_nonblocking(val_sock(o));
+	if( connect(val_sock(o),(struct sockaddr*)&addr,sizeof(addr)) != 0 ) {
+#		ifndef NEKO_WINDOWS
+		vloop *l;
+		if( errno == EINPROGRESS && (l = loop_active()) != NULL ) {
+			int err = 0;
+			socklen_t len = sizeof(err);
+			if( loop_wait(l,val_sock(o),LOOP_WRITE,-1) == LOOP_CLOSED )
+				neko_error();
+			if( getsockopt(val_sock(o),SOL_SOCKET,SO_ERROR,&err,&len) != 0 || err != 0 )
+				neko_error();
+			return val_true;
+		}
+#		endif
 		return block_error();
+	}
 	return val_true;
 }
 
@@ -572,10 +918,12 @@ static value socket_accept( value o ) {
 	unsigned int addrlen = sizeof(addr);
 	SOCKET s;
 	val_check_kind(o,k_socket);
+	loop_nonblocking(val_sock(o));
 	POSIX_LABEL(accept_again);
 	s = accept(val_sock(o),(struct sockaddr*)&addr,&addrlen);
 	if( s == INVALID_SOCKET ) {
 		HANDLE_EINTR(accept_again);
+		LOOP_BLOCK(o,LOOP_READ,accept_again);
 		return block_error();
 	}
 	return alloc_abstract(k_socket,(value)(int_val)s);
@@ -926,9 +1274,10 @@ static value socket_send_to( value o, value data, value pos, value len, value va
 	if( p < 0 || l < 0 || p > dlen || p + l > dlen )
 		neko_error();
 	POSIX_LABEL(send_again);
-	dlen = sendto(val_sock(o), val_string(data) + p , l, MSG_NOSIGNAL, (struct sockaddr*)&addr, sizeof(addr));
+	dlen = sendto(val_sock(o), val_string(data) + p , l, MSG_NOSIGNAL | loop_flags(), (struct sockaddr*)&addr, sizeof(addr));
 	if( dlen == SOCKET_ERROR ) {
 		HANDLE_EINTR(send_again);
+		LOOP_BLOCK(o,LOOP_WRITE,send_again);
 		return block_error();
 	}
 	return alloc_int(dlen);
@@ -943,6 +1292,7 @@ static value socket_send_to( value o, value data, value pos, value len, value va
 static value socket_recv_from( value o, value data, value pos, value len, value addr ) {
 	int p,l,dlen,ret;
 	int retry = 0;
+	int flags = MSG_NOSIGNAL | loop_flags();
 	struct sockaddr_in saddr;
 	int slen = sizeof(saddr);
 	val_check_kind(o,k_socket);
@@ -961,12 +1311,14 @@ static value socket_recv_from( value o, value data, value pos, value len, value
 		t.sock = val_sock(o);
 		t.buf = val_string(data) + p;
 		t.size = l;
+		t.flags = flags;
 		neko_thread_blocking(tmp_recv,&t);
 		ret = t.ret;
 	} else
-		ret = recvfrom(val_sock(o), val_string(data) + p , l, MSG_NOSIGNAL, (struct sockaddr*)&saddr, &slen);
+		ret = recvfrom(val_sock(o), val_string(data) + p , l, flags, (struct sockaddr*)&saddr, &slen);
 	if( ret == SOCKET_ERROR ) {
 		HANDLE_EINTR(recv_from_again);
+		LOOP_BLOCK(o,LOOP_READ,recv_from_again);
 #ifdef	NEKO_WINDOWS
 		if( WSAGetLastError() == WSAECONNRESET )
 			ret = 0;
@@ -1203,6 +1555,224 @@ static value socket_epoll_wait(value e, value timeout) {
 #endif
 }
 
+static void free_loop( value v ) {
+#	ifdef HAS_EPOLL
+	close(val_loop(v)->epollfd);
+#	endif
+}
+
+static value loop_fiber_main( value v ) {
+	lfiber *f = (lfiber*)val_data(v);
+	value exc = NULL;
+	value ret = val_callEx(val_null,f->f,&f->param,1,&exc);
+	f->exc = exc;
+	return ret;
+}
+
+/**
+	socket_loop_alloc : void -> 'loop
+	<doc>
+	Allocate an event loop which runs fibers : the socket operations of
+	its fibers suspend them until the socket is ready instead of blocking
+	the thread or raising "Blocking".
+	</doc>
+**/
+static value socket_loop_alloc() {
+#ifdef NEKO_WINDOWS
+	neko_error();
+	return val_null;
+#else
+	value v;
+	vloop *l = (vloop*)alloc(sizeof(vloop));
+	memset(l,0,sizeof(vloop));
+	l->main = alloc_function(loop_fiber_main,1,"loop_fiber_main");
+#	ifdef HAS_EPOLL
+	l->epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if( l->epollfd < 0 )
+		neko_error();
+	l->events = (struct epoll_event*)alloc_private(sizeof(struct epoll_event) * LOOP_EVENTS);
+#	endif
+	v = alloc_abstract(k_loop,l);
+	val_gc(v,free_loop);
+	return v;
+#endif
+}
+
+/**
+	socket_loop_spawn : 'loop -> f:function:1 -> p:any -> 'fiber
+	<doc>Create a fiber running [f(p)] which will be started by [socket_loop_run]</doc>
+**/
+static value socket_loop_spawn( value lv, value f, value p ) {
+	vloop *l;
+	lfiber *lf;
+	val_check_kind(lv,k_loop);
+	val_check_function(f,1);
+#ifdef NEKO_WINDOWS
+	neko_error();
+	return val_null;
+#else
+	l = val_loop(lv);
+	lf = (lfiber*)alloc(sizeof(lfiber));
+	memset(lf,0,sizeof(lfiber));
+	lf->f = f;
+	lf->param = p;
+	lf->fd = -1;
+	lf->fiber = neko_fiber_alloc(l->main,0);
+	lf->arg = alloc_abstract(k_loop_fiber,lf);
+	loop_ready(l,lf);
+	l->count++;
+	return lf->fiber;
+#endif
+}
+
+/**
+	socket_loop_run : 'loop -> void
+	<doc>
+	Run the fibers of the loop until they have all returned. An exception
+	raised by a fiber stops the loop and is raised again, the other fibers
+	are resumed by the next [socket_loop_run].
+	</doc>
+**/
+static value socket_loop_run( value lv ) {
+#ifdef NEKO_WINDOWS
+	neko_error();
+#else
+	vloop *l, *prev;
+	val_check_kind(lv,k_loop);
+	l = val_loop(lv);
+	if( l->running != NULL )
+		neko_error();
+	prev = (vloop*)local_get(loop_current);
+	local_set(loop_current,l);
+	while( l->count > 0 ) {
+		int n = l->rcount;
+		int timeout = -1;
+		while( n-- > 0 ) {
+			lfiber *f = l->ready[l->rhead];
+			value arg = f->arg;
+			l->ready[l->rhead] = NULL;
+			l->rhead = (l->rhead + 1) % l->rsize;
+			l->rcount--;
+			f->arg = val_null;
+			l->running = f;
+			neko_fiber_resume(f->fiber,arg);
+			l->running = NULL;
+			if( neko_fiber_status(f->fiber) == NEKO_FIBER_DEAD ) {
+				l->count--;
+				if( f->exc != NULL ) {
+					local_set(loop_current,prev);
+					val_rethrow(f->exc);
+				}
+			} else if( f->wait == 0 )
+				// yielded by fiber_yield : run it again later
+				loop_ready(l,f);
+		}
+		if( l->count == 0 )
+			break;
+		if( l->rcount > 0 )
+			timeout = 0;
+		else if( l->ntimers > 0 ) {
+			double t = (l->timers[0].time - loop_time()) * 1000.0;
+			timeout = t <= 0 ? 0 : (int)t + 1;
+		} else if( l->nwaits == 0 )
+			// the remaining fibers are not waiting for anything of this loop
+			break;
+		loop_poll(l,timeout);
+		loop_timers(l);
+	}
+	local_set(loop_current,prev);
+#endif
+	return val_null;
+}
+
+/**
+	socket_loop_sleep : float -> void
+	<doc>
+	Suspend the current loop fiber for the given number of seconds. When
+	not called from a loop fiber, the thread sleeps.
+	</doc>
+**/
+static value socket_loop_sleep( value t ) {
+	val_check(t,number);
+#ifdef NEKO_WINDOWS
+	Sleep((DWORD)(val_number(t) * 1000));
+#else
+	{
+		vloop *l = loop_active();
+		if( l != NULL )
+			loop_wait(l,-1,0,val_number(t) < 0 ? 0 : val_number(t));
+		else {
+			struct timespec ts;
+			double d = val_number(t);
+			ts.tv_sec = (time_t)d;
+			ts.tv_nsec = (long)((d - ts.tv_sec) * 1e9);
+			while( nanosleep(&ts,&ts) != 0 && errno == EINTR ) {
+			}
+		}
+	}
+#endif
+	return val_null;
+}
+
+/**
+	socket_loop_wait : 'socket -> write:bool -> timeout:number? -> bool
+	<doc>
+	Wait until the socket is ready for reading or writing, returns false if
+	the [timeout] (in seconds) expires first. Only the current fiber is
+	suspended when called from a loop fiber.
+	</doc>
+**/
+static value socket_loop_wait( value o, value write, value timeout ) {
+	double t = -1;
+	val_check_kind(o,k_socket);
+	val_check(write,bool);
+	if( !val_is_null(timeout) ) {
+		val_check(timeout,number);
+		t = val_number(timeout);
+		if( t < 0 )
+			t = 0;
+	}
+#ifdef NEKO_WINDOWS
+	{
+		fd_set fds;
+		struct timeval tv;
+		FD_ZERO(&fds);
+		FD_SET(val_sock(o),&fds);
+		if( t >= 0 )
+			init_timeval(t,&tv);
+		switch( select(0,val_bool(write) ? NULL : &fds,val_bool(write) ? &fds : NULL,NULL,t >= 0 ? &tv : NULL) ) {
+		case SOCKET_ERROR:
+			neko_error();
+		case 0:
+			return val_false;
+		}
+		return val_true;
+	}
+#else
+	{
+		vloop *l = loop_active();
+		struct pollfd p;
+		int ret;
+		if( l != NULL ) {
+			ret = loop_wait(l,val_sock(o),val_bool(write) ? LOOP_WRITE : LOOP_READ,t);
+			if( ret == LOOP_CLOSED )
+				neko_error();
+			return alloc_bool(ret);
+		}
+		p.fd = val_sock(o);
+		p.events = val_bool(write) ? POLLOUT : POLLIN;
+		p.revents = 0;
+		POSIX_LABEL(wait_again);
+		ret = poll(&p,1,t < 0 ? -1 : (int)(t * 1000));
+		if( ret < 0 ) {
+			HANDLE_EINTR(wait_again);
+			neko_error();
+		}
+		return alloc_bool(ret > 0);
+	}
+#endif
+}
+
 DEFINE_PRIM(socket_init,0);
 DEFINE_PRIM(socket_new,1);
 DEFINE_PRIM(socket_send,4);
@@ -1240,6 +1810,12 @@ DEFINE_PRIM(socket_epoll_register,3);
 DEFINE_PRIM(socket_epoll_unregister,2);
 DEFINE_PRIM(socket_epoll_wait,2);
 
+DEFINE_PRIM(socket_loop_alloc,0);
+DEFINE_PRIM(socket_loop_spawn,3);
+DEFINE_PRIM(socket_loop_run,1);
+DEFINE_PRIM(socket_loop_sleep,1);
+DEFINE_PRIM(socket_loop_wait,3);
+
 DEFINE_PRIM(host_local,0);
 DEFINE_PRIM(host_resolve,1);
 DEFINE_PRIM(host_to_string,1);
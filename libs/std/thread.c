@@ -33,6 +33,11 @@
 #else
 #	include <pthread.h>
 #	include <sys/time.h>
+#	include <unistd.h>
+#	ifdef NEKO_LINUX
+#		include <sys/syscall.h>
+#		include <linux/futex.h>
+#	endif
 	typedef struct _vlock {
 		pthread_mutex_t lock;
 		pthread_cond_t cond;
@@ -57,6 +62,40 @@ typedef struct {
 #	endif
 } vdeque;
 
+/*
+	bounded lock-free MPMC ring : each cell carries a sequence number telling
+	if it is ready to be written (seq == pos) or read (seq == pos + 1) for
+	the lap at [pos]. Threads only sleep when the ring is empty or full.
+*/
+typedef struct {
+	volatile int sleeping;
+#	ifdef NEKO_LINUX
+#	elif defined(NEKO_WINDOWS)
+	SRWLOCK lock;
+	CONDITION_VARIABLE cond;
+#	else
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#	endif
+} vfutex;
+
+typedef struct {
+	volatile unsigned int seq;
+	value msg;
+} qcell;
+
+typedef struct {
+	qcell *cells;
+	int mask;
+	char pad0[64];
+	volatile unsigned int head;
+	char pad1[64];
+	volatile unsigned int tail;
+	char pad2[64];
+	vfutex not_empty;
+	vfutex not_full;
+} vqueue;
+
 typedef struct {
 #	ifdef NEKO_WINDOWS
 	DWORD tid;
@@ -64,13 +103,16 @@ typedef struct {
 	pthread_t phandle;
 #	endif
 	value v;
+	vqueue mq;
 	vdeque q;
+	volatile int overflow;
 	neko_vm *vm;
 } vthread;
 
 DECLARE_KIND(k_thread);
 
 #define val_thread(t)	((vthread*)val_data(t))
+#define MAILBOX_SIZE	1024
 
 #ifdef NEKO_WINDOWS
 #	define LOCK(l)		EnterCriticalSection(&(l))
@@ -82,6 +124,22 @@ DECLARE_KIND(k_thread);
 #	define SIGNAL(l)	pthread_cond_signal(&(l))
 #endif
 
+#ifdef NEKO_WINDOWS
+#	define ATOMIC_ADD(p,v)		InterlockedExchangeAdd((volatile LONG*)(p),(v))
+#	define ATOMIC_CAS(p,o,v)	(InterlockedCompareExchange((volatile LONG*)(p),(v),(o)) == (o))
+#	define ATOMIC_XCHG(p,v)		InterlockedExchange((volatile LONG*)(p),(v))
+#	define ATOMIC_LOAD(p)		(*(p))
+#	define ATOMIC_STORE(p,v)	(*(p) = (v))
+#	define ATOMIC_FENCE()		MemoryBarrier()
+#else
+#	define ATOMIC_ADD(p,v)		__sync_fetch_and_add((p),(v))
+#	define ATOMIC_CAS(p,o,v)	__sync_bool_compare_and_swap((p),(o),(v))
+#	define ATOMIC_XCHG(p,v)		__atomic_exchange_n((p),(v),__ATOMIC_SEQ_CST)
+#	define ATOMIC_LOAD(p)		__atomic_load_n((p),__ATOMIC_ACQUIRE)
+#	define ATOMIC_STORE(p,v)	__atomic_store_n((p),(v),__ATOMIC_RELEASE)
+#	define ATOMIC_FENCE()		__sync_synchronize()
+#endif
+
 /*
 	deque raw API
 */
@@ -159,6 +217,219 @@ static value _deque_pop( vdeque *q, int block ) {
 	return msg;
 }
 
+/*
+	queue raw API
+*/
+static void _futex_init( vfutex *f ) {
+	f->sleeping = 0;
+#	ifdef NEKO_LINUX
+#	elif defined(NEKO_WINDOWS)
+	InitializeSRWLock(&f->lock);
+	InitializeConditionVariable(&f->cond);
+#	else
+	pthread_mutex_init(&f->lock,NULL);
+	pthread_cond_init(&f->cond,NULL);
+#	endif
+}
+
+static void _futex_destroy( vfutex *f ) {
+#	if !defined(NEKO_LINUX) && !defined(NEKO_WINDOWS)
+	pthread_mutex_destroy(&f->lock);
+	pthread_cond_destroy(&f->cond);
+#	endif
+}
+
+/*
+	a thread about to sleep sets [sleeping], checks its condition again
+	then waits until a wake clears it : the first wake after that is the
+	only one paying for a system call. Waiters can return early and must
+	check their condition again.
+*/
+static void _futex_prepare( vfutex *f ) {
+	ATOMIC_XCHG(&f->sleeping,1);
+}
+
+static void _futex_wait( vfutex *f ) {
+#	ifdef NEKO_LINUX
+	syscall(SYS_futex,&f->sleeping,FUTEX_WAIT_PRIVATE,1,NULL,NULL,0);
+#	elif defined(NEKO_WINDOWS)
+	AcquireSRWLockExclusive(&f->lock);
+	if( f->sleeping )
+		SleepConditionVariableSRW(&f->cond,&f->lock,INFINITE,0);
+	ReleaseSRWLockExclusive(&f->lock);
+#	else
+	pthread_mutex_lock(&f->lock);
+	if( f->sleeping )
+		pthread_cond_wait(&f->cond,&f->lock);
+	pthread_mutex_unlock(&f->lock);
+#	endif
+}
+
+static void _futex_wake( vfutex *f ) {
+	ATOMIC_FENCE();
+	if( !f->sleeping || !ATOMIC_XCHG(&f->sleeping,0) )
+		return;
+#	ifdef NEKO_LINUX
+	syscall(SYS_futex,&f->sleeping,FUTEX_WAKE_PRIVATE,0x7FFFFFFF,NULL,NULL,0);
+#	elif defined(NEKO_WINDOWS)
+	AcquireSRWLockExclusive(&f->lock);
+	WakeAllConditionVariable(&f->cond);
+	ReleaseSRWLockExclusive(&f->lock);
+#	else
+	pthread_mutex_lock(&f->lock);
+	pthread_cond_broadcast(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+#	endif
+}
+
+static void _queue_init( vqueue *q, int size ) {
+	int i, n = 2;
+	while( n < size )
+		n <<= 1;
+	q->cells = (qcell*)alloc(sizeof(qcell) * n);
+	for(i=0;i<n;i++) {
+		q->cells[i].seq = i;
+		q->cells[i].msg = NULL;
+	}
+	q->mask = n - 1;
+	q->head = 0;
+	q->tail = 0;
+	_futex_init(&q->not_empty);
+	_futex_init(&q->not_full);
+}
+
+static void _queue_destroy( vqueue *q ) {
+	_futex_destroy(&q->not_empty);
+	_futex_destroy(&q->not_full);
+}
+
+static bool _queue_try_add( vqueue *q, value msg ) {
+	unsigned int pos = q->head;
+	qcell *c;
+	while( true ) {
+		int d;
+		c = q->cells + (pos & q->mask);
+		d = (int)(ATOMIC_LOAD(&c->seq) - pos);
+		if( d == 0 ) {
+			if( ATOMIC_CAS(&q->head,pos,pos + 1) )
+				break;
+			pos = q->head;
+		} else if( d < 0 )
+			return false;
+		else
+			pos = q->head;
+	}
+	c->msg = msg;
+	ATOMIC_STORE(&c->seq,pos + 1);
+	return true;
+}
+
+static bool _queue_try_pop( vqueue *q, value *msg ) {
+	unsigned int pos = q->tail;
+	qcell *c;
+	while( true ) {
+		int d;
+		c = q->cells + (pos & q->mask);
+		d = (int)(ATOMIC_LOAD(&c->seq) - (pos + 1));
+		if( d == 0 ) {
+			if( ATOMIC_CAS(&q->tail,pos,pos + 1) )
+				break;
+			pos = q->tail;
+		} else if( d < 0 )
+			return false;
+		else
+			pos = q->tail;
+	}
+	*msg = c->msg;
+	c->msg = NULL;
+	ATOMIC_STORE(&c->seq,pos + q->mask + 1);
+	return true;
+}
+
+static bool _queue_add( vqueue *q, value msg, bool block ) {
+	while( !_queue_try_add(q,msg) ) {
+		if( !block )
+			return false;
+		_futex_prepare(&q->not_full);
+		if( _queue_try_add(q,msg) )
+			break;
+		_futex_wait(&q->not_full);
+	}
+	_futex_wake(&q->not_empty);
+	return true;
+}
+
+static bool _queue_pop( vqueue *q, value *msg, bool block ) {
+	while( !_queue_try_pop(q,msg) ) {
+		if( !block )
+			return false;
+		_futex_prepare(&q->not_empty);
+		if( _queue_try_pop(q,msg) )
+			break;
+		_futex_wait(&q->not_empty);
+	}
+	_futex_wake(&q->not_full);
+	return true;
+}
+
+/*
+	thread messages go through the ring, and only spill into the
+	locked deque while it is full. Once a message has spilled, the next
+	ones also go to the deque until it has been emptied, which keeps the
+	messages of each sender in order.
+*/
+static void _mailbox_add( vthread *t, value msg ) {
+	tqueue *m;
+	if( t->overflow == 0 && _queue_try_add(&t->mq,msg) ) {
+		_futex_wake(&t->mq.not_empty);
+		return;
+	}
+	m = (tqueue*)alloc(sizeof(tqueue));
+	m->msg = msg;
+	m->next = NULL;
+	LOCK(t->q.lock);
+	if( t->q.last == NULL )
+		t->q.first = m;
+	else
+		t->q.last->next = m;
+	t->q.last = m;
+	t->overflow++;
+	UNLOCK(t->q.lock);
+	_futex_wake(&t->mq.not_empty);
+}
+
+static bool _mailbox_try_pop( vthread *t, value *msg ) {
+	bool found = false;
+	if( _queue_try_pop(&t->mq,msg) )
+		return true;
+	if( ATOMIC_LOAD(&t->overflow) == 0 )
+		return false;
+	LOCK(t->q.lock);
+	if( t->q.first != NULL ) {
+		*msg = t->q.first->msg;
+		t->q.first = t->q.first->next;
+		if( t->q.first == NULL )
+			t->q.last = NULL;
+		t->overflow--;
+		found = true;
+	}
+	UNLOCK(t->q.lock);
+	return found;
+}
+
+static value _mailbox_pop( vthread *t, bool block ) {
+	value msg;
+	while( !_mailbox_try_pop(t,&msg) ) {
+		if( !block )
+			return val_null;
+		_futex_prepare(&t->mq.not_empty);
+		if( _mailbox_try_pop(t,&msg) )
+			break;
+		_futex_wait(&t->mq.not_empty);
+	}
+	return msg;
+}
+
 
 /**
 	<doc>
@@ -173,6 +444,7 @@ static value _deque_pop( vdeque *q, int block ) {
 #define val_tls(l)		((vtls*)val_data(l))
 #define val_mutex(l)	((mt_lock*)val_data(l))
 #define val_deque(l)	((vdeque*)val_data(l))
+#define val_queue(l)	((vqueue*)val_data(l))
 
 typedef struct {
 #	ifdef NEKO_WINDOWS
@@ -187,6 +459,7 @@ DEFINE_KIND(k_lock);
 DEFINE_KIND(k_tls);
 DEFINE_KIND(k_mutex);
 DEFINE_KIND(k_deque);
+DEFINE_KIND(k_queue);
 
 typedef struct {
 	value callb;
@@ -203,6 +476,7 @@ static vthread *neko_thread_current() {
 static void free_thread( value v ) {
 	vthread *t = val_thread(v);
 	_deque_destroy(&t->q);
+	_queue_destroy(&t->mq);
 }
 
 static vthread *alloc_thread( neko_vm *vm ) {
@@ -216,6 +490,7 @@ static vthread *alloc_thread( neko_vm *vm ) {
 	t->v = alloc_abstract(k_thread,t);
 	t->vm = vm;
 	_deque_init(&t->q);
+	_queue_init(&t->mq,MAILBOX_SIZE);
 	val_gc(t->v,free_thread);
 	return t;
 }
@@ -287,7 +562,7 @@ static value thread_send( value vt, value msg ) {
 	vthread *t;
 	val_check_kind(vt,k_thread);
 	t = val_thread(vt);
-	_deque_add(&t->q,msg);
+	_mailbox_add(t,msg);
 	return val_null;
 }
 
@@ -307,7 +582,7 @@ static value thread_read_message( value block ) {
 		neko_error();
 	t = val_thread(v);
 	val_check(block,bool);
-	return _deque_pop( &t->q, val_bool(block) );
+	return _mailbox_pop(t,val_bool(block));
 }
 
 /**
@@ -628,6 +903,60 @@ static value deque_pop( value v, value block ) {
 	return _deque_pop(val_deque(v),val_bool(block));
 }
 
+static void free_queue( value v ) {
+	_queue_destroy(val_queue(v));
+}
+
+/**
+	queue_create : size:int -> 'queue
+	<doc>
+	Create a bounded message queue holding up to [size] messages (rounded up
+	to a power of two). Adding and popping messages is lock-free, threads
+	only sleep while the queue is full or empty.
+	</doc>
+**/
+static value queue_create( value size ) {
+	vqueue *q;
+	value v;
+	val_check(size,int);
+	if( val_int(size) <= 0 || val_int(size) > (1 << 28) )
+		neko_error();
+	q = (vqueue*)alloc(sizeof(vqueue));
+	v = alloc_abstract(k_queue,q);
+	val_gc(v,free_queue);
+	_queue_init(q,val_int(size));
+	return v;
+}
+
+/**
+	queue_add : 'queue -> any -> block:bool -> bool
+	<doc>
+	Add a message at the end of the queue. If the queue is full, either block
+	until there is room for it or return immediately with false.
+	</doc>
+**/
+static value queue_add( value v, value msg, value block ) {
+	val_check_kind(v,k_queue);
+	val_check(block,bool);
+	return alloc_bool(_queue_add(val_queue(v),msg,val_bool(block)));
+}
+
+/**
+	queue_pop : 'queue -> block:bool -> any?
+	<doc>
+	Pop a message from the queue head. Either block until a message is
+	available or return immediately with null.
+	</doc>
+**/
+static value queue_pop( value v, value block ) {
+	value msg;
+	val_check_kind(v,k_queue);
+	val_check(block,bool);
+	if( !_queue_pop(val_queue(v),&msg,val_bool(block)) )
+		return val_null;
+	return msg;
+}
+
 DEFINE_PRIM(thread_create,2);
 DEFINE_PRIM(thread_current,0);
 DEFINE_PRIM(thread_send,2);
@@ -652,6 +981,10 @@ DEFINE_PRIM(deque_add,2);
 DEFINE_PRIM(deque_push,2);
 DEFINE_PRIM(deque_pop,2);
 
+DEFINE_PRIM(queue_create,1);
+DEFINE_PRIM(queue_add,3);
+DEFINE_PRIM(queue_pop,2);
+
 typedef struct {
 #ifdef NEKO_WINDOWS
   SRWLOCK lock;
@@ -928,4 +1261,323 @@ static value semaphore_release(value s) {
 DEFINE_PRIM(semaphore_create, 1)
 DEFINE_PRIM(semaphore_acquire, 1)
 DEFINE_PRIM(semaphore_try_acquire, 2)
-DEFINE_PRIM(semaphore_release, 1)
\ No newline at end of file
+DEFINE_PRIM(semaphore_release, 1)
+
+// ---------------------------------------- THREAD POOL ----------------
+
+/*
+	Each worker is a registered thread with its own VM and task deque.
+	A worker pops its own tasks from the bottom and steals from the top of
+	the other deques when it runs out of work. Tasks submitted by a worker
+	go to its own deque, other submissions are spread over the workers.
+	The pending/sleepers/waiters counters are atomic so that the pool
+	conditions are only taken when some thread is actually sleeping.
+*/
+
+typedef struct _vpool vpool;
+
+typedef struct {
+	vpool *pool;
+	value f;
+	value result;
+	value exc;
+	volatile int done;
+} vfuture;
+
+typedef struct {
+	vpool *pool;
+	int id;
+	int jit;
+	value *tasks;
+	int head;
+	int count;
+	int size;
+	vcondition lock;
+} vworker;
+
+struct _vpool {
+	vworker **workers;
+	int nworkers;
+	volatile int next;
+	volatile int pending;
+	volatile int sleepers;
+	volatile int waiters;
+	volatile int stop;
+	vcondition work;
+	vcondition done;
+};
+
+DEFINE_KIND(k_pool);
+DEFINE_KIND(k_future);
+DEFINE_KIND(k_worker);
+
+#define val_pool(v)		((vpool*)val_data(v))
+#define val_future(v)	((vfuture*)val_data(v))
+
+static void worker_push( vworker *w, value t ) {
+	_cond_acquire(&w->lock);
+	if( w->count == w->size ) {
+		int i;
+		int size = w->size ? w->size * 2 : 64;
+		value *tasks = (value*)alloc(sizeof(value) * size);
+		for(i=0;i<w->count;i++)
+			tasks[i] = w->tasks[(w->head + i) % w->size];
+		w->tasks = tasks;
+		w->head = 0;
+		w->size = size;
+	}
+	w->tasks[(w->head + w->count++) % w->size] = t;
+	_cond_release(&w->lock);
+}
+
+static value worker_take( vworker *w, bool steal ) {
+	value t = NULL;
+	int i;
+	if( w->count == 0 )
+		return NULL;
+	_cond_acquire(&w->lock);
+	if( w->count > 0 ) {
+		if( steal ) {
+			i = w->head;
+			w->head = (w->head + 1) % w->size;
+		} else
+			i = (w->head + w->count - 1) % w->size;
+		t = w->tasks[i];
+		w->tasks[i] = NULL;
+		w->count--;
+	}
+	_cond_release(&w->lock);
+	return t;
+}
+
+static value pool_take( vpool *p, vworker *w ) {
+	value t;
+	int i;
+	if( p->pending == 0 )
+		return NULL;
+	if( (t = worker_take(w,false)) != NULL )
+		return t;
+	for(i=1;i<p->nworkers;i++)
+		if( (t = worker_take(p->workers[(w->id + i) % p->nworkers],true)) != NULL )
+			return t;
+	return NULL;
+}
+
+static void pool_run( vpool *p, value t ) {
+	vfuture *f = val_future(t);
+	value exc = NULL;
+	ATOMIC_ADD(&p->pending,-1);
+	f->result = val_callEx(val_null,f->f,NULL,0,&exc);
+	f->exc = exc;
+	f->f = val_null;
+	ATOMIC_ADD(&f->done,1);
+	if( p->waiters > 0 ) {
+		_cond_acquire(&p->done);
+		_cond_broadcast(&p->done);
+		_cond_release(&p->done);
+	}
+}
+
+static vworker *pool_worker( vpool *p ) {
+	vworker *w = (vworker*)neko_vm_custom(neko_vm_current(),k_worker);
+	return (w != NULL && w->pool == p) ? w : NULL;
+}
+
+static void worker_init( void *_w ) {
+	vworker *w = (vworker*)_w;
+	neko_vm *vm = neko_vm_alloc(NULL);
+	neko_vm_jit(vm,w->jit);
+	neko_vm_select(vm);
+	neko_vm_set_custom(vm,k_thread,alloc_thread(vm));
+	neko_vm_set_custom(vm,k_worker,w);
+}
+
+static void worker_loop( void *_w ) {
+	vworker *w = (vworker*)_w;
+	vpool *p = w->pool;
+	bool stop = false;
+	while( !stop ) {
+		value t = pool_take(p,w);
+		if( t != NULL ) {
+			pool_run(p,t);
+			continue;
+		}
+		_cond_acquire(&p->work);
+		ATOMIC_ADD(&p->sleepers,1);
+		while( p->pending == 0 && !p->stop )
+			_cond_wait(&p->work);
+		ATOMIC_ADD(&p->sleepers,-1);
+		stop = p->stop && p->pending == 0;
+		_cond_release(&p->work);
+	}
+	neko_vm_select(NULL);
+}
+
+/**
+	pool_create : nthreads:int? -> 'pool
+	<doc>
+	Creates a pool of [nthreads] worker threads, or one per CPU if [null],
+	which will run the tasks given to [pool_submit]. The workers keep
+	running until [pool_close] is called.
+	</doc>
+**/
+static value pool_create( value n ) {
+	vpool *p;
+	int i, nworkers;
+	if( val_is_null(n) ) {
+#		ifdef NEKO_WINDOWS
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		nworkers = (int)info.dwNumberOfProcessors;
+#		else
+		nworkers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#		endif
+	} else {
+		val_check(n,int);
+		nworkers = val_int(n);
+	}
+	if( nworkers <= 0 )
+		nworkers = 1;
+	p = (vpool*)alloc(sizeof(vpool));
+	memset(p,0,sizeof(vpool));
+	_cond_init(&p->work);
+	_cond_init(&p->done);
+	p->nworkers = nworkers;
+	p->workers = (vworker**)alloc(sizeof(vworker*) * nworkers);
+	for(i=0;i<nworkers;i++) {
+		vworker *w = (vworker*)alloc(sizeof(vworker));
+		memset(w,0,sizeof(vworker));
+		w->pool = p;
+		w->id = i;
+		w->jit = neko_vm_jit(neko_vm_current(),-1);
+		_cond_init(&w->lock);
+		p->workers[i] = w;
+	}
+	for(i=0;i<nworkers;i++) {
+		void *handle;
+		if( !neko_thread_create(worker_init,worker_loop,p->workers[i],&handle) )
+			neko_error();
+	}
+	return alloc_abstract(k_pool,p);
+}
+
+/**
+	pool_submit : 'pool -> f:function:0 -> 'future
+	<doc>
+	Queues the call [f()] to be run by one of the pool workers and returns
+	the future of its result.
+	</doc>
+**/
+static value pool_submit( value vp, value f ) {
+	vpool *p;
+	vworker *w;
+	vfuture *fut;
+	value t;
+	val_check_kind(vp,k_pool);
+	val_check_function(f,0);
+	p = val_pool(vp);
+	fut = (vfuture*)alloc(sizeof(vfuture));
+	fut->pool = p;
+	fut->f = f;
+	fut->result = val_null;
+	fut->exc = NULL;
+	fut->done = 0;
+	t = alloc_abstract(k_future,fut);
+	w = pool_worker(p);
+	if( w == NULL ) {
+		// under the lock, so that no task is queued after the workers exited
+		_cond_acquire(&p->work);
+		if( p->stop ) {
+			_cond_release(&p->work);
+			neko_error();
+		}
+		worker_push(p->workers[(unsigned int)ATOMIC_ADD(&p->next,1) % p->nworkers],t);
+		ATOMIC_ADD(&p->pending,1);
+		if( p->sleepers > 0 )
+			_cond_signal(&p->work);
+		_cond_release(&p->work);
+	} else {
+		worker_push(w,t);
+		ATOMIC_ADD(&p->pending,1);
+		if( p->sleepers > 0 ) {
+			_cond_acquire(&p->work);
+			_cond_signal(&p->work);
+			_cond_release(&p->work);
+		}
+	}
+	// workers blocked in future_wait can run it too
+	if( p->waiters > 0 ) {
+		_cond_acquire(&p->done);
+		_cond_broadcast(&p->done);
+		_cond_release(&p->done);
+	}
+	return t;
+}
+
+/**
+	pool_close : 'pool -> void
+	<doc>
+	Stops the pool : the workers exit once all the pending tasks have been
+	run. From then on [pool_submit] fails unless it is called by one of the
+	pool workers. Does not wait for the workers.
+	</doc>
+**/
+static value pool_close( value vp ) {
+	vpool *p;
+	val_check_kind(vp,k_pool);
+	p = val_pool(vp);
+	_cond_acquire(&p->work);
+	p->stop = 1;
+	_cond_broadcast(&p->work);
+	_cond_release(&p->work);
+	return val_null;
+}
+
+/**
+	future_done : 'future -> bool
+	<doc>Tells if the task of the future has completed</doc>
+**/
+static value future_done( value v ) {
+	val_check_kind(v,k_future);
+	return alloc_bool(val_future(v)->done);
+}
+
+/**
+	future_wait : 'future -> any
+	<doc>
+	Waits for the task of the future to complete and returns its result,
+	or raises again the exception of the task. When called from one of
+	the pool workers, other tasks are run while waiting.
+	</doc>
+**/
+static value future_wait( value v ) {
+	vfuture *f;
+	vpool *p;
+	vworker *w;
+	val_check_kind(v,k_future);
+	f = val_future(v);
+	p = f->pool;
+	w = pool_worker(p);
+	while( !f->done ) {
+		value t = w ? pool_take(p,w) : NULL;
+		if( t != NULL ) {
+			pool_run(p,t);
+			continue;
+		}
+		_cond_acquire(&p->done);
+		ATOMIC_ADD(&p->waiters,1);
+		while( !f->done && (w == NULL || p->pending == 0) )
+			_cond_wait(&p->done);
+		ATOMIC_ADD(&p->waiters,-1);
+		_cond_release(&p->done);
+	}
+	if( f->exc != NULL )
+		val_rethrow(f->exc);
+	return f->result;
+}
+
+DEFINE_PRIM(pool_create,1);
+DEFINE_PRIM(pool_submit,2);
+DEFINE_PRIM(pool_close,1);
+DEFINE_PRIM(future_done,1);
+DEFINE_PRIM(future_wait,1);
@@ -21,6 +21,7 @@
  */
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include "neko.h"
 #include "objtable.h"
 #include "opcodes.h"
@@ -30,6 +31,11 @@
 
 #ifdef NEKO_POSIX
 #	include <signal.h>
+#	include <sys/time.h>
+#	include <unistd.h>
+#endif
+#ifdef NEKO_WINDOWS
+#	include <windows.h>
 #endif
 
 #ifdef NEKO_WINDOWS
@@ -58,6 +64,33 @@
 #define gc_alloc_root		GC_MALLOC_UNCOLLECTABLE
 #define gc_free_root		GC_FREE
 
+#ifdef GC_NEXT
+// small blocks are taken from per-VM lists of cells allocated in batch
+// by GC_malloc_many, which saves taking the GC lock for each allocation
+#define CELL_SIZE	(2 * sizeof(void*))
+
+static void *alloc_cell( unsigned int nbytes ) {
+	unsigned int k = (nbytes + CELL_SIZE - 1) / CELL_SIZE;
+	neko_vm *vm;
+	void *c;
+	if( k == 0 || k > NEKO_CELL_CLASSES || (vm = NEKO_VM()) == NULL )
+		return gc_alloc_big(nbytes);
+	c = vm->cells[--k];
+	if( c == NULL ) {
+		c = GC_malloc_many((k + 1) * CELL_SIZE);
+		if( c == NULL )
+			failure("out of memory");
+		vm->cell_refills++;
+	}
+	vm->cells[k] = GC_NEXT(c);
+	GC_NEXT(c) = NULL;
+	vm->cell_allocs++;
+	return c;
+}
+#else
+#	define alloc_cell		gc_alloc_big
+#endif
+
 typedef struct _klist {
 	const char *name;
 	vkind k;
@@ -68,8 +101,9 @@ static int_val op_last = Last;
 static value *apply_string = NULL;
 int_val *callback_return = &op_last;
 value *neko_builtins = NULL;
-objtable *neko_fields = NULL;
 mt_lock *neko_fields_lock = NULL;
+mt_lock *neko_verify_lock = NULL;
+mt_lock *neko_tier_lock = NULL;
 mt_local *neko_vm_context = NULL;
 static val_type t_null = VAL_NULL;
 static val_type t_true = VAL_BOOL;
@@ -108,6 +142,83 @@ static void handle_signal( int signal ) {
 }
 #endif
 
+#if GC_VERSION_MAJOR > 7 || (GC_VERSION_MAJOR == 7 && GC_VERSION_MINOR >= 6)
+#	define GC_PAUSE_EVENTS
+#endif
+
+#if GC_VERSION_MAJOR >= 8
+#	define GC_STACK_SWITCH
+#	include "gc/gc_mark.h"
+#endif
+
+// bucket 0 counts the pauses under 1ms, bucket i the pauses in
+// [2^(i-1),2^i[ ms and the last one all the longer pauses
+static int gc_pauses[NEKO_GC_PAUSE_BUCKETS];
+static int gc_pause_max = 0;
+
+#ifdef GC_PAUSE_EVENTS
+static double gc_pause_start = 0.;
+
+// in microseconds ; only the pause deltas are stored as int
+static double gc_timer() {
+#	ifdef NEKO_WINDOWS
+	LARGE_INTEGER t, freq;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart * 1000000. / (double)freq.QuadPart;
+#	else
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	return (double)tv.tv_sec * 1000000. + (double)tv.tv_usec;
+#	endif
+}
+
+// called with the GC lock held
+static void gc_event( GC_EventType e ) {
+	int t, ms, b;
+	switch( e ) {
+	case GC_EVENT_PRE_STOP_WORLD:
+		gc_pause_start = gc_timer();
+		break;
+	case GC_EVENT_POST_START_WORLD:
+		t = (int)(gc_timer() - gc_pause_start);
+		if( t > gc_pause_max )
+			gc_pause_max = t;
+		ms = t / 1000;
+		b = 0;
+		while( ms && b < NEKO_GC_PAUSE_BUCKETS - 1 ) {
+			ms >>= 1;
+			b++;
+		}
+		gc_pauses[b]++;
+		break;
+	default:
+		break;
+	}
+}
+#endif
+
+#ifdef GC_STACK_SWITCH
+// the stacks which are not running (protected by the GC lock)
+static neko_stack *gc_stacks = NULL;
+static GC_push_other_roots_proc gc_push_prev = NULL;
+
+static void gc_push_stacks() {
+	neko_stack *s = gc_stacks;
+	while( s != NULL ) {
+		GC_push_all(s->lo,s->hi);
+		s = s->next;
+	}
+	if( gc_push_prev )
+		gc_push_prev();
+}
+#endif
+
+static int gc_env_int( const char *name, int def ) {
+	char *v = getenv(name);
+	return (v == NULL || *v == 0) ? def : atoi(v);
+}
+
 static void null_warn_proc( char *msg, int arg ) {
 #	ifdef GC_LOG
 	printf(msg,arg);
@@ -116,7 +227,21 @@ static void null_warn_proc( char *msg, int arg ) {
 #	endif
 }
 
+/*
+	The collection mode can be selected with environment variables :
+	NEKO_GC_INCREMENTAL=1 enables incremental collection, NEKO_GC_PAUSE
+	sets its target pause time in ms (and enables it) and NEKO_GC_MARKERS
+	sets the number of parallel marker threads (libgc 8.2 and later, older
+	versions read GC_MARKERS themselves).
+*/
 void neko_gc_init() {
+	int pause = gc_env_int("NEKO_GC_PAUSE",0);
+	int incremental = gc_env_int("NEKO_GC_INCREMENTAL",0) || pause > 0;
+#	if GC_VERSION_MAJOR > 8 || (GC_VERSION_MAJOR == 8 && GC_VERSION_MINOR >= 2)
+	int markers = gc_env_int("NEKO_GC_MARKERS",0);
+	if( markers > 0 )
+		GC_set_markers_count(markers);
+#	endif
 #ifdef NEKO_JIT_ENABLE
 	GC_set_pages_executable(1);
 #endif
@@ -139,6 +264,18 @@ void neko_gc_init() {
 	GC_dont_expand = 1;
 #endif
 	GC_clear_roots();
+#ifdef GC_PAUSE_EVENTS
+	GC_set_on_collection_event(gc_event);
+#endif
+#ifdef GC_STACK_SWITCH
+	gc_push_prev = GC_get_push_other_roots();
+	GC_set_push_other_roots(gc_push_stacks);
+#endif
+	if( incremental ) {
+		if( pause > 0 )
+			GC_set_time_limit(pause);
+		GC_enable_incremental();
+	}
 #if defined(GC_LOG) && defined(NEKO_POSIX)
 	{
 		struct sigaction act;
@@ -159,13 +296,97 @@ EXTERN void neko_gc_major() {
 	GC_gcollect();
 }
 
+/*
+	fork() keeping the collector usable in the child : this is left to the
+	atfork handlers of the GC, which embedders forking on their own rely on.
+*/
+EXTERN int neko_gc_fork() {
+#ifdef NEKO_POSIX
+	return fork();
+#else
+	return -1;
+#endif
+}
+
+/*
+	Switching the C stack of a thread (see fiber.c) : the switch is done with
+	the GC lock held, the thread stack bottom is moved to the new stack and
+	the stacks which are not running are added as extra roots.
+*/
+int neko_gc_can_switch() {
+#ifdef GC_STACK_SWITCH
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void neko_gc_lock() {
+#ifdef GC_STACK_SWITCH
+	GC_alloc_lock();
+#endif
+}
+
+void neko_gc_unlock() {
+#ifdef GC_STACK_SWITCH
+	GC_alloc_unlock();
+#endif
+}
+
+void *neko_gc_stack_bottom( void *bottom ) {
+#ifdef GC_STACK_SWITCH
+	struct GC_stack_base sb;
+	void *h = GC_get_my_stackbottom(&sb);
+	void *prev = sb.mem_base;
+	if( bottom != NULL ) {
+		sb.mem_base = bottom;
+		GC_set_stackbottom(h,&sb);
+	}
+	return prev;
+#else
+	return NULL;
+#endif
+}
+
+void neko_gc_add_stack( neko_stack *s ) {
+#ifdef GC_STACK_SWITCH
+	s->prev = NULL;
+	s->next = gc_stacks;
+	if( gc_stacks )
+		gc_stacks->prev = s;
+	gc_stacks = s;
+#endif
+}
+
+void neko_gc_remove_stack( neko_stack *s ) {
+#ifdef GC_STACK_SWITCH
+	if( s->prev )
+		s->prev->next = s->next;
+	else
+		gc_stacks = s->next;
+	if( s->next )
+		s->next->prev = s->prev;
+	s->prev = s->next = NULL;
+#endif
+}
+
 EXTERN void neko_gc_stats( int *heap, int *free ) {
 	*heap = (int)GC_get_heap_size();
 	*free = (int)GC_get_free_bytes();
 }
 
+EXTERN void neko_gc_pause_stats( int *pauses, int *max_pause ) {
+	memcpy(pauses,gc_pauses,sizeof(gc_pauses));
+	*max_pause = gc_pause_max;
+}
+
+EXTERN void neko_gc_vm_stats( neko_vm *vm, int *allocs, int *refills ) {
+	*allocs = vm->cell_allocs;
+	*refills = vm->cell_refills;
+}
+
 EXTERN char *alloc( unsigned int nbytes ) {
-	return (char*)gc_alloc_big(nbytes);
+	return (char*)alloc_cell(nbytes);
 }
 
 EXTERN char *alloc_private( unsigned int nbytes ) {
@@ -193,14 +414,20 @@ EXTERN value alloc_string( const char *str ) {
 }
 
 EXTERN value alloc_float( tfloat f ) {
-	vfloat *v = (vfloat*)gc_alloc_private(sizeof(vfloat));
+	vfloat *v;
+#	ifdef NEKO_IMMEDIATE_FLOATS
+	value i = neko_imm_float(f);
+	if( i != NULL )
+		return i;
+#	endif
+	v = (vfloat*)alloc_cell(sizeof(vfloat));
 	v->t = VAL_FLOAT;
 	v->f = f;
 	return (value)v;
 }
 
 EXTERN value alloc_int32( int i ) {
-	vint32 *v = (vint32*)gc_alloc_private(sizeof(vint32));
+	vint32 *v = (vint32*)alloc_cell(sizeof(vint32));
 	v->t = VAL_INT32;
 	v->i = i;
 	return (value)v;
@@ -212,14 +439,14 @@ EXTERN value alloc_array( unsigned int n ) {
 		return (value)(void*)&empty_array;
 	if( n > max_array_size )
 		failure("max_array_size reached");
-	v = (value)gc_alloc_big(sizeof(varray)+(n - 1)*sizeof(value));
+	v = (value)alloc_cell(sizeof(varray)+(n - 1)*sizeof(value));
 	if( v == NULL ) failure("out of memory");
 	v->t = VAL_ARRAY | (n << NEKO_TAG_BITS);
 	return v;
 }
 
 EXTERN value alloc_abstract( vkind k, void *data ) {
-	vabstract *v = (vabstract*)gc_alloc(sizeof(vabstract));
+	vabstract *v = (vabstract*)alloc_cell(sizeof(vabstract));
 	v->t = VAL_ABSTRACT;
 	v->kind = k;
 	v->data = data;
@@ -230,7 +457,7 @@ EXTERN value alloc_function( void *c_prim, unsigned int nargs, const char *name
 	vfunction *v;
 	if( c_prim == NULL || ((int)nargs < 0 && nargs != VAR_ARGS) )
 		failure("alloc_function");
-	v = (vfunction*)gc_alloc(sizeof(vfunction));
+	v = (vfunction*)alloc_cell(sizeof(vfunction));
 	v->t = VAL_PRIMITIVE;
 	v->addr = c_prim;
 	v->nargs = nargs;
@@ -243,7 +470,7 @@ value neko_alloc_module_function( void *m, int_val pos, int nargs ) {
 	vfunction *v;
 	if( nargs < 0 && nargs != VAR_ARGS )
 		failure("alloc_module_function");
-	v = (vfunction*)gc_alloc(sizeof(vfunction));
+	v = (vfunction*)alloc_cell(sizeof(vfunction));
 	v->t = VAL_FUNCTION;
 	v->addr = (void*)pos;
 	v->nargs = nargs;
@@ -303,7 +530,7 @@ static value apply5( value p1, value p2, value p3, value p4, value p5 ) {
 }
 
 value neko_alloc_apply( int nargs, value env ) {
-	vfunction *v = (vfunction*)gc_alloc(sizeof(vfunction));
+	vfunction *v = (vfunction*)alloc_cell(sizeof(vfunction));
 	v->t = VAL_PRIMITIVE;
 	switch( nargs ) {
 	case 1: v->addr = apply1; break;
@@ -323,15 +550,14 @@ EXTERN value alloc_object( value cpy ) {
 	vobject *v;
 	if( cpy != NULL && !val_is_null(cpy) && !val_is_object(cpy) )
 		val_throw(alloc_string("$new")); // 'new' opcode simulate $new
-	v = (vobject*)gc_alloc(sizeof(vobject));
+	v = (vobject*)alloc_cell(sizeof(vobject));
 	v->t = VAL_OBJECT;
 	if( cpy == NULL || val_is_null(cpy) ) {
 		v->proto = NULL;
-		otable_init(&v->table);
-
+		obj_init(v);
 	} else {
 		v->proto = ((vobject*)cpy)->proto;
-		otable_copy(&((vobject*)cpy)->table,&v->table);
+		obj_copy((vobject*)cpy,v);
 	}
 	return (value)v;
 }
@@ -344,7 +570,7 @@ EXTERN value copy_string( const char *str, int_val strlen ) {
 }
 
 EXTERN void alloc_field( value obj, field f, value v ) {
-	otable_replace(&((vobject*)obj)->table,f,v);
+	obj_replace((vobject*)obj,f,v);
 }
 
 static void __on_finalize( value v, void *f ) {
@@ -370,7 +596,11 @@ EXTERN void free_root(value *v) {
 
 extern void neko_init_builtins();
 extern void neko_init_fields();
+extern void neko_free_fields();
+extern void neko_init_shapes();
+extern void neko_free_shapes();
 extern void neko_init_jit();
+extern void neko_init_hash();
 extern void neko_free_jit();
 
 #define INIT_ID(x)	id_##x = val_id("__" #x)
@@ -381,14 +611,13 @@ EXTERN void neko_global_init() {
 #	endif
 	empty_array.ptr = val_null;
 	neko_gc_init();
+	neko_init_hash();
 	neko_vm_context = alloc_local();
 	neko_fields_lock = alloc_lock();
-	neko_fields = (objtable*)alloc_root((NEKO_FIELDS_MASK+1) * sizeof(struct _objtable) / sizeof(value));
-	{
-		int i;
-		for(i=0;i<=NEKO_FIELDS_MASK;i++)
-			otable_init(&neko_fields[i]);
-	}
+	neko_verify_lock = alloc_lock();
+	neko_tier_lock = alloc_lock();
+	neko_init_fields();
+	neko_init_shapes();
 	neko_init_builtins();
 	kind_names = (kind_list**)alloc_root(1);
 	*kind_names = NULL;
@@ -422,10 +651,13 @@ EXTERN void neko_global_free() {
 	free_root((value*)kind_names);
 	free_root(apply_string);
 	free_root(neko_builtins);
-	free_root((value*)neko_fields);
+	neko_free_fields();
 	apply_string = NULL;
 	free_local(neko_vm_context);
 	free_lock(neko_fields_lock);
+	free_lock(neko_verify_lock);
+	free_lock(neko_tier_lock);
+	neko_free_shapes();
 	neko_gc_major();
 }
 
@@ -36,6 +36,8 @@ extern value *neko_builtins;
 
 DEFINE_KIND(neko_k_kind);
 DEFINE_KIND(k_old_int32);
+DEFINE_KIND(neko_k_smap);
+DEFINE_KIND(neko_k_imap);
 
 /**
 	<doc>
@@ -661,7 +663,7 @@ static value builtin_objcall( value o, value f, value args ) {
 **/
 static value builtin_objfield( value o, value f ) {
 	val_check(f,int);
-	return alloc_bool( val_is_object(o) && otable_find(&((vobject*)o)->table, val_int(f)) != NULL );
+	return alloc_bool( val_is_object(o) && obj_find((vobject*)o, val_int(f)) != NULL );
 }
 
 /**
@@ -671,7 +673,7 @@ static value builtin_objfield( value o, value f ) {
 static value builtin_objremove( value o, value f ) {
 	val_check(o,object);
 	val_check(f,int);
-	return alloc_bool( otable_remove(&((vobject*)o)->table,val_int(f)) );
+	return alloc_bool( obj_remove((vobject*)o,val_int(f)) );
 }
 
 static void builtin_objfields_rec( value d, field id, void *a ) {
@@ -685,12 +687,10 @@ static void builtin_objfields_rec( value d, field id, void *a ) {
 static value builtin_objfields( value o ) {
 	value a;
 	value *aptr;
-	objtable *t;
 	val_check(o,object);
-	t = &((vobject*)o)->table;
-	a = alloc_array(otable_count(t));
+	a = alloc_array(obj_count((vobject*)o));
 	aptr = val_array_ptr(a);
-	otable_iter(t,builtin_objfields_rec,&aptr);
+	obj_iter((vobject*)o,builtin_objfields_rec,&aptr);
 	return a;
 }
 
@@ -1073,35 +1073,13 @@ static value builtin_hkey( value v ) {
 	return alloc_int(val_hash(v));
 }
 
-#define HASH_DEF_SIZE 7
-
 /**
 	$hnew : s:int -> 'hash
 	<doc>Create an hashtable with [s] slots</doc>
 **/
 static value builtin_hnew( value size ) {
-	vhash *h;
-	int i;
 	val_check(size,int);
-	h = (vhash*)alloc(sizeof(vhash));
-	h->nitems = 0;
-	h->ncells = val_int(size);
-	if( h->ncells <= 0 )
-		h->ncells = HASH_DEF_SIZE;
-	h->cells = (hcell**)alloc(sizeof(hcell*)*h->ncells);
-	for(i=0;i<h->ncells;i++)
-		h->cells[i] = NULL;
-	return alloc_abstract(k_hash,h);
-}
-
-static void add_rec( hcell **cc, int size, hcell *c ) {
-	int k;
-	if( c == NULL )
-		return;
-	add_rec(cc,size,c->next);
-	k = c->hkey % size;
-	c->next = cc[k];
-	cc[k] = c;
+	return alloc_abstract(k_hash,neko_hash_alloc(val_int(size)));
 }
 
 /**
@@ -1109,22 +1087,9 @@ static void add_rec( hcell **cc, int size, hcell *c ) {
 	<doc>Resize an hashtable</doc>
 **/
 static value builtin_hresize( value vh, value size ) {
-	vhash *h;
-	hcell **cc;
-	int nsize;
-	int i;
 	val_check_kind(vh,k_hash);
 	val_check(size,int);
-	h = val_hdata(vh);
-	nsize = val_int(size);
-	if( nsize <= 0 )
-		nsize = HASH_DEF_SIZE;
-	cc = (hcell**)alloc(sizeof(hcell*)*nsize);
-	memset(cc,0,sizeof(hcell*)*nsize);
-	for(i=0;i<h->ncells;i++)
-		add_rec(cc,nsize,h->cells[i]);
-	h->cells = cc;
-	h->ncells = nsize;
+	neko_hash_resize(val_hdata(vh),val_int(size));
 	return val_null;
 }
 
@@ -1138,26 +1103,13 @@ static value builtin_hresize( value vh, value size ) {
 **/
 static value builtin_hget( value vh, value key, value cmp ) {
 	vhash *h;
-	hcell *c;
+	int i;
 	if( !val_is_null(cmp) )
 		val_check_function(cmp,2);
 	val_check_kind(vh,k_hash);
 	h = val_hdata(vh);
-	c = h->cells[val_hash(key) % h->ncells];
-	if( val_is_null(cmp) ) {
-		while( c != NULL ) {
-			if( val_compare(key,c->key) == 0 )
-				return c->val;
-			c = c->next;
-		}
-	} else {
-		while( c != NULL ) {
-			if( val_call2(cmp,key,c->key) == alloc_int(0) )
-				return c->val;
-			c = c->next;
-		}
-	}
-	return val_null;
+	i = neko_hash_find(h,val_hash(key),key,cmp);
+	return i < 0 ? val_null : h->cells[i].val;
 }
 
 /**
@@ -1169,27 +1121,10 @@ static value builtin_hget( value vh, value key, value cmp ) {
 	</doc>
 **/
 static value builtin_hmem( value vh, value key, value cmp ) {
-	vhash *h;
-	hcell *c;
 	if( !val_is_null(cmp) )
 		val_check_function(cmp,2);
 	val_check_kind(vh,k_hash);
-	h = val_hdata(vh);
-	c = h->cells[val_hash(key) % h->ncells];
-	if( val_is_null(cmp) ) {
-		while( c != NULL ) {
-			if( val_compare(key,c->key) == 0 )
-				return val_true;
-			c = c->next;
-		}
-	} else {
-		while( c != NULL ) {
-			if( val_call2(cmp,key,c->key) == alloc_int(0) )
-				return val_true;
-			c = c->next;
-		}
-	}
-	return val_false;
+	return alloc_bool(neko_hash_find(val_hdata(vh),val_hash(key),key,cmp) >= 0);
 }
 
 /**
@@ -1201,43 +1136,10 @@ static value builtin_hmem( value vh, value key, value cmp ) {
 	</doc>
 **/
 static value builtin_hremove( value vh, value key, value cmp ) {
-	vhash *h;
-	hcell *c, *prev = NULL;
-	int hkey;
 	if( !val_is_null(cmp) )
 		val_check_function(cmp,2);
 	val_check_kind(vh,k_hash);
-	h = val_hdata(vh);
-	hkey = val_hash(key) % h->ncells;
-	c = h->cells[hkey];
-	if( val_is_null(cmp) ) {
-		while( c != NULL ) {
-			if( val_compare(key,c->key) == 0 ) {
-				if( prev == NULL )
-					h->cells[hkey] = c->next;
-				else
-					prev->next = c->next;
-				h->nitems--;
-				return val_true;
-			}
-			prev = c;
-			c = c->next;
-		}
-	} else {
-		while( c != NULL ) {
-			if( val_call2(cmp,key,c->key) == alloc_int(0) ) {
-				if( prev == NULL )
-					h->cells[hkey] = c->next;
-				else
-					prev->next = c->next;
-				h->nitems--;
-				return val_true;
-			}
-			prev = c;
-			c = c->next;
-		}
-	}
-	return val_false;
+	return alloc_bool(neko_hash_remove(val_hdata(vh),val_hash(key),key,cmp));
 }
 
 /**
@@ -1248,43 +1150,10 @@ static value builtin_hremove( value vh, value key, value cmp ) {
 	</doc>
 **/
 static value builtin_hset( value vh, value key, value val, value cmp ) {
-	vhash *h;
-	hcell *c;
-	int hkey;
 	if( !val_is_null(cmp) )
 		val_check_function(cmp,2);
 	val_check_kind(vh,k_hash);
-	h = val_hdata(vh);
-	hkey = val_hash(key);
-	c = h->cells[hkey % h->ncells];
-	if( val_is_null(cmp) ) {
-		while( c != NULL ) {
-			if( val_compare(key,c->key) == 0 ) {
-				c->val = val;
-				return val_false;
-			}
-			c = c->next;
-		}
-	} else {
-		while( c != NULL ) {
-			if( val_call2(cmp,key,c->key) == alloc_int(0) ) {
-				c->val = val;
-				return val_false;
-			}
-			c = c->next;
-		}
-	}
-	if( h->nitems >= (h->ncells << 1) )
-		builtin_hresize(vh,alloc_int(h->ncells << 1));
-	c = (hcell*)alloc(sizeof(hcell));
-	c->hkey = hkey;
-	c->key = key;
-	c->val = val;
-	hkey %= h->ncells;
-	c->next = h->cells[hkey];
-	h->cells[hkey] = c;
-	h->nitems++;
-	return val_true;
+	return alloc_bool(neko_hash_set(val_hdata(vh),val_hash(key),key,val,cmp));
 }
 
 /**
@@ -1294,45 +1163,43 @@ static value builtin_hset( value vh, value key, value val, value cmp ) {
 	</doc>
 **/
 static value builtin_hadd( value vh, value key, value val ) {
-	vhash *h;
-	hcell *c;
 	int hkey;
 	val_check_kind(vh,k_hash);
-	h = val_hdata(vh);
 	hkey = val_hash(key);
 	if( hkey < 0 )
 		neko_error();
-	if( h->nitems >= (h->ncells << 1) )
-		builtin_hresize(vh,alloc_int(h->ncells << 1));
-	c = (hcell*)alloc(sizeof(hcell));
-	c->hkey = hkey;
-	c->key = key;
-	c->val = val;
-	hkey %= h->ncells;
-	c->next = h->cells[hkey];
-	h->cells[hkey] = c;
-	h->nitems++;
+	neko_hash_add(val_hdata(vh),hkey,key,val,false);
 	return val_null;
 }
 
+static void hash_iter( vhash *h, value f ) {
+	int i, n;
+	hcell *cells, *c;
+	unsigned char *ctrl;
+	// [f] might resize the table : keep iterating over the current slots
+	cells = h->cells;
+	ctrl = h->ctrl;
+	n = h->ncells;
+	for(i=0;i<n;i++) {
+		if( ctrl[i] & 0x80 )
+			continue;
+		val_call2(f,cells[i].key,cells[i].val);
+		c = cells[i].next;
+		while( c != NULL ) {
+			val_call2(f,c->key,c->val);
+			c = c->next;
+		}
+	}
+}
+
 /**
 	$hiter : 'hash -> f:function:2 -> void
 	<doc>Call the function [f] with every key and value in the hashtable</doc>
 **/
 static value builtin_hiter( value vh, value f ) {
-	int i;
-	hcell *c;
-	vhash *h;
 	val_check_function(f,2);
 	val_check_kind(vh,k_hash);
-	h = val_hdata(vh);
-	for(i=0;i<h->ncells;i++) {
-		c = h->cells[i];
-		while( c != NULL ) {
-			val_call2(f,c->key,c->val);
-			c = c->next;
-		}
-	}
+	hash_iter(val_hdata(vh),f);
 	return val_null;
 }
 
@@ -1354,6 +1221,187 @@ static value builtin_hsize( value vh ) {
 	return alloc_int( val_hdata(vh)->ncells );
 }
 
+/** <doc><h2>Typed Maps Builtins</h2></doc> **/
+
+/**
+	$smapnew : s:int -> 'smap
+	<doc>Create a map keyed by strings, with room for [s] bindings</doc>
+**/
+static value builtin_smapnew( value size ) {
+	val_check(size,int);
+	return alloc_abstract(neko_k_smap,neko_hash_alloc(val_int(size)));
+}
+
+/**
+	$smapget : 'smap -> k:string -> any
+	<doc>Return the value bound to [k] or [null] if not found</doc>
+**/
+static value builtin_smapget( value m, value k ) {
+	vhash *h;
+	int i;
+	val_check_kind(m,neko_k_smap);
+	val_check(k,string);
+	h = val_hdata(m);
+	i = neko_hash_find_string(h,neko_hash_string(val_string(k),val_strlen(k)),val_string(k),val_strlen(k));
+	return i < 0 ? val_null : h->cells[i].val;
+}
+
+/**
+	$smapmem : 'smap -> k:string -> bool
+	<doc>Tells if [k] is bound in the map</doc>
+**/
+static value builtin_smapmem( value m, value k ) {
+	val_check_kind(m,neko_k_smap);
+	val_check(k,string);
+	return alloc_bool(neko_hash_find_string(val_hdata(m),neko_hash_string(val_string(k),val_strlen(k)),val_string(k),val_strlen(k)) >= 0);
+}
+
+/**
+	$smapset : 'smap -> k:string -> v:any -> bool
+	<doc>Bind [k] to [v]. Return true if [k] was not bound before</doc>
+**/
+static value builtin_smapset( value m, value k, value v ) {
+	vhash *h;
+	int hkey, i;
+	val_check_kind(m,neko_k_smap);
+	val_check(k,string);
+	h = val_hdata(m);
+	hkey = neko_hash_string(val_string(k),val_strlen(k));
+	i = neko_hash_find_string(h,hkey,val_string(k),val_strlen(k));
+	if( i >= 0 ) {
+		h->cells[i].val = v;
+		return val_false;
+	}
+	neko_hash_insert(h,hkey,k,v);
+	return val_true;
+}
+
+/**
+	$smapremove : 'smap -> k:string -> bool
+	<doc>Remove the binding of [k]. Return true if it was bound</doc>
+**/
+static value builtin_smapremove( value m, value k ) {
+	vhash *h;
+	int i;
+	val_check_kind(m,neko_k_smap);
+	val_check(k,string);
+	h = val_hdata(m);
+	i = neko_hash_find_string(h,neko_hash_string(val_string(k),val_strlen(k)),val_string(k),val_strlen(k));
+	if( i < 0 )
+		return val_false;
+	neko_hash_remove_slot(h,i);
+	return val_true;
+}
+
+/**
+	$smapcount : 'smap -> int
+	<doc>Return the number of bindings in the map</doc>
+**/
+static value builtin_smapcount( value m ) {
+	val_check_kind(m,neko_k_smap);
+	return alloc_int( val_hdata(m)->nitems );
+}
+
+/**
+	$smapiter : 'smap -> f:function:2 -> void
+	<doc>Call the function [f] with every key and value in the map</doc>
+**/
+static value builtin_smapiter( value m, value f ) {
+	val_check_function(f,2);
+	val_check_kind(m,neko_k_smap);
+	hash_iter(val_hdata(m),f);
+	return val_null;
+}
+
+/**
+	$imapnew : s:int -> 'imap
+	<doc>Create a map keyed by integers, with room for [s] bindings</doc>
+**/
+static value builtin_imapnew( value size ) {
+	val_check(size,int);
+	return alloc_abstract(neko_k_imap,neko_hash_alloc(val_int(size)));
+}
+
+/**
+	$imapget : 'imap -> k:int -> any
+	<doc>Return the value bound to [k] or [null] if not found</doc>
+**/
+static value builtin_imapget( value m, value k ) {
+	vhash *h;
+	int i;
+	val_check_kind(m,neko_k_imap);
+	val_check(k,int);
+	h = val_hdata(m);
+	i = neko_hash_find_int(h,val_int(k));
+	return i < 0 ? val_null : h->cells[i].val;
+}
+
+/**
+	$imapmem : 'imap -> k:int -> bool
+	<doc>Tells if [k] is bound in the map</doc>
+**/
+static value builtin_imapmem( value m, value k ) {
+	val_check_kind(m,neko_k_imap);
+	val_check(k,int);
+	return alloc_bool(neko_hash_find_int(val_hdata(m),val_int(k)) >= 0);
+}
+
+/**
+	$imapset : 'imap -> k:int -> v:any -> bool
+	<doc>Bind [k] to [v]. Return true if [k] was not bound before</doc>
+**/
+static value builtin_imapset( value m, value k, value v ) {
+	vhash *h;
+	int i;
+	val_check_kind(m,neko_k_imap);
+	val_check(k,int);
+	h = val_hdata(m);
+	i = neko_hash_find_int(h,val_int(k));
+	if( i >= 0 ) {
+		h->cells[i].val = v;
+		return val_false;
+	}
+	neko_hash_insert(h,val_int(k),k,v);
+	return val_true;
+}
+
+/**
+	$imapremove : 'imap -> k:int -> bool
+	<doc>Remove the binding of [k]. Return true if it was bound</doc>
+**/
+static value builtin_imapremove( value m, value k ) {
+	vhash *h;
+	int i;
+	val_check_kind(m,neko_k_imap);
+	val_check(k,int);
+	h = val_hdata(m);
+	i = neko_hash_find_int(h,val_int(k));
+	if( i < 0 )
+		return val_false;
+	neko_hash_remove_slot(h,i);
+	return val_true;
+}
+
+/**
+	$imapcount : 'imap -> int
+	<doc>Return the number of bindings in the map</doc>
+**/
+static value builtin_imapcount( value m ) {
+	val_check_kind(m,neko_k_imap);
+	return alloc_int( val_hdata(m)->nitems );
+}
+
+/**
+	$imapiter : 'imap -> f:function:2 -> void
+	<doc>Call the function [f] with every key and value in the map</doc>
+**/
+static value builtin_imapiter( value m, value f ) {
+	val_check_function(f,2);
+	val_check_kind(m,neko_k_imap);
+	hash_iter(val_hdata(m),f);
+	return val_null;
+}
+
 /** <doc><h2>Other Builtins</h2></doc> **/
 
 /**
@@ -1618,6 +1666,21 @@ void neko_init_builtins() {
 	BUILTIN(hsize,1);
 	BUILTIN(hiter,2);
 
+	BUILTIN(smapnew,1);
+	BUILTIN(smapget,2);
+	BUILTIN(smapmem,2);
+	BUILTIN(smapset,3);
+	BUILTIN(smapremove,2);
+	BUILTIN(smapcount,1);
+	BUILTIN(smapiter,2);
+	BUILTIN(imapnew,1);
+	BUILTIN(imapget,2);
+	BUILTIN(imapmem,2);
+	BUILTIN(imapset,3);
+	BUILTIN(imapremove,2);
+	BUILTIN(imapcount,1);
+	BUILTIN(imapiter,2);
+
 	BUILTIN(iadd,2);
 	BUILTIN(isub,2);
 	BUILTIN(imult,2);
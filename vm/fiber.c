@@ -0,0 +1,375 @@
+/*
+ * Copyright (C)2005-2022 Haxe Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#if defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+// needed for ucontext
+#	define _XOPEN_SOURCE 600
+#	define _DARWIN_C_SOURCE
+#endif
+#include <string.h>
+#include "vm.h"
+
+#if defined(NEKO_POSIX) && !defined(NEKO_WINDOWS)
+#	if defined(NEKO_X64) && defined(__GNUC__) && defined(__ELF__)
+#		define FIBER_ASM
+#	endif
+#	ifndef FIBER_ASM
+#		include <ucontext.h>
+#	endif
+#	include <sys/mman.h>
+#	define FIBER_CONTEXT
+#endif
+
+/*
+	Fibers : each fiber has its own VM and C stack and runs on the thread
+	which resumes it until it yields or returns. Switching is done with the
+	GC lock held (see neko_gc_add_stack) so a collection never sees a thread
+	with a half switched stack. A started fiber is kept alive by a root until
+	it returns : a fiber which is never resumed to completion keeps its stack
+	until neko_fiber_dispose is called.
+*/
+
+#define FIBER_STACK_SIZE	(1 << 20)
+#define FIBER_STACK_MARGIN	(1 << 16)
+#define FIBER_POOL_SIZE		64
+
+#ifdef __GNUC__
+#	define NOINLINE	__attribute__((noinline))
+#else
+#	define NOINLINE
+#endif
+
+DEFINE_KIND(neko_kind_fiber);
+
+#ifdef FIBER_CONTEXT
+
+#ifdef FIBER_ASM
+/*
+	x86-64 context switch without the signal mask syscalls of swapcontext :
+	pushes the callee-saved registers and the SSE/x87 control words on the
+	current stack, saves its pointer in *from then pops them back from [to]
+*/
+typedef void *fiber_ctx;
+extern void neko_fiber_swap( fiber_ctx *from, fiber_ctx to, void **lo ) __attribute__((visibility("hidden")));
+__asm__(
+	".text\n"
+	".globl neko_fiber_swap\n"
+	".hidden neko_fiber_swap\n"
+	".type neko_fiber_swap,@function\n"
+	"neko_fiber_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $8, %rsp\n"
+	"	stmxcsr (%rsp)\n"
+	"	fnstcw 4(%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsp, (%rdx)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr (%rsp)\n"
+	"	fldcw 4(%rsp)\n"
+	"	addq $8, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size neko_fiber_swap,.-neko_fiber_swap\n"
+);
+#else
+typedef ucontext_t fiber_ctx;
+#endif
+
+typedef struct {
+	value handle;
+	value f;
+	value arg;
+	value exc;
+	value *root;
+	neko_vm *vm;
+	neko_vm *owner;
+	int state;
+	int stack_size;
+	char *stack;
+	neko_stack self;
+	neko_stack back;
+	fiber_ctx ctx;
+	fiber_ctx back_ctx;
+} neko_fiber;
+
+// stacks of the default size are recycled (protected by the GC lock)
+static char *stack_pool[FIBER_POOL_SIZE];
+static int stack_pool_count = 0;
+
+static char *fiber_stack_alloc( int size ) {
+	void *s;
+	if( size == FIBER_STACK_SIZE && stack_pool_count > 0 )
+		return stack_pool[--stack_pool_count];
+#	ifdef MAP_NORESERVE
+	s = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANON|MAP_NORESERVE,-1,0);
+#	else
+	s = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANON,-1,0);
+#	endif
+	return s == MAP_FAILED ? NULL : (char*)s;
+}
+
+static void fiber_stack_free( char *s, int size ) {
+	if( size == FIBER_STACK_SIZE && stack_pool_count < FIBER_POOL_SIZE )
+		stack_pool[stack_pool_count++] = s;
+	else
+		munmap(s,size);
+}
+
+// called with the GC lock held, returns with it held
+static void NOINLINE fiber_switch( neko_stack *s, fiber_ctx *from, fiber_ctx *to ) {
+#	ifdef FIBER_ASM
+	neko_gc_add_stack(s);
+	neko_fiber_swap(from,*to,&s->lo);
+#	else
+	int_val here;
+	s->lo = &here;
+	neko_gc_add_stack(s);
+	swapcontext(from,to);
+#	endif
+}
+
+static void fiber_entry() {
+	neko_fiber *fb = (neko_fiber*)NEKO_VM()->fiber;
+	value exc = NULL;
+	value ret;
+	neko_gc_unlock();
+	ret = val_callEx(val_null,fb->f,&fb->arg,1,&exc);
+	neko_gc_lock();
+	fb->arg = ret;
+	fb->exc = exc;
+	fb->f = val_null;
+	fb->state = NEKO_FIBER_DEAD;
+#	ifdef FIBER_ASM
+	neko_fiber_swap(&fb->ctx,fb->back_ctx,&fb->self.lo);
+#	else
+	setcontext(&fb->back_ctx);
+#	endif
+}
+
+static void fiber_init_ctx( neko_fiber *fb ) {
+#	ifdef FIBER_ASM
+	// the frame popped by neko_fiber_swap, returning into fiber_entry
+	void **sp = (void**)(fb->stack + fb->stack_size);
+	*--sp = NULL;
+	*--sp = (void*)fiber_entry;
+	sp -= 6;
+	memset(sp,0,6 * sizeof(void*));
+	*--sp = (void*)(int_val)0x0000037F00001F80; // default x87 control word : mxcsr
+	fb->ctx = sp;
+#	else
+	getcontext(&fb->ctx);
+	fb->ctx.uc_stack.ss_sp = fb->stack;
+	fb->ctx.uc_stack.ss_size = fb->stack_size;
+	fb->ctx.uc_link = NULL;
+	makecontext(&fb->ctx,fiber_entry,0);
+#	endif
+}
+
+#endif
+
+EXTERN value neko_fiber_alloc( value f, int stack_size ) {
+#ifdef FIBER_CONTEXT
+	neko_vm *cur = NEKO_VM();
+	neko_vm *vm;
+	neko_fiber *fb;
+	if( !neko_gc_can_switch() )
+		failure("Fibers are not supported by this GC");
+	if( stack_size <= 0 )
+		stack_size = FIBER_STACK_SIZE;
+	else if( stack_size < FIBER_STACK_MARGIN * 4 )
+		stack_size = FIBER_STACK_MARGIN * 4;
+	fb = (neko_fiber*)alloc(sizeof(neko_fiber));
+	memset(fb,0,sizeof(neko_fiber));
+	vm = neko_vm_alloc(NULL);
+	// fibers share the thread of their owner
+	neko_atomic_dec(&neko_vm_count);
+	vm->run_jit = cur->run_jit;
+	vm->trusted_code = cur->trusted_code;
+	vm->print = cur->print;
+	vm->print_param = cur->print_param;
+	vm->clist = cur->clist;
+	vm->resolver = cur->resolver;
+	vm->fstats = cur->fstats;
+	vm->pstats = cur->pstats;
+	vm->fiber = fb;
+	fb->vm = vm;
+	fb->owner = cur->fiber ? ((neko_fiber*)cur->fiber)->owner : cur;
+	fb->f = f;
+	fb->arg = val_null;
+	fb->exc = NULL;
+	fb->state = NEKO_FIBER_NEW;
+	fb->stack_size = stack_size;
+	fb->handle = alloc_abstract(neko_kind_fiber,fb);
+	return fb->handle;
+#else
+	failure("Fibers are not supported on this platform");
+	return val_null;
+#endif
+}
+
+EXTERN value neko_fiber_resume( value h, value v ) {
+#ifdef FIBER_CONTEXT
+	neko_vm *vm = NEKO_VM();
+	neko_fiber *fb;
+	value exc;
+	if( !val_is_kind(h,neko_kind_fiber) )
+		failure("Invalid fiber");
+	fb = (neko_fiber*)val_data(h);
+	if( fb->state == NEKO_FIBER_RUNNING )
+		failure("Fiber is already running");
+	if( fb->state == NEKO_FIBER_DEAD )
+		failure("Cannot resume a dead fiber");
+	if( fb->owner != (vm->fiber ? ((neko_fiber*)vm->fiber)->owner : vm) )
+		failure("Fiber resumed from another thread");
+	if( fb->state == NEKO_FIBER_NEW && fb->root == NULL ) {
+		fb->root = alloc_root(1);
+		*fb->root = h;
+	}
+	neko_gc_lock();
+	if( fb->state == NEKO_FIBER_NEW ) {
+		fb->stack = fiber_stack_alloc(fb->stack_size);
+		if( fb->stack == NULL ) {
+			neko_gc_unlock();
+			free_root(fb->root);
+			fb->root = NULL;
+			failure("Failed to allocate fiber stack");
+		}
+		fb->vm->c_stack_max = fb->stack + FIBER_STACK_MARGIN;
+		fiber_init_ctx(fb);
+	} else
+		neko_gc_remove_stack(&fb->self);
+	fb->self.hi = fb->stack + fb->stack_size;
+	fb->back.hi = neko_gc_stack_bottom(NULL);
+	neko_gc_stack_bottom(fb->self.hi);
+	fb->arg = v;
+	fb->state = NEKO_FIBER_RUNNING;
+	neko_vm_select(fb->vm);
+	fiber_switch(&fb->back,&fb->back_ctx,&fb->ctx);
+	// the fiber yielded or returned
+	neko_gc_remove_stack(&fb->back);
+	neko_gc_stack_bottom(fb->back.hi);
+	if( fb->state == NEKO_FIBER_DEAD ) {
+		fiber_stack_free(fb->stack,fb->stack_size);
+		fb->stack = NULL;
+	}
+	neko_gc_unlock();
+	neko_vm_select(vm);
+	if( fb->state == NEKO_FIBER_DEAD ) {
+		free_root(fb->root);
+		fb->root = NULL;
+		exc = fb->exc;
+		fb->exc = NULL;
+		if( exc != NULL )
+			val_rethrow(exc);
+	}
+	v = fb->arg;
+	fb->arg = val_null;
+	return v;
+#else
+	failure("Fibers are not supported on this platform");
+	return val_null;
+#endif
+}
+
+EXTERN value neko_fiber_yield( value v ) {
+#ifdef FIBER_CONTEXT
+	neko_fiber *fb = (neko_fiber*)NEKO_VM()->fiber;
+	if( fb == NULL )
+		failure("Cannot yield outside of a fiber");
+	neko_gc_lock();
+	fb->arg = v;
+	fb->state = NEKO_FIBER_SUSPENDED;
+	fiber_switch(&fb->self,&fb->ctx,&fb->back_ctx);
+	// resumed : the stack bottom has been moved back to our stack
+	neko_gc_unlock();
+	v = fb->arg;
+	fb->arg = val_null;
+	return v;
+#else
+	failure("Fibers are not supported on this platform");
+	return val_null;
+#endif
+}
+
+EXTERN void neko_fiber_dispose( value h ) {
+#ifdef FIBER_CONTEXT
+	neko_vm *vm = NEKO_VM();
+	neko_fiber *fb;
+	if( !val_is_kind(h,neko_kind_fiber) )
+		failure("Invalid fiber");
+	fb = (neko_fiber*)val_data(h);
+	if( fb->state == NEKO_FIBER_RUNNING )
+		failure("Cannot dispose a running fiber");
+	if( fb->state == NEKO_FIBER_DEAD )
+		return;
+	if( fb->owner != (vm->fiber ? ((neko_fiber*)vm->fiber)->owner : vm) )
+		failure("Fiber disposed from another thread");
+	// the suspended C frames are dropped without running any more code
+	if( fb->stack != NULL ) {
+		neko_gc_lock();
+		neko_gc_remove_stack(&fb->self);
+		fiber_stack_free(fb->stack,fb->stack_size);
+		neko_gc_unlock();
+		fb->stack = NULL;
+	}
+	if( fb->root != NULL ) {
+		free_root(fb->root);
+		fb->root = NULL;
+	}
+	fb->f = val_null;
+	fb->arg = val_null;
+	fb->exc = NULL;
+	fb->state = NEKO_FIBER_DEAD;
+#else
+	failure("Fibers are not supported on this platform");
+#endif
+}
+
+EXTERN value neko_fiber_current() {
+#ifdef FIBER_CONTEXT
+	neko_fiber *fb = (neko_fiber*)NEKO_VM()->fiber;
+	return fb == NULL ? val_null : fb->handle;
+#else
+	return val_null;
+#endif
+}
+
+EXTERN int neko_fiber_status( value h ) {
+#ifdef FIBER_CONTEXT
+	if( !val_is_kind(h,neko_kind_fiber) )
+		return -1;
+	return ((neko_fiber*)val_data(h))->state;
+#else
+	return -1;
+#endif
+}
+
+/* ************************************************************************ */
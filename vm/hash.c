@@ -19,7 +19,10 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
  * DEALINGS IN THE SOFTWARE.
  */
-#include "neko.h"
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include "neko_vm.h"
 
 typedef struct vlist {
 	value v;
@@ -28,15 +31,21 @@ typedef struct vlist {
 
 typedef struct vparam {
 	int *h;
+	int compat;
 	vlist l;
 } vparam;
 
 #define HBIG(x)  *h = *h * 65599 + (x)
 #define HSMALL(x) *h = *h * 19 + (x)
 
+// NEKO_HASH_COMPAT restores the byte hash of strings and floats, so that
+// $hkey gives the values of previous versions ; $hiter order still differs
+static int hash_compat = 0;
+static uintptr_t hash_seed = 0;
+
 static void hash_obj_rec( value v, field f, void *_p );
 
-static void hash_rec( value v, int *h, vlist *l ) {
+static void hash_rec( value v, int *h, vlist *l, int compat ) {
 	val_type t = val_type(v);
 	switch( t ) {
 	case VAL_INT:
@@ -50,9 +59,17 @@ static void hash_rec( value v, int *h, vlist *l ) {
 		break;
 	case VAL_FLOAT:
 		{
+			tfloat f = val_float(v);
 			int k = sizeof(tfloat);
+			if( !compat ) {
+				// -0.0 == 0.0
+				if( f == 0 )
+					f = 0;
+				HBIG(neko_hash_string((char*)&f,sizeof(tfloat)));
+				break;
+			}
 			while( k )
-				HSMALL(val_string(v)[--k]);
+				HSMALL(((char*)&f)[--k]);
 		}
 		break;
 	case VAL_BOOL:
@@ -61,6 +78,10 @@ static void hash_rec( value v, int *h, vlist *l ) {
 	case VAL_STRING:
 		{
 			int k = val_strlen(v);
+			if( !compat ) {
+				HBIG(neko_hash_string(val_string(v),k));
+				break;
+			}
 			while( k )
 				HSMALL(val_string(v)[--k]);
 		}
@@ -82,19 +103,20 @@ static void hash_rec( value v, int *h, vlist *l ) {
 		if( t == VAL_OBJECT ) {
 			vparam p;
 			p.h = h;
+			p.compat = compat;
 			p.l.v = v;
 			p.l.next = l;
 			val_iter_fields(v,hash_obj_rec,&p);
 			v = (value)((vobject*)v)->proto;
 			if( v != NULL )
-				hash_rec(v,h,&p.l);
+				hash_rec(v,h,&p.l,compat);
 		} else {
 			vlist cur;
 			int k = val_array_size(v);
 			cur.v = v;
 			cur.next = l;
 			while( k )
-				hash_rec(val_array_ptr(v)[--k],h,&cur);
+				hash_rec(val_array_ptr(v)[--k],h,&cur,compat);
 		}
 		break;
 	default:
@@ -107,15 +129,325 @@ static void hash_obj_rec( value v, field f, void *_p ) {
 	vparam *p = (vparam*)_p;
 	int *h = p->h;
 	HBIG((int)f);
-	hash_rec(v,h,&p->l);
+	hash_rec(v,h,&p->l,p->compat);
 }
 
 EXTERN int val_hash( value v ) {
 	int h = 0;
-	hash_rec(v,&h,NULL);
+	hash_rec(v,&h,NULL,hash_compat);
+	return (((unsigned int)h) & 0x3FFFFFFF);
+}
+
+// the hash of previous versions, which is what they expect in serialized data
+EXTERN int neko_val_hash_compat( value v ) {
+	int h = 0;
+	hash_rec(v,&h,NULL,1);
 	return (((unsigned int)h) & 0x3FFFFFFF);
 }
 
 /* ************************************************************************ */
 
+/*
+	Hashtables use open addressing. Each slot has a control byte which is
+	either EMPTY, DELETED or 7 bits of the key hash, and the bytes
+	are probed one machine word (a group) at a time. Bindings masked by
+	$hadd are chained in the [next] field of the slot that holds the key.
+*/
+
+#define H_EMPTY		0x80
+#define H_DELETED	0xFE
+#define H_GROUP		((int)sizeof(uintptr_t))
+#define H_ONES		((uintptr_t)-1 / 0xFF)
+#define H_MSBS		(H_ONES << 7)
+#define H_DEF_SIZE	8
+
+// spread the bits of the hash since int keys hash to themselves
+static unsigned int hash_mix( int hkey ) {
+	unsigned int m = (unsigned int)hkey * 0x9E3779B1;
+	return m ^ (m >> 15);
+}
+
+#define h2(m)	((m) & 0x7F)
+#define h1(m)	((m) >> 7)
+
+static uintptr_t group_load( vhash *h, int g ) {
+	uintptr_t w;
+	memcpy(&w,h->ctrl + g * H_GROUP,sizeof(w));
+	return w;
+}
+
+#define group_match(w,b)	((((w) ^ (H_ONES * (b))) - H_ONES) & ~((w) ^ (H_ONES * (b))) & H_MSBS)
+#define group_empty(w)		((w) & (~(w) << 6) & H_MSBS)
+#define group_free(w)		((w) & H_MSBS)
+
+// index in the group of the lowest control byte marked in [m]
+static int group_first( uintptr_t m ) {
+	int k;
+#	ifdef NEKO_GCC
+	k = __builtin_ctzll((unsigned long long)m) >> 3;
+#	else
+	k = 0;
+	while( !(m & 0x80) ) {
+		m >>= 8;
+		k++;
+	}
+#	endif
+#	ifdef NEKO_BIG_ENDIAN
+	k = H_GROUP - 1 - k;
+#	endif
+	return k;
+}
+
+#define group_next(m)	((m) & ((m) - 1))
+
+static int hash_capacity( int size ) {
+	int n = H_DEF_SIZE < H_GROUP ? H_GROUP : H_DEF_SIZE;
+	// keep at most 7/8 of the slots used
+	while( n - (n >> 3) < size && n < (1 << 28) )
+		n <<= 1;
+	return n;
+}
+
+static void hash_init( vhash *h, int ncells ) {
+	h->cells = (hcell*)alloc(sizeof(hcell) * ncells);
+	h->ctrl = (unsigned char*)alloc_private(ncells);
+	memset(h->ctrl,H_EMPTY,ncells);
+	h->ncells = ncells;
+	h->nused = 0;
+}
+
+EXTERN vhash *neko_hash_alloc( int size ) {
+	vhash *h = (vhash*)alloc(sizeof(vhash));
+	hash_init(h,hash_capacity(size));
+	h->nitems = 0;
+	return h;
+}
+
+static int hash_equals( value a, value b, value cmp ) {
+	if( !val_is_null(cmp) )
+		return val_call2(cmp,a,b) == alloc_int(0);
+	if( !val_is_int(a) && !val_is_int(b) && val_short_tag(a) == VAL_STRING && val_short_tag(b) == VAL_STRING )
+		return val_strlen(a) == val_strlen(b) && memcmp(val_string(a),val_string(b),val_strlen(a)) == 0;
+	return val_compare(a,b) == 0;
+}
+
+// look for the slot of [hkey] for which [eq] holds, with [i] the slot index
+#define HASH_PROBE(t,key_hash,eq) { \
+		unsigned int hm = hash_mix(key_hash); \
+		int mask = t->ncells / H_GROUP - 1; \
+		int g = h1(hm) & mask; \
+		int step = 0; \
+		while( true ) { \
+			uintptr_t w = group_load(t,g); \
+			uintptr_t m = group_match(w,h2(hm)); \
+			while( m ) { \
+				int i = g * H_GROUP + group_first(m); \
+				if( t->ctrl[i] == h2(hm) && t->cells[i].hkey == key_hash && (eq) ) \
+					return i; \
+				m = group_next(m); \
+			} \
+			if( group_empty(w) || step > mask ) \
+				return -1; \
+			g = (g + ++step) & mask; \
+		} \
+	}
+
+EXTERN int neko_hash_find( vhash *h, int hkey, value key, value cmp ) {
+	HASH_PROBE(h,hkey,hash_equals(key,h->cells[i].key,cmp));
+}
+
+EXTERN int neko_hash_find_string( vhash *h, int hkey, const char *s, int len ) {
+	HASH_PROBE(h,hkey,val_strlen(h->cells[i].key) == len && memcmp(val_string(h->cells[i].key),s,len) == 0);
+}
+
+EXTERN int neko_hash_find_int( vhash *h, int k ) {
+	HASH_PROBE(h,k,true);
+}
+
+// a free slot for a key which is not in the table
+static int hash_slot( vhash *h, unsigned int hm ) {
+	int mask = h->ncells / H_GROUP - 1;
+	int g = h1(hm) & mask;
+	int step = 0;
+	while( true ) {
+		uintptr_t m = group_free(group_load(h,g));
+		if( m )
+			return g * H_GROUP + group_first(m);
+		g = (g + ++step) & mask;
+	}
+}
+
+static void hash_rebuild( vhash *h, int ncells ) {
+	hcell *cells = h->cells;
+	unsigned char *ctrl = h->ctrl;
+	int n = h->ncells;
+	int i;
+	hash_init(h,ncells);
+	for(i=0;i<n;i++)
+		if( !(ctrl[i] & 0x80) ) {
+			int k = hash_slot(h,hash_mix(cells[i].hkey));
+			h->ctrl[k] = ctrl[i];
+			h->cells[k] = cells[i];
+			h->nused++;
+		}
+}
+
+EXTERN void neko_hash_resize( vhash *h, int size ) {
+	int live = 0;
+	int i;
+	for(i=0;i<h->ncells;i++)
+		if( !(h->ctrl[i] & 0x80) )
+			live++;
+	hash_rebuild(h,hash_capacity(size > live ? size : live));
+}
+
+EXTERN void neko_hash_insert( vhash *h, int hkey, value key, value val ) {
+	unsigned int hm = hash_mix(hkey);
+	int i;
+	if( h->nused >= h->ncells - (h->ncells >> 3) )
+		neko_hash_resize(h,h->nitems << 1);
+	i = hash_slot(h,hm);
+	if( h->ctrl[i] == H_EMPTY )
+		h->nused++;
+	h->ctrl[i] = (unsigned char)h2(hm);
+	h->cells[i].hkey = hkey;
+	h->cells[i].key = key;
+	h->cells[i].val = val;
+	h->cells[i].next = NULL;
+	h->nitems++;
+}
+
+EXTERN bool neko_hash_set( vhash *h, int hkey, value key, value val, value cmp ) {
+	int i = neko_hash_find(h,hkey,key,cmp);
+	if( i >= 0 ) {
+		h->cells[i].val = val;
+		return false;
+	}
+	neko_hash_insert(h,hkey,key,val);
+	return true;
+}
+
+EXTERN void neko_hash_add( vhash *h, int hkey, value key, value val, bool below ) {
+	hcell *c;
+	int i = neko_hash_find(h,hkey,key,val_null);
+	if( i < 0 ) {
+		neko_hash_insert(h,hkey,key,val);
+		return;
+	}
+	c = (hcell*)alloc(sizeof(hcell));
+	c->hkey = hkey;
+	c->next = NULL;
+	if( below ) {
+		hcell **p = &h->cells[i].next;
+		while( *p != NULL )
+			p = &(*p)->next;
+		c->key = key;
+		c->val = val;
+		*p = c;
+	} else {
+		c->key = h->cells[i].key;
+		c->val = h->cells[i].val;
+		c->next = h->cells[i].next;
+		h->cells[i].key = key;
+		h->cells[i].val = val;
+		h->cells[i].next = c;
+	}
+	h->nitems++;
+}
+
+EXTERN void neko_hash_remove_slot( vhash *h, int i ) {
+	h->nitems--;
+	// probing stops at a group with an empty slot so it never went past this one
+	if( group_empty(group_load(h,i / H_GROUP)) ) {
+		h->ctrl[i] = H_EMPTY;
+		h->nused--;
+	} else
+		h->ctrl[i] = H_DELETED;
+	h->cells[i].key = NULL;
+	h->cells[i].val = NULL;
+}
+
+EXTERN bool neko_hash_remove( vhash *h, int hkey, value key, value cmp ) {
+	hcell *c;
+	int i = neko_hash_find(h,hkey,key,cmp);
+	if( i < 0 )
+		return false;
+	c = h->cells[i].next;
+	if( c != NULL ) {
+		h->cells[i].key = c->key;
+		h->cells[i].val = c->val;
+		h->cells[i].next = c->next;
+		h->nitems--;
+	} else
+		neko_hash_remove_slot(h,i);
+	return true;
+}
+
+/*
+	String hash reading one machine word at a time, and four of them per
+	step for long strings. NEKO_HASH_SEED sets a seed ("random" picks one)
+	so that colliding keys can't be guessed from outside.
+*/
+
+#define HASH_ROUND(h,w)	h = ((h) ^ (w)) * k; h ^= h >> (H_GROUP * 4 - 3)
 
+EXTERN int neko_hash_string( const char *s, int len ) {
+	uintptr_t k = (uintptr_t)0x9E3779B97F4A7C15ULL;
+	uintptr_t h = hash_seed ^ ((uintptr_t)len * k);
+	uintptr_t w, w2, w3, w4;
+	if( len >= H_GROUP * 4 ) {
+		uintptr_t a = h, b = h + k, c = h - k, d = ~h;
+		do {
+			memcpy(&w,s,sizeof(w));
+			memcpy(&w2,s + H_GROUP,sizeof(w));
+			memcpy(&w3,s + H_GROUP * 2,sizeof(w));
+			memcpy(&w4,s + H_GROUP * 3,sizeof(w));
+			HASH_ROUND(a,w);
+			HASH_ROUND(b,w2);
+			HASH_ROUND(c,w3);
+			HASH_ROUND(d,w4);
+			s += H_GROUP * 4;
+			len -= H_GROUP * 4;
+		} while( len >= H_GROUP * 4 );
+		HASH_ROUND(h,a);
+		HASH_ROUND(h,b);
+		HASH_ROUND(h,c);
+		HASH_ROUND(h,d);
+	}
+	while( len >= H_GROUP ) {
+		memcpy(&w,s,sizeof(w));
+		HASH_ROUND(h,w);
+		s += H_GROUP;
+		len -= H_GROUP;
+	}
+	if( len ) {
+		w = 0;
+		memcpy(&w,s,len);
+		HASH_ROUND(h,w);
+	}
+#	ifdef NEKO_64BITS
+	h ^= h >> 33;
+	h *= (uintptr_t)0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+#	else
+	h ^= h >> 16;
+	h *= 0x85EBCA6B;
+	h ^= h >> 13;
+#	endif
+	return (int)(h & 0x3FFFFFFF);
+}
+
+void neko_init_hash() {
+	char *c = getenv("NEKO_HASH_COMPAT");
+	char *seed = getenv("NEKO_HASH_SEED");
+	hash_compat = c != NULL && atoi(c) != 0;
+	if( seed == NULL || *seed == 0 )
+		hash_seed = 0;
+	else if( strcmp(seed,"random") == 0 ) {
+		uintptr_t r = (uintptr_t)time(NULL) ^ (uintptr_t)clock() ^ (uintptr_t)&seed;
+		hash_seed = (r * (uintptr_t)0x9E3779B97F4A7C15ULL) | 1;
+	} else
+		hash_seed = (uintptr_t)strtoul(seed,NULL,0);
+}
+
+/* ************************************************************************ */
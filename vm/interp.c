@@ -66,6 +66,7 @@
 extern field id_add, id_radd, id_sub, id_rsub, id_mult, id_rmult, id_div, id_rdiv, id_mod, id_rmod;
 extern field id_get, id_set;
 extern value neko_alloc_module_function( void *m, int_val pos, int nargs );
+extern void neko_module_verify( neko_module *m, int_val *pc );
 extern char *jit_boot_seq;
 extern char *jit_handle_trap;
 typedef void (*jit_handle)( neko_vm * );
@@ -96,6 +97,8 @@ static void default_printer( const char *s, int len, void *out ) {
 	fflush((FILE*)out);
 }
 
+int neko_vm_count = 0;
+
 EXTERN neko_vm *neko_vm_alloc( void *custom ) {
 	neko_vm *vm = (neko_vm*)alloc(sizeof(neko_vm));
 #	ifdef NEKO_WINDOWS
@@ -129,6 +132,12 @@ EXTERN neko_vm *neko_vm_alloc( void *custom ) {
 	vm->trusted_code = 0;
 	vm->fstats = NULL;
 	vm->pstats = NULL;
+	memset(vm->cells,0,sizeof(vm->cells));
+	vm->cell_allocs = 0;
+	vm->cell_refills = 0;
+	vm->prof_tick = neko_prof_ticks;
+	vm->fiber = NULL;
+	neko_atomic_inc(&neko_vm_count);
 	return vm;
 }
 
@@ -262,6 +271,30 @@ typedef int_val (*c_primN)(value*,int);
 typedef int_val (*jit_prim)( neko_vm *, void *, value , neko_module *m );
 
 
+static void *tier_entry( neko_module *m, int_val *pc, int_val acc ) {
+	neko_tier *t = (neko_tier*)m->tier;
+	unsigned int p = (unsigned int)(pc - m->code);
+	void *native = t->native[p];
+	if( native == NULL && ++t->counts[p] == TIER_CALLS )
+		native = neko_tier_hot(m,pc);
+	// closures made before the function was compiled
+	if( native != NULL && neko_vm_count == 1 && !(acc & 1) && val_tag(acc) == VAL_FUNCTION && ((vfunction*)acc)->addr == pc ) {
+		((vfunction*)acc)->addr = native;
+		((vfunction*)acc)->t = VAL_JITFUN;
+	}
+	return native;
+}
+
+// native code can't handle ropes : flatten the stack slots it can read
+static void tier_flatten( int_val *sp, int_val *end ) {
+	while( sp < end ) {
+		int_val v = *sp;
+		if( v != 0 && !(v & 3) && *(val_type*)v == VAL_ABSTRACT )
+			*sp = (int_val)neko_rope_flatten((value)v);
+		sp++;
+	}
+}
+
 static int_val jit_run( neko_vm *vm, vfunction *acc ) {
 	neko_module *m = (neko_module*)acc->module;
 	return ((jit_prim)jit_boot_seq)(vm,acc->addr,(value)acc,m);
@@ -270,7 +303,7 @@ static int_val jit_run( neko_vm *vm, vfunction *acc ) {
 #define RuntimeError(err,param)	{ if( param ) pc++; PushInfos(); BeginCall(); val_throw(alloc_string(err)); }
 #define CallFailure()		RuntimeError("Invalid call",false)
 #define InvalidFieldAccess()	{ \
-					value v = val_field_name((field)*pc); \
+					value v = val_field_name(((obj_cache*)*pc)->id); \
 					buffer b; \
 					if( val_is_null(v) ) RuntimeError("Invalid field access",true); \
 					b = alloc_buffer("Invalid field access : "); \
@@ -279,6 +312,22 @@ static int_val jit_run( neko_vm *vm, vfunction *acc ) {
 					val_throw(buffer_to_string(b)); \
 				}
 
+#define FieldAccess() \
+		if( val_is_object(acc) ) { \
+			obj_cache *c = (obj_cache*)*pc; \
+			value *f = obj_cache_find(c,(vobject*)acc); \
+			if( f ) \
+				acc = (int_val)*f; \
+			else if( vm->resolver ) { \
+				BeginCall(); \
+				acc = (int_val)val_call2(vm->resolver,(value)acc,alloc_int(c->id)); \
+				EndCall(); \
+			} else \
+				acc = (int_val)val_null; \
+		} else \
+			InvalidFieldAccess(); \
+		pc++;
+
 #ifdef NEKO_THREADED
 #	define Instr(x)	Label##x:
 #	ifdef NEKO_DIRECT_THREADED
@@ -343,7 +392,10 @@ static int_val jit_run( neko_vm *vm, vfunction *acc ) {
 			pc = (int_val*)((vfunction*)acc)->addr; \
 			vm->vthis = this_arg; \
 			vm->env = ((vfunction*)acc)->env; \
+			ProfPoll(pc); \
+			TierEnter(); \
 		} else if( val_tag(acc) == VAL_PRIMITIVE ) { \
+			FlattenArgs(pc_args); \
 			if( pc_args == ((vfunction*)acc)->nargs ) { \
 				SetupBeforeCall(this_arg); \
 				switch( pc_args ) { \
@@ -381,6 +433,7 @@ static int_val jit_run( neko_vm *vm, vfunction *acc ) {
 				CallFailure(); \
 			PopMacro(pc_args); \
 		} else if( val_tag(acc) == VAL_JITFUN ) { \
+			FlattenArgs(pc_args); \
 			if( pc_args == ((vfunction*)acc)->nargs ) { \
 				SetupBeforeCall(this_arg); \
 				acc = jit_run(vm,(vfunction*)acc); \
@@ -390,8 +443,39 @@ static int_val jit_run( neko_vm *vm, vfunction *acc ) {
 		} else \
 			CallFailure();
 
+#define ProfPoll(p) \
+		if( neko_prof_ticks != vm->prof_tick ) { \
+			BeginCall(); \
+			neko_prof_sample(vm,m,p); \
+		}
+
+#define TierEnter() \
+		if( m->tier != NULL ) { \
+			void *native; \
+			BeginCall(); \
+			native = tier_entry(m,pc,acc); \
+			if( native != NULL ) { \
+				tier_flatten(sp,sp + ((vfunction*)acc)->nargs); \
+				acc = ((jit_prim)jit_boot_seq)(vm,native,(value)acc,m); \
+				EndCall(); \
+				PopInfos(true); \
+			} \
+		}
+
 #define OpError(op) RuntimeError("Invalid operation (" op ")", false)
 
+#define IsRope(v)		(!((v) & 3) && val_is_rope((value)(v)))
+#define Flatten(v)		if( !((v) & 3) && *(val_type*)(v) == VAL_ABSTRACT ) v = (int_val)neko_rope_flatten((value)(v))
+#define FlattenArgs(n) { \
+			int_val _i; \
+			for(_i=0;_i<(n);_i++) \
+				if( !(sp[_i] & 3) && *(val_type*)sp[_i] == VAL_ABSTRACT ) { \
+					ACC_BACKUP \
+					sp[_i] = (int_val)neko_rope_flatten((value)sp[_i]); \
+					ACC_RESTORE; \
+				} \
+		}
+
 #define IntOp(op) \
 		if( (acc & 1) && (*sp & 1) ) \
 			acc = (int_val)alloc_best_int(val_int(*sp) op val_int(acc)); \
@@ -410,6 +494,87 @@ static int_val jit_run( neko_vm *vm, vfunction *acc ) {
 		acc = (int_val)((acc test 0 && acc != invalid_comparison)?val_true:val_false); \
 		Next
 
+#ifdef NEKO_IMMEDIATE_FLOATS
+#	define IsFloatPair()	(!(((acc ^ 2) | (*sp ^ 2)) & 3) || (!((acc | *sp) & 1) && val_tag(acc) == VAL_FLOAT && val_tag(*sp) == VAL_FLOAT))
+#else
+#	define IsFloatPair()	(!((acc | *sp) & 1) && val_tag(acc) == VAL_FLOAT && val_tag(*sp) == VAL_FLOAT)
+#endif
+
+/*
+	Quickening : the first execution of an arithmetic or comparison opcode
+	rewrites it into its int/int or float/float variant depending on the
+	operands, or into the generic one. A variant whose guard fails rewrites
+	the opcode to the generic version and executes it again.
+*/
+#ifdef NEKO_DIRECT_THREADED
+#	define Quicken(op)	pc[-1] = (int_val)instructions[op]
+#else
+#	define Quicken(op)	pc[-1] = op
+#endif
+
+#define QuickenOp(op) \
+		if( (acc & 1) && (*sp & 1) ) \
+			Quicken(op##II); \
+		else if( IsFloatPair() ) \
+			Quicken(op##FF); \
+		else \
+			Quicken(op##Gen);
+
+#define Deopt(op) \
+		Quicken(op##Gen); \
+		pc--; \
+		Next
+
+#define QuickIntOp(op,name) \
+		if( (acc & 1) && (*sp & 1) ) { \
+			acc = (int_val)alloc_best_int(val_int(*sp) op val_int(acc)); \
+			*sp++ = ERASE; \
+			Next; \
+		} \
+		Deopt(name)
+
+#define QuickFloatOp(op,name) \
+		if( IsFloatPair() ) { \
+			acc = (int_val)alloc_float(val_float(*sp) op val_float(acc)); \
+			*sp++ = ERASE; \
+			Next; \
+		} \
+		Deopt(name)
+
+#define QuickIntTest(test,name) \
+		if( (acc & 1) && (*sp & 1) ) { \
+			acc = (int_val)((*sp test acc)?val_true:val_false); \
+			*sp++ = ERASE; \
+			Next; \
+		} \
+		Deopt(name)
+
+#define QuickFloatTest(test,name) \
+		if( IsFloatPair() ) { \
+			acc = (int_val)((val_float(*sp) test val_float(acc))?val_true:val_false); \
+			*sp++ = ERASE; \
+			Next; \
+		} \
+		Deopt(name)
+
+#define TestJumpIfNot(test) \
+		if( (acc & 1) && (*sp & 1) ) \
+			acc = (int_val)((*sp test acc)?val_true:val_false); \
+		else if( IsFloatPair() ) \
+			acc = (int_val)((val_float(*sp) test val_float(acc))?val_true:val_false); \
+		else { \
+			BeginCall(); \
+			acc = (int_val)val_compare((value)*sp,(value)acc); \
+			EndCall(); \
+			acc = (int_val)((acc test 0 && acc != invalid_comparison)?val_true:val_false); \
+		} \
+		*sp++ = ERASE; \
+		if( acc != (int_val)val_true ) \
+			pc = (int_val*)pc[1]; \
+		else \
+			pc += 2; \
+		Next
+
 #define SUB(x,y) ((x) - (y))
 #define MULT(x,y) ((x) * (y))
 #define DIV(x,y) ((x) / (y))
@@ -610,7 +775,7 @@ void neko_process_trap( neko_vm *vm ) {
 		*vm->sp++ = ERASE;
 }
 
-int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val *_pc ) {
+int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val *_pc, int_val *stack_bottom ) {
 	register int_val acc ACC_REG = _acc;
 	register int_val *pc PC_REG = _pc;
 #	ifdef VM_REG
@@ -675,27 +840,7 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		acc = (int_val)val_array_ptr(vm->env)[*pc++];
 		Next;
 	Instr(AccField)
-		if( val_is_object(acc) ) {
-			value *f;
-			value old = (value)acc, tacc = (value)acc;
-			do {
-				f = otable_find(&((vobject*)acc)->table,(field)*pc);
-				if( f )
-					break;
-				acc = (int_val)((vobject*)tacc)->proto;
-				tacc = (value)acc;
-			} while( acc );
-			if( f )
-				acc = (int_val)*f;
-			else if( vm->resolver ) {
-				BeginCall();
-				acc = (int_val)val_call2(vm->resolver,old,alloc_int(*pc));
-				EndCall();
-			} else
-                acc = (int_val)val_null;
-		} else
-			InvalidFieldAccess();
-		pc++;
+		FieldAccess();
 		Next;
 	Instr(AccArray)
 		if( val_is_int(acc) && val_is_array(*sp) ) {
@@ -753,16 +898,19 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		sp[*pc++] = acc;
 		Next;
 	Instr(SetGlobal)
+		Flatten(acc);
 		*(int_val*)(*pc++) = acc;
 		Next;
 	Instr(SetEnv)
 		if( *pc >= val_array_size(vm->env) ) RuntimeError("Writing Outside Env",true);
+		Flatten(acc);
 		val_array_ptr(vm->env)[*pc++] = (value)acc;
 		Next;
 	Instr(SetField)
 		if( val_is_object(*sp) ) {
+			Flatten(acc);
 			ACC_BACKUP;
-			otable_replace(&((vobject*)*sp)->table,(field)*pc,(value)acc);
+			obj_cache_set((obj_cache*)*pc,(vobject*)*sp,(value)acc);
 			ACC_RESTORE;
 		} else
 			InvalidFieldAccess();
@@ -770,6 +918,7 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		pc++;
 		Next;
 	Instr(SetArray)
+		Flatten(acc);
 		if( val_is_array(*sp) && val_is_int(sp[1]) ) {
 			int k = val_int(sp[1]);
 			if( k >= 0 && k < val_array_size(*sp) )
@@ -793,6 +942,7 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		*sp++ = ERASE;
 		Next;
 	Instr(SetIndex)
+		Flatten(acc);
 		if( val_is_array(*sp) ) {
 			if( *pc >= 0 && *pc < val_array_size(*sp) )
 				val_array_ptr(*sp)[*pc] = (value)acc;
@@ -813,6 +963,7 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		*sp++ = ERASE;
 		Next;
 	Instr(SetThis)
+		Flatten(acc);
 		vm->vthis = (value)acc;
 		Next;
 	Instr(Push)
@@ -841,6 +992,7 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 				while( i > *pc )
 					val_array_ptr(env)[i--] = val_null;
 				while( i ) {
+					Flatten(*sp);
 					val_array_ptr(env)[i--] = (value)*sp;
 					*sp++ = ERASE;
 				}
@@ -873,6 +1025,10 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		pc++;
 		DoCall(vm->vthis,pc[-1]);
 		Next;
+	Instr(AccFieldObjCall)
+		FieldAccess();
+		pc++;
+		// continue with ObjCall
 	Instr(ObjCall)
 		{
 			value vtmp = (value)*sp;
@@ -882,9 +1038,11 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		}
 		Next;
 	Instr(Jump)
+		ProfPoll(pc - 1);
 		pc = (int_val*)*pc;
 		Next;
 	Instr(JumpIf)
+		ProfPoll(pc - 1);
 		if( acc == (int_val)val_true )
 			pc = (int_val*)*pc;
 		else
@@ -924,12 +1082,17 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 			int_val tmp = (int_val)alloc_array(n);
 			ACC_RESTORE;
 			while( n-- ) {
+				Flatten(*sp);
 				val_array_ptr(tmp)[n] = (value)*sp;
 				*sp++ = ERASE;
 			}
-			if( val_is_int(acc) || val_tag(acc) != VAL_FUNCTION )
+			if( val_is_int(acc) || (val_tag(acc) != VAL_FUNCTION && val_tag(acc) != VAL_JITFUN) )
 				RuntimeError("Invalid environment",false);
-			acc = (int_val)neko_alloc_module_function(((vfunction*)acc)->module,(int_val)((vfunction*)acc)->addr,((vfunction*)acc)->nargs);
+			{
+				val_type t = val_tag(acc);
+				acc = (int_val)neko_alloc_module_function(((vfunction*)acc)->module,(int_val)((vfunction*)acc)->addr,((vfunction*)acc)->nargs);
+				((vfunction*)acc)->t = t;
+			}
 			((vfunction*)acc)->env = (value)tmp;
 		}
 		Next;
@@ -940,10 +1103,12 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 			value arr = alloc_array(n+1);
 			ACC_RESTORE;
 			while( n ) {
+				Flatten(*sp);
 				val_array_ptr(arr)[n] = (value)*sp;
 				*sp++ = ERASE;
 				n--;
 			}
+			Flatten(acc);
 			val_array_ptr(arr)[0] = (value)acc;
 			acc = (int_val)arr;
 		}
@@ -958,8 +1123,10 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 			if( n == 2 ) {
 				n += 0;
 			}
+			Flatten(acc);
 			val_array_ptr(arr)[n] = (value)acc;
 			while( n ) {
+				Flatten(*sp);
 				val_array_ptr(arr)[--n] = (value)*sp;
 				*sp++ = ERASE;
 			}
@@ -979,6 +1146,8 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		acc = (int_val)((acc == (int_val)val_null)?val_false:val_true);
 		Next;
 	Instr(Add)
+		QuickenOp(Add)
+	Instr(AddGen)
 		if( (acc & 1) && (*sp & 1) )
 			acc = (int_val)alloc_best_int(val_int(*sp) + val_int(acc));
 		else if( acc & 1 ) {
@@ -986,12 +1155,12 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 				acc = (int_val)alloc_float(val_float(*sp) + val_int(acc));
 			else if( val_tag(*sp) == VAL_INT32 )
 				acc = (int_val)alloc_best_int(val_int32(*sp) + val_int(acc));
-			else if( val_short_tag(*sp) == VAL_STRING  )
+			else if( val_short_tag(*sp) == VAL_STRING && val_strlen(*sp) < ROPE_MIN_LENGTH )
 				acc = (int_val)neko_append_int(vm,(value)*sp,val_int(acc),true);
 			else if( val_tag(*sp) == VAL_OBJECT )
 				ObjectOp(*sp,acc,id_add)
 			else
-				OpError("+");
+				goto add_next;
 		} else if( *sp & 1 ) {
 			if( val_tag(acc) == VAL_FLOAT )
 				acc = (int_val)alloc_float(val_int(*sp) + val_float(acc));
@@ -1002,7 +1171,7 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 			else if( val_tag(acc) == VAL_OBJECT )
 				ObjectOp(acc,*sp,id_radd)
 			else
-				OpError("+");
+				goto add_next;
 		} else if( val_tag(acc) == VAL_FLOAT ) {
 			if( val_tag(*sp) == VAL_FLOAT )
 				acc = (int_val)alloc_float(val_float(*sp) + val_float(acc));
@@ -1019,6 +1188,20 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 				goto add_next;
 		} else {
 		add_next:
+			{
+				value r;
+				BeginCall();
+				r = neko_rope_add(vm,(value)*sp,(value)acc);
+				EndCall();
+				if( r != NULL ) {
+					acc = (int_val)r;
+					goto add_done;
+				}
+			}
+			if( (acc & 1) || (*sp & 1) )
+				OpError("+");
+			Flatten(*sp);
+			Flatten(acc);
 			if( val_tag(*sp) == VAL_OBJECT )
 				ObjectOpGen(*sp,acc,id_add,goto add_2)
 			else {
@@ -1041,11 +1224,16 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 				}
 			}
 		}
+		add_done:
 		*sp++ = ERASE;
 		Next;
 	Instr(Sub)
+		QuickenOp(Sub)
+	Instr(SubGen)
 		NumberOp(-,SUB,id_sub,id_rsub)
 	Instr(Mult)
+		QuickenOp(Mult)
+	Instr(MultGen)
 		NumberOp(*,MULT,id_mult,id_rmult)
 	Instr(Div)
 		if( val_is_number(acc) && val_is_number(*sp) )
@@ -1085,23 +1273,35 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 	Instr(Xor)
 		IntOp(^);
 	Instr(Eq)
+		QuickenOp(Eq)
+	Instr(EqGen)
 		Test(==)
 	Instr(Neq)
+		QuickenOp(Neq)
+	Instr(NeqGen)
 		BeginCall();
 		acc = (int_val)((val_compare((value)*sp,(value)acc) == 0)?val_false:val_true);
 		EndCall();
 		*sp++ = ERASE;
 		Next;
 	Instr(Lt)
+		QuickenOp(Lt)
+	Instr(LtGen)
 		Test(<)
 	Instr(Lte)
+		QuickenOp(Lte)
+	Instr(LteGen)
 		Test(<=)
 	Instr(Gt)
+		QuickenOp(Gt)
+	Instr(GtGen)
 		Test(>)
 	Instr(Gte)
+		QuickenOp(Gte)
+	Instr(GteGen)
 		Test(>=)
 	Instr(TypeOf)
-		acc = (int_val)(val_is_int(acc) ? alloc_int(1) : NEKO_TYPEOF[val_short_tag(acc)]);
+		acc = (int_val)(val_is_int(acc) ? alloc_int(1) : NEKO_TYPEOF[IsRope(acc) ? VAL_STRING : val_short_tag(acc)]);
 		Next;
 	Instr(Compare)
 		BeginCall();
@@ -1111,10 +1311,13 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 		*sp++ = ERASE;
 		Next;
 	Instr(PhysCompare)
+		Flatten(*sp);
+		Flatten(acc);
 		acc = (int_val)(( *sp > acc )?alloc_int(1):(( *sp < acc )?alloc_int(-1):alloc_int(0)));
 		*sp++ = ERASE;
 		Next;
 	Instr(Hash)
+		Flatten(acc);
 		if( val_is_string(acc) ) {
 			BeginCall();
 			acc = (int_val)alloc_int( val_id(val_string(acc)) );
@@ -1134,6 +1337,140 @@ int_val neko_interp_loop( neko_vm *VM_ARG, neko_module *m, int_val _acc, int_val
 	Instr(Loop)
 		// space for GC/Debug
 		Next;
+	Instr(AccStackPush)
+		acc = sp[*pc];
+		pc += 2;
+		--sp;
+		if( sp <= csp ) STACK_EXPAND;
+		*sp = acc;
+		Next;
+	Instr(AccStack0Push)
+		acc = *sp;
+		pc++;
+		--sp;
+		if( sp <= csp ) STACK_EXPAND;
+		*sp = acc;
+		Next;
+	Instr(AccStack1Push)
+		acc = sp[1];
+		pc++;
+		--sp;
+		if( sp <= csp ) STACK_EXPAND;
+		*sp = acc;
+		Next;
+	Instr(AddInt)
+		if( *sp & 1 ) {
+			acc = (int_val)alloc_best_int(val_int(*sp) + val_int(*pc));
+			*sp++ = ERASE;
+			pc += 2;
+		} else
+			acc = *pc++;
+		Next;
+	Instr(SubInt)
+		if( *sp & 1 ) {
+			acc = (int_val)alloc_best_int(val_int(*sp) - val_int(*pc));
+			*sp++ = ERASE;
+			pc += 2;
+		} else
+			acc = *pc++;
+		Next;
+	Instr(AddII)
+		QuickIntOp(+,Add)
+	Instr(AddFF)
+		QuickFloatOp(+,Add)
+	Instr(SubII)
+		QuickIntOp(-,Sub)
+	Instr(SubFF)
+		QuickFloatOp(-,Sub)
+	Instr(MultII)
+		QuickIntOp(*,Mult)
+	Instr(MultFF)
+		QuickFloatOp(*,Mult)
+	Instr(EqII)
+		QuickIntTest(==,Eq)
+	Instr(EqFF)
+		QuickFloatTest(==,Eq)
+	Instr(NeqII)
+		QuickIntTest(!=,Neq)
+	Instr(NeqFF)
+		QuickFloatTest(!=,Neq)
+	Instr(LtII)
+		QuickIntTest(<,Lt)
+	Instr(LtFF)
+		QuickFloatTest(<,Lt)
+	Instr(LteII)
+		QuickIntTest(<=,Lte)
+	Instr(LteFF)
+		QuickFloatTest(<=,Lte)
+	Instr(GtII)
+		QuickIntTest(>,Gt)
+	Instr(GtFF)
+		QuickFloatTest(>,Gt)
+	Instr(GteII)
+		QuickIntTest(>=,Gte)
+	Instr(GteFF)
+		QuickFloatTest(>=,Gte)
+	Instr(EqJumpIfNot)
+		TestJumpIfNot(==)
+	Instr(NeqJumpIfNot)
+		if( (acc & 1) && (*sp & 1) )
+			acc = (int_val)((*sp != acc)?val_true:val_false);
+		else if( IsFloatPair() )
+			acc = (int_val)((val_float(*sp) != val_float(acc))?val_true:val_false);
+		else {
+			BeginCall();
+			acc = (int_val)((val_compare((value)*sp,(value)acc) == 0)?val_false:val_true);
+			EndCall();
+		}
+		*sp++ = ERASE;
+		if( acc != (int_val)val_true )
+			pc = (int_val*)pc[1];
+		else
+			pc += 2;
+		Next;
+	Instr(LtJumpIfNot)
+		TestJumpIfNot(<)
+	Instr(LteJumpIfNot)
+		TestJumpIfNot(<=)
+	Instr(GtJumpIfNot)
+		TestJumpIfNot(>)
+	Instr(GteJumpIfNot)
+		TestJumpIfNot(>=)
+	Instr(Verify)
+		BeginCall();
+		neko_module_verify(m,pc - 1);
+		EndCall();
+		pc--;
+		Next;
+	Instr(TierJump)
+		ProfPoll(pc - 1);
+		{
+			neko_tier *t = (neko_tier*)m->tier;
+			int_val *target = (int_val*)*pc;
+			void *native = t->native[target - m->code];
+			if( native == NULL && ++t->counts[pc - 1 - m->code] == TIER_LOOPS ) {
+				t->counts[pc - 1 - m->code] = 0;
+				BeginCall();
+				native = neko_tier_hot(m,target);
+			}
+			// the native code can't pop a trap set by the interpreter in this call
+			if( native != NULL && (vm->trap == 0 || val_int((vm->spmax - vm->trap)[0]) != csp - vm->spmin || (vm->spmax - vm->trap)[4] == (int_val)val_null) ) {
+				unsigned int p = (unsigned int)(target - m->code);
+				int global = p >= t->main && p < t->main_end;
+				BeginCall();
+				// the slots below belong to the callers of this interpreter
+				tier_flatten(sp,stack_bottom);
+				Flatten(acc);
+				acc = ((jit_prim)jit_boot_seq)(vm,native,(value)acc,m);
+				EndCall();
+				if( global )
+					goto end;
+				PopInfos(true);
+				Next;
+			}
+			pc = target;
+		}
+		Next;
 	Instr(Last)
 		goto end;
 #ifdef NEKO_VCC
@@ -1149,7 +1486,7 @@ end:
 
 int_val *neko_get_ttable() {
 #	ifdef NEKO_THREADED
-	return (int_val*)neko_interp_loop(NULL,NULL,0,NULL);
+	return (int_val*)neko_interp_loop(NULL,NULL,0,NULL,NULL);
 #	else
 	return NULL;
 #	endif
@@ -1160,6 +1497,23 @@ value neko_interp( neko_vm *vm, void *_m, int_val acc, int_val *pc ) {
 	int_val init_sp = vm->spmax - vm->sp;
 	neko_module *m = (neko_module*)_m;
 	jmp_buf old;
+	if( m->tier != NULL && pc != m->code ) {
+		void *native = tier_entry(m,pc,acc);
+		if( native != NULL ) {
+			// C callers pass null and never hold ropes
+			if( !(acc & 1) && (val_tag(acc) == VAL_FUNCTION || val_tag(acc) == VAL_JITFUN) )
+				tier_flatten(vm->sp,vm->sp + ((vfunction*)acc)->nargs);
+			// pop the call infos as Ret would do
+			acc = ((jit_prim)jit_boot_seq)(vm,native,(value)acc,m);
+			csp = vm->csp;
+			vm->vthis = (value)csp[-1];
+			vm->env = (value)csp[-2];
+			csp[0] = csp[-1] = csp[-2] = csp[-3] = ERASE;
+			vm->csp = csp - 4;
+			Flatten(acc);
+			return (value)acc;
+		}
+	}
 	memcpy(&old,&vm->start,sizeof(jmp_buf));
 	if( setjmp(vm->start) ) {
 		acc = (int_val)vm->vthis;
@@ -1211,7 +1565,8 @@ value neko_interp( neko_vm *vm, void *_m, int_val acc, int_val *pc ) {
 	if( m->jit != NULL && m->code == pc )
 		acc = ((jit_prim)jit_boot_seq)(vm,m->jit,(value)acc,m);
 	else
-		acc = neko_interp_loop(vm,m,acc,pc);
+		acc = neko_interp_loop(vm,m,acc,pc,vm->spmax - init_sp);
+	Flatten(acc);
 	memcpy(&vm->start,&old,sizeof(jmp_buf));
 	return (value)acc;
 }
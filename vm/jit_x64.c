@@ -0,0 +1,2362 @@
+/*
+ * Copyright (C)2005-2022 Haxe Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include "vm.h"
+#include "neko_mod.h"
+#include "objtable.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdio.h>
+
+/*
+	x86-64 (System V ABI) JIT backend.
+
+	This follows the design of jit_x86.c : the VM registers live in
+	callee-saved machine registers, every opcode is translated to a
+	fixed sequence and the slow paths call small C helpers that emulate
+	the interpreter. The main differences are :
+	- arguments to C functions are passed in registers
+	- the native stack must be 16-bytes aligned before any call
+	- the pc of the current opcode is passed to the stubs in PCREG
+	- 64-bit constants need a full movabs
+*/
+
+#if defined(NEKO_JIT_ENABLE) && defined(NEKO_X64)
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#define tmp_alloc(size) malloc(size)
+#define tmp_free(ptr)	free(ptr)
+
+#define TAG_MASK		((1<<NEKO_TAG_BITS)-1)
+
+#define PARAMETER_TABLE
+#include "opcodes.h"
+
+extern field id_add, id_radd, id_sub, id_rsub, id_mult, id_rmult, id_div, id_rdiv, id_mod, id_rmod;
+extern field id_get, id_set;
+
+extern int neko_stack_expand( int_val *sp, int_val *csp, neko_vm *vm );
+extern value neko_append_int( neko_vm *vm, value str, int x, bool way );
+extern value neko_alloc_module_function( void *m, int_val pos, int nargs );
+extern void neko_process_trap( neko_vm *vm );
+extern void neko_setup_trap( neko_vm *vm );
+extern value NEKO_TYPEOF[];
+
+typedef union {
+	void *p;
+	unsigned char *b;
+	unsigned int *w;
+	int_val *q;
+	char *c;
+	int *i;
+} jit_buffer;
+
+typedef struct _jlist {
+	int pos;
+	int target;
+	struct _jlist *next;
+} jlist;
+
+typedef struct {
+	jit_buffer buf;
+	void *baseptr;
+	neko_module *module;
+	int curpc;
+	int size;
+	int *pos;
+	jlist *jumps;
+	jlist *traps;
+} jit_ctx;
+
+enum Special {
+	VThis,
+	VEnv,
+	VModule,
+	VSpMax,
+	VTrap,
+};
+
+enum PushInfosMode {
+	CALLBACK,
+	PC_ARG
+};
+
+enum CallMode {
+	NORMAL,
+	THIS_CALL,
+	TAIL_CALL,
+};
+
+enum Operation {
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+};
+
+enum IOperation {
+	IOP_SHL,
+	IOP_SHR,
+	IOP_USHR,
+	IOP_AND,
+	IOP_OR,
+	IOP_XOR,
+};
+
+#define Rax 0
+#define Rcx 1
+#define Rdx 2
+#define Rbx 3
+#define Rsp 4
+#define Rbp 5
+#define Rsi 6
+#define Rdi 7
+#define R8	8
+#define R9	9
+#define R10	10
+#define R11	11
+#define R12	12
+#define R13	13
+#define R14	14
+#define R15	15
+
+#define Xmm0	0
+#define Xmm1	1
+
+#define ACC		Rax
+#define VM		Rbx
+#define SP		R14
+#define CSP		R15
+#define TMP		Rcx
+#define TMP2	Rdx
+#define PCREG	R10
+#define CALLREG	R11
+
+// C arguments
+#define Arg0	Rdi
+#define Arg1	Rsi
+#define Arg2	Rdx
+#define Arg3	Rcx
+#define Arg4	R8
+#define Arg5	R9
+
+static const int call_args[] = { Arg0, Arg1, Arg2, Arg3, Arg4, Arg5 };
+
+#define B(bv)	*buf.b++ = (unsigned char)(bv)
+#define W(wv)	*buf.w++ = (unsigned int)(wv)
+#define Q(qv)	*buf.q++ = (int_val)(qv)
+
+#define JAlways		0
+#define JLt			0x82
+#define JGte		0x83
+#define JEq			0x84
+#define JNeq		0x85
+#define JLte		0x86
+#define JGt			0x87
+#define JSignLt		0x8C
+#define JSignGte	0x8D
+#define JSignLte	0x8E
+#define JSignGt		0x8F
+#define JOverflow	0x80
+
+#define ERROR	{ tmp_free(ctx->pos); tmp_free(ctx->baseptr); failure("JIT error"); }
+#define CONST(v)				((int_val)(v))
+
+#define PATCH_JUMP(local)		if( local != NULL ) { \
+		int delta = (int)((int_val)buf.p - ((int_val)local + 1)); \
+		if( sizeof(*local) == sizeof(int) ) \
+			*local = delta - 3; \
+		else { \
+			if( delta > 127 || delta < -127 ) \
+				ERROR; \
+			*local = (char)delta; \
+		} \
+	} \
+
+#define FIELD(n)				((n) * 8)
+#define VMFIELD(f)				((int)(int_val)&((neko_vm*)0)->f)
+#define FUNFIELD(f)				((int)(int_val)&((vfunction*)0)->f)
+#define FLOATFIELD				((int)(int_val)&((vfloat*)0)->f)
+
+#define POS()					((int)((int_val)ctx->buf.p - (int_val)ctx->baseptr))
+#define GET_PC()				CONST(ctx->module->code + ctx->curpc)
+
+#define INIT_BUFFER				register jit_buffer buf = ctx->buf
+#define END_BUFFER				ctx->buf = buf
+
+#define IS_SBYTE(c)				( (c) >= -128 && (c) < 128 )
+#define IS_SINT(c)				( (c) == (int_val)(int)(c) )
+
+#define REX(w,r,x,b)			{ \
+		int __rex = ((w)?8:0) | (((r)&8)?4:0) | (((x)&8)?2:0) | (((b)&8)?1:0); \
+		if( __rex ) B(0x40 | __rex); \
+	}
+#define MOD_RM(mod,reg,rm)		B(((mod) << 6) | (((reg)&7) << 3) | ((rm)&7))
+#define SIB						MOD_RM
+
+// [base + disp]
+#define MEM(reg,base,disp)		{ \
+		int __d = (disp); \
+		int __rm = (base) & 7; \
+		if( __d == 0 && __rm != Rbp ) { \
+			MOD_RM(0,reg,base); \
+			if( __rm == Rsp ) B(0x24); \
+		} else if( IS_SBYTE(__d) ) { \
+			MOD_RM(1,reg,base); \
+			if( __rm == Rsp ) B(0x24); \
+			B(__d); \
+		} else { \
+			MOD_RM(2,reg,base); \
+			if( __rm == Rsp ) B(0x24); \
+			W(__d); \
+		} \
+	}
+
+#define OP_RR(w,op,reg,rm)			{ REX(w,reg,0,rm); B(op); MOD_RM(3,reg,rm); }
+#define OP_RR2(w,op,reg,rm)			{ REX(w,reg,0,rm); B(0x0F); B(op); MOD_RM(3,reg,rm); }
+#define OP_RM(w,op,reg,base,disp)	{ REX(w,reg,0,base); B(op); MEM(reg,base,disp); }
+#define OP_RC(w,ext,r,cst)			{ \
+		int __c = (int)(cst); \
+		if( IS_SBYTE(__c) ) { OP_RR(w,0x83,ext,r); B(__c); } \
+		else { OP_RR(w,0x81,ext,r); W(__c); } \
+	}
+
+// OPCODES :
+// _r : register
+// _c : constant
+// _p : [reg + constant:idx]
+// _x : [reg + reg:idx * 8]
+// 32 suffix : operate on the low 32 bits
+
+#define XRet()					B(0xC3)
+#define XMov_rr(dst,src)		OP_RR(1,0x8B,dst,src)
+#define XMov32_rr(dst,src)		OP_RR(0,0x8B,dst,src)
+#define XMov_rc(dst,cst)		{ \
+		int_val __v = (int_val)(cst); \
+		if( IS_SINT(__v) ) { OP_RR(1,0xC7,0,dst); W((int)__v); } \
+		else { REX(1,0,0,dst); B(0xB8 + ((dst)&7)); Q(__v); } \
+	}
+#define XMov_rp(dst,reg,idx)	OP_RM(1,0x8B,dst,reg,idx)
+#define XMov32_rp(dst,reg,idx)	OP_RM(0,0x8B,dst,reg,idx)
+#define XMov_pr(reg,idx,src)	OP_RM(1,0x89,src,reg,idx)
+#define XMov_pc(reg,idx,c)		{ OP_RM(1,0xC7,0,reg,idx); W(c); }
+#define XMov_rx(dst,r,idx,d)	{ REX(1,dst,idx,r); B(0x8B); MOD_RM(1,dst,4); SIB(3,idx,r); B(d); }
+#define XMov_xr(r,idx,d,src)	{ REX(1,src,idx,r); B(0x89); MOD_RM(1,src,4); SIB(3,idx,r); B(d); }
+#define XLea_rp(dst,reg,idx)	OP_RM(1,0x8D,dst,reg,idx)
+#define XMovsxd_rr(dst,src)		OP_RR(1,0x63,dst,src)
+
+#define XCall_r(r)				OP_RR(0,0xFF,2,r)
+#define XCall_m(v)				{ XMov_rc(CALLREG,CONST(v)); XCall_r(CALLREG); }
+#define XJump_r(r)				OP_RR(0,0xFF,4,r)
+#define XJump(how,local)		if( (how) == JAlways ) { B(0xE9); } else { B(0x0F); B(how); }; local = buf.i; W(0)
+#define XJump_near(local)		B(0xEB); local = buf.c; B(0)
+
+#define XPush_r(r)				{ if( (r) & 8 ) B(0x41); B(0x50 + ((r)&7)); }
+#define XPop_r(r)				{ if( (r) & 8 ) B(0x41); B(0x58 + ((r)&7)); }
+#define XPush_p(reg,idx)		OP_RM(0,0xFF,6,reg,idx)
+
+#define XAdd_rc(r,cst)			OP_RC(1,0,r,cst)
+#define XOr_rc(r,cst)			OP_RC(1,1,r,cst)
+#define XAnd_rc(r,cst)			OP_RC(1,4,r,cst)
+#define XSub_rc(r,cst)			OP_RC(1,5,r,cst)
+#define XCmp_rc(r,cst)			OP_RC(1,7,r,cst)
+#define XOr32_rc(r,cst)			OP_RC(0,1,r,cst)
+#define XAnd32_rc(r,cst)		OP_RC(0,4,r,cst)
+#define XCmp32_rc(r,cst)		OP_RC(0,7,r,cst)
+#define XCmp32_pc(reg,idx,cst)	{ OP_RM(0,0x83,7,reg,idx); B(cst); }
+
+#define XAdd_rr(dst,src)		OP_RR(1,0x03,dst,src)
+#define XSub_rr(dst,src)		OP_RR(1,0x2B,dst,src)
+#define XAnd_rr(dst,src)		OP_RR(1,0x23,dst,src)
+#define XCmp_rr(r1,r2)			OP_RR(1,0x3B,r1,r2)
+#define XAdd32_rr(dst,src)		OP_RR(0,0x03,dst,src)
+#define XSub32_rr(dst,src)		OP_RR(0,0x2B,dst,src)
+#define XAnd32_rr(dst,src)		OP_RR(0,0x23,dst,src)
+#define XOr32_rr(dst,src)		OP_RR(0,0x0B,dst,src)
+#define XXor32_rr(dst,src)		OP_RR(0,0x33,dst,src)
+#define XIMul32_rr(dst,src)		OP_RR2(0,0xAF,dst,src)
+#define XIDiv32_r(r)			OP_RR(0,0xF7,7,r)
+#define XTest_rr(r,src)			OP_RR(1,0x85,src,r)
+#define XTest32_rr(r,src)		OP_RR(0,0x85,src,r)
+#define XTest32_rc(r,cst)		{ OP_RR(0,0xF7,0,r); W(cst); }
+#define XCdq()					B(0x99)
+
+#define shift_r(w,r,spec)		OP_RR(w,0xD3,spec,r)
+#define shift_c(w,r,n,spec)		if( (n) == 1 ) { OP_RR(w,0xD1,spec,r); } else { OP_RR(w,0xC1,spec,r); B(n); }
+
+#define XShl_rc(r,n)			shift_c(1,r,n,4)
+#define XShr_rc(r,n)			shift_c(1,r,n,7)
+#define XShl32_rc(r,n)			shift_c(0,r,n,4)
+#define XShr32_rc(r,n)			shift_c(0,r,n,7)
+#define XUShr32_rc(r,n)			shift_c(0,r,n,5)
+#define XShl32_rr(r,src)		if( src != Rcx ) ERROR; shift_r(0,r,4)
+#define XShr32_rr(r,src)		if( src != Rcx ) ERROR; shift_r(0,r,7)
+#define XUShr32_rr(r,src)		if( src != Rcx ) ERROR; shift_r(0,r,5)
+
+// SSE2
+#define sse_op(op,xmm,rm)		{ B(0xF2); REX(0,xmm,0,rm); B(0x0F); B(op); MOD_RM(3,xmm,rm); }
+#define sse_op_p(op,xmm,reg,idx) { B(0xF2); REX(0,xmm,0,reg); B(0x0F); B(op); MEM(xmm,reg,idx); }
+#define XMovsd_rp(xmm,reg,idx)	sse_op_p(0x10,xmm,reg,idx)
+#define XAddsd_rp(xmm,reg,idx)	sse_op_p(0x58,xmm,reg,idx)
+#define XMulsd_rp(xmm,reg,idx)	sse_op_p(0x59,xmm,reg,idx)
+#define XSubsd_rp(xmm,reg,idx)	sse_op_p(0x5C,xmm,reg,idx)
+#define XDivsd_rp(xmm,reg,idx)	sse_op_p(0x5E,xmm,reg,idx)
+#define XDivsd_rr(dst,src)		sse_op(0x5E,dst,src)
+#define XCvtsi2sd_rr(xmm,r)		sse_op(0x2A,xmm,r)
+
+#define is_int(r,flag,local)	{ XTest32_rc(r,1); XJump((flag)?JNeq:JEq,local); }
+#ifdef NEKO_IMMEDIATE_FLOATS
+// jump if the value is an int or an immediate float
+#	define is_imm(r,local)		{ XTest32_rc(r,3); XJump(JNeq,local); }
+#else
+#	define is_imm(r,local)		is_int(r,true,local)
+#endif
+
+#define stack_push(r,n) \
+	if( (n) != 0 ) { \
+		if( (r) == CSP ) { \
+			XAdd_rc(r,(n) * 8); \
+		} else { \
+			XSub_rc(r,(n) * 8); \
+		} \
+	}
+
+#define stack_pop(r,n) \
+	if( (n) != 0 ) { \
+		if( (r) == CSP ) { \
+			XSub_rc(r,(n) * 8); \
+		} else { \
+			XAdd_rc(r,(n) * 8); \
+		} \
+	}
+
+// the jitted code runs with rsp = 8 (mod 16), so we need to pad
+// the native stack when calling C from the body of a function
+#define call_c(v)		{ stack_push(Rsp,1); XCall_m(v); stack_pop(Rsp,1); }
+
+#define begin_call()	{ XMov_pr(VM,VMFIELD(sp),SP); XMov_pr(VM,VMFIELD(csp),CSP); }
+#define end_call()		{ XMov_rp(SP,VM,VMFIELD(sp)); XMov_rp(CSP,VM,VMFIELD(csp)); }
+#define label(code)		{ XMov_rc(CALLREG,CONST(code)); XCall_r(CALLREG); }
+
+#define pop(n) if( (n) != 0 ) { \
+		int i = (n); \
+		while( i-- > 0 ) { \
+			XMov_pc(SP,FIELD(i),0); \
+		} \
+		stack_pop(SP,n); \
+	}
+
+#define pop_loop(n) { \
+		char *start; \
+		int *loop; \
+		XMov_rc(TMP,n); \
+		start = buf.c; \
+		XMov_pc(SP,FIELD(0),0); \
+		stack_pop(SP,1); \
+		XSub_rc(TMP,1); \
+		XJump(JNeq,loop); \
+		*loop = (int)(start - buf.c); \
+	}
+
+#define pop_any(n) if( (n) > 10 ) { pop_loop(n); } else { pop(n); }
+
+// error with the pc already in PCREG (inside the stubs)
+#define runtime_error_pc(msg_id) { \
+	XMov_rc(Arg1,CONST(strings[msg_id])); \
+	XMov_rc(CALLREG,CONST(code->runtime_error)); \
+	XJump_r(CALLREG); \
+}
+
+#define runtime_error(msg_id) { \
+	XMov_rc(PCREG,GET_PC()); \
+	runtime_error_pc(msg_id); \
+}
+
+#define get_var_r(reg,v) { \
+	switch( v ) { \
+	case VThis: \
+		XMov_rp(reg,VM,VMFIELD(vthis)); \
+		break; \
+	case VEnv: \
+		XMov_rp(reg,VM,VMFIELD(env)); \
+		break; \
+	case VModule: \
+		XMov_rp(reg,VM,VMFIELD(jit_val)); \
+		break; \
+	case VSpMax: \
+		XMov_rp(reg,VM,VMFIELD(spmax)); \
+		break; \
+	case VTrap: \
+		XMov_rp(reg,VM,VMFIELD(trap)); \
+		break; \
+	default: \
+		ERROR; \
+		break; \
+	} \
+}
+
+#define get_var_p(reg,idx,v) { \
+	get_var_r(TMP,v); \
+	XMov_pr(reg,idx,TMP); \
+}
+
+#define set_var_r(v,reg) { \
+	switch( v ) { \
+	case VThis: \
+		XMov_pr(VM,VMFIELD(vthis),reg); \
+		break; \
+	case VEnv: \
+		XMov_pr(VM,VMFIELD(env),reg); \
+		break; \
+	case VTrap: \
+		XMov_pr(VM,VMFIELD(trap),reg); \
+		break; \
+	case VModule: \
+		XMov_pr(VM,VMFIELD(jit_val),reg); \
+		break; \
+	default: \
+		ERROR; \
+		break; \
+	} \
+}
+
+#define set_var_p(v,reg,idx) { \
+	XMov_rp(TMP,reg,idx); \
+	set_var_r(v,TMP); \
+}
+
+#define jump(how,targ) { \
+	jlist *j = (jlist*)alloc(sizeof(jlist)); \
+	void *jcode; \
+	j->target = (int)((int_val*)(int_val)(targ) - ctx->module->code); \
+	j->next = ctx->jumps; \
+	ctx->jumps = j; \
+	XJump(how,jcode); \
+	j->pos = (int)((int_val)jcode - (int_val)ctx->baseptr); \
+}
+
+#define pop_infos() { \
+	set_var_p(VModule,CSP,FIELD(0)); \
+	set_var_p(VThis,CSP,FIELD(-1)); \
+	set_var_p(VEnv,CSP,FIELD(-2)); \
+	XMov_pc(CSP,FIELD(0),0); \
+	XMov_pc(CSP,FIELD(-1),0); \
+	XMov_pc(CSP,FIELD(-2),0); \
+	XMov_pc(CSP,FIELD(-3),0); \
+	stack_pop(CSP,4); \
+}
+
+#define setup_before_call(mode,is_callb) { \
+	push_infos(is_callb?CALLBACK:PC_ARG); \
+	if( !is_callb ) { XPush_r(ACC); } \
+	if( mode == THIS_CALL ) { \
+		set_var_p(VThis,SP,FIELD(0)); \
+		pop(1); \
+	} \
+	set_var_p(VEnv,ACC,FUNFIELD(env)); \
+}
+
+// the function is saved on the native stack at [rsp+pad]
+#define restore_after_call(pad) { \
+	int *jok; \
+	XCmp_rc(ACC,0); \
+	XJump(JNeq,jok); \
+	XMov_rp(ACC,Rsp,pad); \
+	XMov_rp(Arg0,ACC,FUNFIELD(module)); \
+	XCall_m(val_throw); \
+	PATCH_JUMP(jok); \
+	stack_pop(Rsp,1 + (pad) / 8); \
+	pop_infos(); \
+}
+
+#define NARGS (CALL_MAX_ARGS + 1)
+
+typedef struct {
+	char *boot;
+	char *stack_expand;
+	char *runtime_error;
+	char *call_normal_jit[NARGS];
+	char *call_this_jit[NARGS];
+	char *call_tail_jit[NARGS];
+	char *call_normal_prim[NARGS];
+	char *call_this_prim[NARGS];
+	char *call_tail_prim[NARGS];
+	char *call_normal_fun[NARGS];
+	char *call_this_fun[NARGS];
+	char *call_tail_fun[NARGS];
+	char *handle_trap;
+} jit_code;
+
+char *jit_boot_seq = NULL;
+char *jit_handle_trap = NULL;
+static jit_code *code;
+
+static value *strings;
+static const char *cstrings[] = {
+	"Stack overflow", // 0
+	"Reading Outside Env", // 1
+	"Writing Outside Env", // 2
+	"Invalid call", // 3
+	"Invalid array access", // 4
+	"Invalid field access", // 5
+	"Invalid environment", // 6
+	"Invalid operation (%)", // 7
+	"$apply", // 8
+	"Invalid End Trap", // 9
+	"$hash", // 10
+};
+
+#define DEFINE_PROC(p,arg) ctx->buf = buf; jit_##p(ctx,arg); buf = ctx->buf
+#define push_infos(arg) DEFINE_PROC(push_infos,arg)
+#define test(arg)		DEFINE_PROC(test,arg)
+#define call(mode,nargs) ctx->buf = buf; jit_call(ctx,mode,nargs); buf = ctx->buf
+#define number_op(arg)	DEFINE_PROC(number_op,arg)
+#define array_access(p)	DEFINE_PROC(array_access,p)
+#define int_op(arg)		DEFINE_PROC(int_op,arg)
+#define best_int()		DEFINE_PROC(best_int,0)
+
+// ------------------- INTERP EMULATION
+
+#define STACK_EXPAND if( !neko_stack_expand(vm->sp,vm->csp,vm) ) val_throw(alloc_string("Stack Overflow"))
+
+#define ERASE 0
+
+#define ACC_BACKUP
+#define ACC_RESTORE
+
+#define PushInfos() \
+		if( vm->csp + 4 >= vm->sp ) STACK_EXPAND; \
+		*++vm->csp = pc; \
+		*++vm->csp = (int_val)vm->env; \
+		*++vm->csp = (int_val)vm->vthis; \
+		*++vm->csp = (int_val)vm->jit_val;
+
+#define PopInfos(restpc) \
+		vm->jit_val = (void*)*vm->csp; \
+		*vm->csp-- = ERASE; \
+		vm->vthis = (value)*vm->csp; \
+		*vm->csp-- = ERASE; \
+		vm->env = (value)*vm->csp; \
+		*vm->csp-- = ERASE; \
+		if( restpc ) pc = *vm->csp; \
+		*vm->csp-- = ERASE;
+
+#define BeginCall()
+#define EndCall()
+
+#define RuntimeError(err)	{ PushInfos(); BeginCall(); val_throw(alloc_string(err)); }
+
+#define ObjectOpGen(obj,param,id,err) { \
+		value _o = (value)obj; \
+		value _arg = (value)param; \
+		value _f = val_field(_o,id); \
+		if( _f == val_null ) { \
+			err; \
+		} else { \
+			PushInfos(); \
+			BeginCall(); \
+			acc = (int_val)val_callEx(_o,_f,&_arg,1,NULL); \
+			EndCall(); \
+			PopInfos(false); \
+		} \
+	}
+
+#define ObjectOp(obj,param,id) ObjectOpGen(obj,param,id,RuntimeError("Unsupported operation"))
+
+#define OpError(op) RuntimeError("Invalid operation (" op ")")
+
+static int_val generic_add( neko_vm *vm, int_val acc, int_val sp, int_val pc ) {
+	if( acc & 1 ) {
+		if( val_tag(sp) == VAL_FLOAT )
+			acc = (int_val)alloc_float(val_float(sp) + val_int(acc));
+		else if( val_tag(sp) == VAL_INT32 )
+			acc = (int_val)alloc_best_int(val_int32(sp) + val_int(acc));
+		else if( val_short_tag(sp) == VAL_STRING  )
+			acc = (int_val)neko_append_int(vm,(value)sp,val_int(acc),true);
+		else if( val_tag(sp) == VAL_OBJECT )
+			ObjectOp(sp,acc,id_add)
+		else
+			OpError("+");
+	} else if( sp & 1 ) {
+		if( val_tag(acc) == VAL_FLOAT )
+			acc = (int_val)alloc_float(val_int(sp) + val_float(acc));
+		else if( val_tag(acc) == VAL_INT32 )
+			acc = (int_val)alloc_best_int(val_int(sp) + val_int32(acc));
+		else if( val_short_tag(acc) == VAL_STRING )
+			acc = (int_val)neko_append_int(vm,(value)acc,val_int(sp),false);
+		else if( val_tag(acc) == VAL_OBJECT )
+			ObjectOp(acc,sp,id_radd)
+		else
+			OpError("+");
+	} else if( val_tag(acc) == VAL_FLOAT ) {
+		if( val_tag(sp) == VAL_FLOAT )
+			acc = (int_val)alloc_float(val_float(sp) + val_float(acc));
+		else if( val_tag(sp) == VAL_INT32 )
+			acc = (int_val)alloc_float(val_int32(sp) + val_float(acc));
+		else
+			goto add_next;
+	} else if( val_tag(acc) == VAL_INT32 ) {
+		if( val_tag(sp) == VAL_INT32 )
+			acc = (int_val)alloc_best_int(val_int32(sp) + val_int32(acc));
+		else if( val_tag(sp) == VAL_FLOAT )
+			acc = (int_val)alloc_float(val_float(sp) + val_int32(acc));
+		else
+			goto add_next;
+	} else {
+	add_next:
+		if( val_tag(sp) == VAL_OBJECT )
+			ObjectOpGen(sp,acc,id_add,goto add_2)
+		else {
+			add_2:
+			if( val_tag(acc) == VAL_OBJECT )
+				ObjectOpGen(acc,sp,id_radd,goto add_3)
+			else {
+				add_3:
+				if( val_short_tag(acc) == VAL_STRING || val_short_tag(sp) == VAL_STRING ) {
+					ACC_BACKUP
+					buffer b = alloc_buffer(NULL);
+					BeginCall();
+					val_buffer(b,(value)sp);
+					ACC_RESTORE;
+					val_buffer(b,(value)acc);
+					EndCall();
+					acc = (int_val)buffer_to_string(b);
+				} else
+					OpError("+");
+			}
+		}
+	}
+	return acc;
+}
+
+#define NumberOp(op,fop,id_op,id_rop) \
+		if( acc & 1 ) { \
+			if( val_tag(sp) == VAL_FLOAT ) \
+				acc = (int_val)alloc_float(fop(val_float(sp),val_int(acc))); \
+			else if( val_tag(sp) == VAL_INT32 ) \
+				acc = (int_val)alloc_best_int(val_int32(sp) op val_int(acc)); \
+			else if( val_tag(sp) == VAL_OBJECT ) \
+			    ObjectOp(sp,acc,id_op) \
+			else \
+				OpError(#op); \
+		} else if( sp & 1 ) { \
+			if( val_tag(acc) == VAL_FLOAT ) \
+				acc = (int_val)alloc_float(fop(val_int(sp),val_float(acc))); \
+			else if( val_tag(acc) == VAL_INT32 ) \
+				acc = (int_val)alloc_best_int(val_int(sp) op val_int32(acc)); \
+			else if( val_tag(acc) == VAL_OBJECT ) \
+				ObjectOp(acc,sp,id_rop) \
+			else \
+				OpError(#op); \
+		} else if( val_tag(acc) == VAL_FLOAT ) { \
+			if( val_tag(sp) == VAL_FLOAT ) \
+				acc = (int_val)alloc_float(fop(val_float(sp),val_float(acc))); \
+			else if( val_tag(sp) == VAL_INT32 ) \
+				acc = (int_val)alloc_float(fop(val_int32(sp),val_float(acc))); \
+			else \
+				goto id_op##_next; \
+		} else if( val_tag(acc) == VAL_INT32 ) {\
+			if( val_tag(sp) == VAL_INT32 ) \
+				acc = (int_val)alloc_best_int(val_int32(sp) op val_int32(acc)); \
+			else if( val_tag(sp) == VAL_FLOAT ) \
+				acc = (int_val)alloc_float(fop(val_float(sp),val_int32(acc))); \
+			else \
+				goto id_op##_next; \
+		} else { \
+			id_op##_next: \
+			if( val_tag(sp) == VAL_OBJECT ) \
+				ObjectOpGen(sp,acc,id_op,goto id_op##_next2) \
+			else { \
+				id_op##_next2: \
+				if( val_tag(acc) == VAL_OBJECT ) \
+					ObjectOp(acc,sp,id_rop) \
+				else \
+					OpError(#op); \
+			} \
+		}
+
+#define SUB(x,y) ((x) - (y))
+#define MULT(x,y) ((x) * (y))
+
+#define GENERIC_OP(id,op,fop) \
+	static int_val generic_##id( neko_vm *vm, int_val acc, int_val sp, int_val pc ) { \
+		NumberOp(op,fop,id_##id,id_r##id); \
+		return acc; \
+	}
+
+GENERIC_OP(sub,-,SUB);
+GENERIC_OP(mult,*,MULT);
+
+static int_val generic_div( neko_vm *vm, int_val acc, int_val sp, int_val pc ) {
+	if( val_is_number(acc) && val_is_number(sp) )
+		acc = (int_val)alloc_float( ((tfloat)val_number(sp)) / val_number(acc) );
+	else if( val_is_object(sp) )
+		ObjectOpGen(sp,acc,id_div,goto div_next)
+	else {
+		div_next:
+		if( val_is_object(acc) )
+			ObjectOp(acc,sp,id_rdiv)
+		else
+			OpError("/");
+	}
+	return acc;
+}
+
+static int_val generic_mod( neko_vm *vm, int_val acc, int_val sp, int_val pc ) {
+	if( (acc == 1 || (val_is_int32(acc) && val_int32(acc)==0)) && val_is_any_int(sp) )
+		OpError("%");
+	NumberOp(%,fmod,id_mod,id_rmod);
+	return acc;
+}
+
+#define GENERIC_IOP(id,op) \
+	static int_val generic_##id( neko_vm *vm, int_val acc, int_val sp, int_val pc ) { \
+		if( val_is_any_int(acc) && val_is_any_int(sp) ) \
+			acc = (int_val)alloc_best_int(val_any_int(sp) op val_any_int(acc)); \
+		else \
+			OpError(#op); \
+		return acc; \
+	}
+
+GENERIC_IOP(shl,<<);
+GENERIC_IOP(shr,>>);
+GENERIC_IOP(or,|);
+GENERIC_IOP(and,&);
+GENERIC_IOP(xor,^);
+
+static int_val generic_ushr( neko_vm *vm, int_val acc, int_val sp, int_val pc ) {
+	if( val_is_any_int(acc) && val_is_any_int(sp) )
+		acc = (int_val)alloc_best_int( ((unsigned int)val_any_int(sp)) >> val_any_int(acc));
+	else
+		OpError(">>>");
+	return acc;
+}
+
+static void generic_error( neko_vm *vm, value msg, int_val pc ) {
+	PushInfos();
+	val_throw(msg);
+}
+
+static void generic_invalid_access( neko_vm *vm, field f, int_val pc ) {
+	value v = val_field_name(f);
+	buffer b;
+	if( val_is_null(v) )
+		RuntimeError("Invalid field access");
+	b = alloc_buffer("Invalid field access : ");
+	val_buffer(b,v);
+	PushInfos();
+	val_throw(buffer_to_string(b));
+}
+
+static int_val generic_acc_field( neko_vm *vm, vobject *o, field f ) {
+	vobject *obj = o;
+	value *v;
+	do {
+		v = obj_find(obj,f);
+		if( v )
+			return (int_val)*v;
+		obj = obj->proto;
+	} while( obj );
+	if( vm->resolver != NULL )
+		return (int_val)val_call2(vm->resolver,(value)o,alloc_int(f));
+	return (int_val)val_null;
+}
+
+static int_val generic_acc_array( neko_vm *vm, int_val acc, int_val sp, int_val pc ) {
+	if( val_is_int(acc) && val_is_array(sp) ) {
+		int k = val_int(acc);
+		if( k < 0 || k >= val_array_size(sp) )
+			acc = (int_val)val_null;
+		else
+			acc = (int_val)val_array_ptr(sp)[k];
+	} else if( val_is_object(sp) )
+		ObjectOp(sp,acc,id_get)
+	else if( val_is_int32(acc) && val_is_array(sp) )
+		acc = (int_val)val_null;
+	else
+		RuntimeError("Invalid array access");
+	return acc;
+}
+
+static int_val generic_acc_index( neko_vm *vm, int_val acc, int idx, int_val pc ) {
+	if( val_is_array(acc) ) {
+		if( idx < 0 || idx >= val_array_size(acc) )
+			acc = (int_val)val_null;
+		else
+			acc = (int_val)val_array_ptr(acc)[idx];
+	} else if( val_is_object(acc) )
+		ObjectOp(acc,alloc_int(idx),id_get)
+	else
+		RuntimeError("Invalid array access");
+	return acc;
+}
+
+static int_val generic_set_array( neko_vm *vm, int_val acc, int_val arr, int_val idx, int_val pc ) {
+	if( val_is_array(arr) && val_is_int(idx) ) {
+		int k = val_int(idx);
+		if( k >= 0 && k < val_array_size(arr) )
+			val_array_ptr(arr)[k] = (value)acc;
+	} else if( val_is_object(arr) ) {
+		value args[] = { (value)idx, (value)acc };
+		value f = val_field((value)arr,id_set);
+		if( f == val_null )
+			RuntimeError("Unsupported operation");
+		PushInfos();
+		val_callEx((value)arr,f,args,2,NULL);
+		PopInfos(false);
+	} else if( !val_is_int32(idx) || !val_is_array(arr) )
+		RuntimeError("Invalid array access");
+	return acc;
+}
+
+static int_val generic_set_index( neko_vm *vm, int_val acc, int_val arr, int idx, int_val pc ) {
+	return generic_set_array(vm,acc,arr,(int_val)alloc_int(idx),pc);
+}
+
+static int_val generic_make_env( neko_vm *vm, int_val acc, int n, int_val pc ) {
+	value env = alloc_array(n);
+	vfunction *f;
+	while( n-- ) {
+		val_array_ptr(env)[n] = (value)*vm->sp;
+		*vm->sp++ = ERASE;
+	}
+	if( val_is_int(acc) || (val_tag(acc) != VAL_FUNCTION && val_tag(acc) != VAL_JITFUN) )
+		RuntimeError("Invalid environment");
+	f = (vfunction*)acc;
+	f = (vfunction*)neko_alloc_module_function(f->module,(int_val)f->addr,f->nargs);
+	f->t = val_tag(acc);
+	f->env = env;
+	return (int_val)f;
+}
+
+static int_val generic_make_array( neko_vm *vm, int_val acc, int n, int keep_order ) {
+	value arr = alloc_array(n+1);
+	if( keep_order ) {
+		val_array_ptr(arr)[n] = (value)acc;
+		while( n ) {
+			val_array_ptr(arr)[--n] = (value)*vm->sp;
+			*vm->sp++ = ERASE;
+		}
+	} else {
+		while( n ) {
+			val_array_ptr(arr)[n--] = (value)*vm->sp;
+			*vm->sp++ = ERASE;
+		}
+		val_array_ptr(arr)[0] = (value)acc;
+	}
+	return (int_val)arr;
+}
+
+// returns NULL if the function can be called directly
+static int_val generic_apply( neko_vm *vm, int_val acc, int n, int_val pc ) {
+	int fargs, i;
+	value env;
+	if( !val_is_function(acc) )
+		RuntimeError("$apply");
+	fargs = val_fun_nargs(acc);
+	if( fargs == n || fargs == VAR_ARGS )
+		return 0;
+	if( n > fargs )
+		RuntimeError("$apply");
+	env = alloc_array(fargs + 1);
+	val_array_ptr(env)[0] = (value)acc;
+	i = fargs;
+	while( i > n )
+		val_array_ptr(env)[i--] = val_null;
+	while( i ) {
+		val_array_ptr(env)[i--] = (value)*vm->sp;
+		*vm->sp++ = ERASE;
+	}
+	return (int_val)neko_alloc_apply(fargs - n,env);
+}
+
+// --------------------------------------------
+
+static jit_ctx *jit_init_context( void *ptr, int size ) {
+	jit_ctx *c = (jit_ctx*)alloc(sizeof(jit_ctx));
+	c->size = size;
+	c->baseptr = ptr;
+	c->buf.p = ptr;
+	c->pos = NULL;
+	c->curpc = 0;
+	c->jumps = NULL;
+	c->traps = NULL;
+	return c;
+}
+
+static void jit_finalize_context( jit_ctx *ctx ) {
+	jlist *l;
+	int nbytes = POS();
+	if( nbytes == 0 || nbytes > ctx->size )
+		failure("JIT buffer overflow");
+	l = ctx->jumps;
+	while( l != NULL ) {
+		*(int*)((char*)ctx->baseptr + l->pos) = ctx->pos[l->target] - (l->pos + 4);
+		l = l->next;
+	}
+	l = ctx->traps;
+	while( l != NULL ) {
+		*(int_val*)((char*)ctx->baseptr + l->pos) = ctx->pos[l->target] + (int_val)ctx->baseptr;
+		l = l->next;
+	}
+}
+
+static void jit_push_infos( jit_ctx *ctx, enum PushInfosMode callb ) {
+	INIT_BUFFER;
+	stack_push(CSP,4);
+	if( callb == CALLBACK ) {
+		XMov_rc(TMP,CONST(callback_return));
+		XMov_pr(CSP,FIELD(-3),TMP);
+		get_var_p(CSP,FIELD(-2),VEnv);
+		get_var_p(CSP,FIELD(-1),VThis);
+		XMov_pc(CSP,FIELD(0),0);
+	} else {
+		XMov_pr(CSP,FIELD(-3),PCREG);
+		get_var_p(CSP,FIELD(-2),VEnv);
+		get_var_p(CSP,FIELD(-1),VThis);
+		get_var_p(CSP,FIELD(0),VModule);
+	}
+	END_BUFFER;
+}
+
+// 32-bit result in eax -> tagged int or int32
+static void jit_best_int( jit_ctx *ctx, int _ ) {
+	int *wrap;
+	char *jend;
+	INIT_BUFFER;
+	XMov32_rr(TMP,ACC);
+	XShl32_rc(ACC,1);
+	XJump(JOverflow,wrap);
+	XOr32_rc(ACC,1);
+	XMovsxd_rr(ACC,ACC);
+	XJump_near(jend);
+	PATCH_JUMP(wrap);
+	XMov32_rr(Arg0,TMP);
+	call_c(alloc_int32);
+	PATCH_JUMP(jend);
+	END_BUFFER;
+}
+
+static void jit_boot( jit_ctx *ctx, void *_ ) {
+	INIT_BUFFER;
+	// jit_boot_seq(vm,addr,acc,m)
+	XPush_r(Rbp);
+	XPush_r(Rbx);
+	XPush_r(R12);
+	XPush_r(R13);
+	XPush_r(R14);
+	XPush_r(R15);
+	XMov_rr(VM,Arg0);
+	get_var_r(ACC,VModule);
+	XPush_r(ACC);
+	set_var_r(VModule,Arg3);
+	XMov_rr(ACC,Arg2);
+	end_call();
+	XCall_r(Arg1);
+	begin_call();
+	XPop_r(TMP);
+	set_var_r(VModule,TMP);
+	XPop_r(R15);
+	XPop_r(R14);
+	XPop_r(R13);
+	XPop_r(R12);
+	XPop_r(Rbx);
+	XPop_r(Rbp);
+	XRet();
+	END_BUFFER;
+}
+
+static void jit_trap( jit_ctx *ctx, int n ) {
+	INIT_BUFFER;
+
+	// jit_handle_trap(vm)
+	XMov_rr(VM,Arg0);
+	get_var_r(Rbp,VThis);
+
+	// restore vm
+	XAnd_rc(Rsp,-16);
+	XCall_m(neko_process_trap);
+
+	// restore registers
+	end_call();
+	XMov_rr(ACC,Rbp);
+	XMov_rp(Rbp,VM,VMFIELD(start)+FIELD(1));
+	XMov_rp(Rsp,VM,VMFIELD(start)+FIELD(2));
+	XMov_rp(TMP2,VM,VMFIELD(start)+FIELD(3));
+
+	// restore vm jmp_buf
+	XPop_r(TMP);
+	XMov_pr(VM,VMFIELD(start)+FIELD(3),TMP);
+	XPop_r(TMP);
+	XMov_pr(VM,VMFIELD(start)+FIELD(2),TMP);
+	XPop_r(TMP);
+	XMov_pr(VM,VMFIELD(start)+FIELD(1),TMP);
+	XPop_r(TMP);
+	XMov_pr(VM,VMFIELD(start),TMP);
+
+	XJump_r(TMP2);
+	END_BUFFER;
+}
+
+static void jit_stack_expand( jit_ctx *ctx, int _ ) {
+	int *jresize, *jdone;
+	INIT_BUFFER;
+	XLea_rp(TMP,CSP,FIELD(MAX_STACK_PER_FUNCTION));
+	XCmp_rr(SP,TMP);
+	XJump(JLt,jresize);
+	XRet();
+	PATCH_JUMP(jresize);
+	XPush_r(ACC);
+	stack_push(Rsp,1);
+	XMov_rr(Arg0,SP);
+	XMov_rr(Arg1,CSP);
+	XMov_rr(Arg2,VM);
+	XCall_m(neko_stack_expand);
+	XTest32_rr(ACC,ACC);
+	XJump(JNeq,jdone);
+	XMov_rc(Arg0,CONST(strings[0])); // Stack overflow
+	XCall_m(val_throw);
+	PATCH_JUMP(jdone);
+	stack_pop(Rsp,1);
+	XPop_r(ACC);
+	end_call();
+	XRet();
+	END_BUFFER;
+}
+
+static void jit_runtime_error( jit_ctx *ctx, void *unused ) {
+	INIT_BUFFER;
+	// msg in Arg1, pc in PCREG
+	begin_call();
+	XMov_rr(Arg0,VM);
+	XMov_rr(Arg2,PCREG);
+	XAnd_rc(Rsp,-16);
+	XCall_m(generic_error);
+	END_BUFFER;
+}
+
+static void jit_test( jit_ctx *ctx, int how ) {
+	INIT_BUFFER;
+	int *jslow, *jtrue1, *jnot1, *jnot2;
+	char *jend1, *jend2;
+	int inv = how ^ 1;
+	XMov_rp(TMP,SP,FIELD(0));
+	// (int,int) : direct comparison
+	XMov_rr(TMP2,TMP);
+	XAnd_rr(TMP2,ACC);
+	is_int(TMP2,false,jslow);
+	XCmp_rr(TMP,ACC);
+	XJump(how,jtrue1);
+	XMov_rc(ACC,CONST(val_false));
+	XJump_near(jend1);
+	// call val_compare(sp[0],acc)
+	PATCH_JUMP(jslow);
+	XMov_rr(Arg0,TMP);
+	XMov_rr(Arg1,ACC);
+	begin_call();
+	call_c(val_compare);
+	end_call();
+	// test ok and != invalid_comparison
+	XCmp32_rc(ACC,0);
+	if( how == JNeq ) {
+		XJump(JEq,jnot1);
+		jnot2 = NULL;
+	} else {
+		XJump(inv,jnot1);
+		XCmp32_rc(ACC,invalid_comparison);
+		XJump(JEq,jnot2);
+	}
+	PATCH_JUMP(jtrue1);
+	XMov_rc(ACC,CONST(val_true));
+	XJump_near(jend2);
+	PATCH_JUMP(jnot1);
+	PATCH_JUMP(jnot2);
+	XMov_rc(ACC,CONST(val_false));
+	PATCH_JUMP(jend1);
+	PATCH_JUMP(jend2);
+	pop(1);
+	END_BUFFER;
+}
+
+static void jit_call( jit_ctx *ctx, int mode, int nargs ) {
+	INIT_BUFFER;
+	int *jerr, *jother, *jerr2;
+	char *jend1, *jend2, *jend3;
+
+	XMov_rc(PCREG,GET_PC());
+
+// if( is_int ) : error
+	is_imm(ACC,jerr);
+
+// if( type == jit )
+	XMov32_rp(TMP,ACC,FUNFIELD(t));
+	XCmp32_rc(TMP,VAL_JITFUN);
+	XJump(JNeq,jother);
+
+	switch( mode ) {
+	case NORMAL: label(code->call_normal_jit[nargs]); break;
+	case THIS_CALL: label(code->call_this_jit[nargs]); break;
+	case TAIL_CALL: label(code->call_tail_jit[nargs]); break;
+	}
+
+	if( mode == TAIL_CALL )
+		jend1 = NULL;
+	else {
+		XJump_near(jend1);
+	}
+
+// else if( type == prim )
+	PATCH_JUMP(jother);
+	XCmp32_rc(TMP,VAL_PRIMITIVE);
+	XJump(JNeq,jother);
+
+	switch( mode ) {
+	case NORMAL: label(code->call_normal_prim[nargs]); break;
+	case THIS_CALL: label(code->call_this_prim[nargs]); break;
+	case TAIL_CALL: label(code->call_tail_prim[nargs]); break;
+	}
+
+	XJump_near(jend2);
+
+// else if( type == function )
+	PATCH_JUMP(jother);
+	XCmp32_rc(TMP,VAL_FUNCTION);
+	XJump(JNeq,jerr2);
+
+	switch( mode ) {
+	case NORMAL: label(code->call_normal_fun[nargs]); break;
+	case THIS_CALL: label(code->call_this_fun[nargs]); break;
+	case TAIL_CALL: label(code->call_tail_fun[nargs]); break;
+	}
+
+	XJump_near(jend3);
+
+// else error
+	PATCH_JUMP(jerr);
+	PATCH_JUMP(jerr2);
+	runtime_error_pc(3); // Invalid call
+
+// end
+	PATCH_JUMP(jend1);
+	PATCH_JUMP(jend2);
+	PATCH_JUMP(jend3);
+
+	END_BUFFER;
+}
+
+// the call stubs are entered with the native stack aligned on 16 bytes
+// and the pc of the calling opcode in PCREG
+
+static void jit_call_jit( jit_ctx *ctx, int nargs, int mode ) {
+	INIT_BUFFER;
+	int *jerr;
+
+	// check arg count
+	XMov32_rp(TMP,ACC,FUNFIELD(nargs));
+	XCmp32_rc(TMP,nargs);
+	XJump(JNeq,jerr);
+
+	if( mode == TAIL_CALL ) {
+		// pop our return address : the callee will return to our caller
+		stack_pop(Rsp,1);
+
+		set_var_p(VModule,ACC,FUNFIELD(module));
+		set_var_p(VEnv,ACC,FUNFIELD(env));
+		XMov_rp(TMP,ACC,FUNFIELD(addr));
+		XJump_r(TMP);
+	} else {
+		push_infos(PC_ARG);
+		set_var_p(VModule,ACC,FUNFIELD(module));
+		set_var_p(VEnv,ACC,FUNFIELD(env));
+		if( mode == THIS_CALL ) {
+			set_var_p(VThis,SP,FIELD(0));
+			pop(1);
+		}
+		XMov_rp(TMP,ACC,FUNFIELD(addr));
+		XCall_r(TMP);
+		pop_infos();
+		XRet();
+	}
+	PATCH_JUMP(jerr);
+	runtime_error_pc(3); // Invalid call
+	END_BUFFER;
+}
+
+static void jit_call_prim( jit_ctx *ctx, int nargs, int mode ) {
+	INIT_BUFFER;
+	int *jvararg, *jerr;
+	int i, size;
+
+	// check arg count
+	XMov32_rp(TMP,ACC,FUNFIELD(nargs));
+	XCmp32_rc(TMP,nargs);
+	XJump(JNeq,jvararg);
+
+	// move args from VMSP to registers
+	setup_before_call(mode,false);
+	stack_push(Rsp,1);
+	XMov_rp(CALLREG,ACC,FUNFIELD(addr));
+	for(i=0;i<nargs;i++) {
+		XMov_rp(call_args[i],SP,FIELD(nargs - 1 - i));
+	}
+	pop(nargs);
+
+	// call C primitive
+	begin_call();
+	XCall_r(CALLREG);
+	end_call();
+	restore_after_call(8);
+	XRet();
+
+//	else if( args == VAR_ARGS )
+	PATCH_JUMP(jvararg);
+	XCmp32_rc(TMP,VAR_ARGS);
+	XJump(JNeq,jerr);
+
+	// copy args from VMSP to the native stack
+	setup_before_call(mode,false);
+	size = (nargs & 1) ? nargs : nargs + 1;
+	stack_push(Rsp,size);
+	for(i=0;i<nargs;i++) {
+		XMov_rp(TMP,SP,FIELD(nargs - 1 - i));
+		XMov_pr(Rsp,FIELD(i),TMP);
+	}
+	pop(nargs);
+
+	// call C primitive with arg ptr and arg count
+	XMov_rr(Arg0,Rsp);
+	XMov_rc(Arg1,nargs);
+	XMov_rp(CALLREG,ACC,FUNFIELD(addr));
+	begin_call();
+	XCall_r(CALLREG);
+	end_call();
+	restore_after_call(FIELD(size));
+	XRet();
+
+// error
+	PATCH_JUMP(jerr);
+	runtime_error_pc(3); // Invalid call
+	END_BUFFER;
+}
+
+static void jit_call_fun( jit_ctx *ctx, int nargs, int mode ) {
+	INIT_BUFFER;
+	int *jerr;
+
+	// check arg count
+	XMov32_rp(TMP,ACC,FUNFIELD(nargs));
+	XCmp32_rc(TMP,nargs);
+	XJump(JNeq,jerr);
+
+	// C call : neko_interp(vm,m,acc,pc)
+	setup_before_call(mode,true);
+	XMov_rr(Arg0,VM);
+	XMov_rp(Arg1,ACC,FUNFIELD(module));
+	XMov_rr(Arg2,ACC);
+	XMov_rp(Arg3,ACC,FUNFIELD(addr));
+	begin_call();
+	XCall_m(neko_interp);
+	end_call();
+	XRet();
+
+	PATCH_JUMP(jerr);
+	runtime_error_pc(3); // Invalid call
+	END_BUFFER;
+}
+
+#define jit_call_jit_normal(ctx,i)		jit_call_jit(ctx,i,NORMAL)
+#define jit_call_jit_tail(ctx,i)		jit_call_jit(ctx,i,TAIL_CALL)
+#define jit_call_jit_this(ctx,i)		jit_call_jit(ctx,i,THIS_CALL)
+
+#define jit_call_prim_normal(ctx,i)		jit_call_prim(ctx,i,NORMAL)
+#define jit_call_prim_tail(ctx,i)		jit_call_prim(ctx,i,TAIL_CALL)
+#define jit_call_prim_this(ctx,i)		jit_call_prim(ctx,i,THIS_CALL)
+
+#define jit_call_fun_normal(ctx,i)		jit_call_fun(ctx,i,NORMAL)
+#define jit_call_fun_tail(ctx,i)		jit_call_fun(ctx,i,TAIL_CALL)
+#define jit_call_fun_this(ctx,i)		jit_call_fun(ctx,i,THIS_CALL)
+
+// we only inline operations for (int,int) and (float,float)
+// other cases are handled by the generic_* functions
+
+static void jit_number_op( jit_ctx *ctx, enum Operation op ) {
+	INIT_BUFFER;
+	int *jnot_int, *jnot_float1, *jnot_float2, *jnot_float3, *jnot_float4, *jmod0, *jend, *jend2, *jdiv = NULL;
+	// tmp = acc
+	XMov_rr(TMP,ACC);
+	// acc = *sp
+	XMov_rp(ACC,SP,FIELD(0));
+	// is_int(acc) && is_int(sp)
+	XMov_rr(TMP2,ACC);
+	XAnd_rr(TMP2,TMP);
+	is_int(TMP2,false,jnot_int);
+	XShr32_rc(ACC,1);
+	XShr32_rc(TMP,1);
+	switch( op ) {
+	case OP_ADD:
+		XAdd32_rr(ACC,TMP);
+		break;
+	case OP_SUB:
+		XSub32_rr(ACC,TMP);
+		break;
+	case OP_MUL:
+		XIMul32_rr(ACC,TMP);
+		break;
+	case OP_MOD:
+		XTest32_rr(TMP,TMP);
+		XJump(JNeq,jmod0);
+		runtime_error(7); // Invalid operation (%)
+		PATCH_JUMP(jmod0);
+		XCdq();
+		XIDiv32_r(TMP);
+		XMov32_rr(ACC,TMP2);
+		break;
+	case OP_DIV:
+		XCvtsi2sd_rr(Xmm0,ACC);
+		XCvtsi2sd_rr(Xmm1,TMP);
+		XDivsd_rr(Xmm0,Xmm1);
+		XJump(JAlways,jdiv);
+		break;
+	default:
+		ERROR;
+		break;
+	}
+	if( op != OP_DIV ) {
+		best_int();
+	}
+	XJump(JAlways,jend);
+
+	// is_float(acc) && is_float(sp)
+	PATCH_JUMP(jnot_int);
+	if( op == OP_MOD ) {
+		// fmod is left to the generic path
+		jnot_float1 = jnot_float2 = jnot_float3 = jnot_float4 = NULL;
+		jend2 = NULL;
+	} else {
+		is_imm(ACC,jnot_float1);
+		is_imm(TMP,jnot_float2);
+		XCmp32_pc(ACC,0,VAL_FLOAT);
+		XJump(JNeq,jnot_float3);
+		XCmp32_pc(TMP,0,VAL_FLOAT);
+		XJump(JNeq,jnot_float4);
+		XMovsd_rp(Xmm0,ACC,FLOATFIELD);
+		switch( op ) {
+		case OP_ADD:
+			XAddsd_rp(Xmm0,TMP,FLOATFIELD);
+			break;
+		case OP_SUB:
+			XSubsd_rp(Xmm0,TMP,FLOATFIELD);
+			break;
+		case OP_MUL:
+			XMulsd_rp(Xmm0,TMP,FLOATFIELD);
+			break;
+		case OP_DIV:
+			XDivsd_rp(Xmm0,TMP,FLOATFIELD);
+			PATCH_JUMP(jdiv);
+			break;
+		default:
+			ERROR;
+			break;
+		}
+		call_c(alloc_float);
+		XJump(JAlways,jend2);
+	}
+
+	// else...
+	PATCH_JUMP(jnot_float1);
+	PATCH_JUMP(jnot_float2);
+	PATCH_JUMP(jnot_float3);
+	PATCH_JUMP(jnot_float4);
+	begin_call();
+	XMov_rr(Arg0,VM);
+	XMov_rr(Arg1,TMP);
+	XMov_rr(Arg2,ACC);
+	XMov_rc(Arg3,GET_PC());
+	switch( op ) {
+	case OP_ADD:
+		call_c(generic_add);
+		break;
+	case OP_SUB:
+		call_c(generic_sub);
+		break;
+	case OP_DIV:
+		call_c(generic_div);
+		break;
+	case OP_MUL:
+		call_c(generic_mult);
+		break;
+	case OP_MOD:
+		call_c(generic_mod);
+		break;
+	}
+	end_call();
+
+	PATCH_JUMP(jend);
+	PATCH_JUMP(jend2);
+	pop(1);
+	END_BUFFER;
+}
+
+static void jit_int_op( jit_ctx *ctx, enum IOperation op ) {
+	INIT_BUFFER;
+	int *jerr, *jend;
+
+	XMov_rr(TMP,ACC);
+	XMov_rp(ACC,SP,FIELD(0));
+	XMov_rr(TMP2,ACC);
+	XAnd_rr(TMP2,TMP);
+	is_int(TMP2,false,jerr);
+	XShr32_rc(TMP,1);
+	XShr32_rc(ACC,1);
+
+	switch( op ) {
+	case IOP_SHL:
+		XShl32_rr(ACC,TMP);
+		break;
+	case IOP_SHR:
+		XShr32_rr(ACC,TMP);
+		break;
+	case IOP_USHR:
+		XUShr32_rr(ACC,TMP);
+		break;
+	case IOP_AND:
+		XAnd32_rr(ACC,TMP);
+		break;
+	case IOP_OR:
+		XOr32_rr(ACC,TMP);
+		break;
+	case IOP_XOR:
+		XXor32_rr(ACC,TMP);
+		break;
+	default:
+		ERROR;
+	}
+
+	best_int();
+	XJump(JAlways,jend);
+
+	PATCH_JUMP(jerr);
+	begin_call();
+	XMov_rr(Arg0,VM);
+	XMov_rr(Arg1,TMP);
+	XMov_rr(Arg2,ACC);
+	XMov_rc(Arg3,GET_PC());
+	switch( op ) {
+	case IOP_SHL:
+		call_c(generic_shl);
+		break;
+	case IOP_SHR:
+		call_c(generic_shr);
+		break;
+	case IOP_USHR:
+		call_c(generic_ushr);
+		break;
+	case IOP_AND:
+		call_c(generic_and);
+		break;
+	case IOP_OR:
+		call_c(generic_or);
+		break;
+	case IOP_XOR:
+		call_c(generic_xor);
+		break;
+	}
+	end_call();
+
+	PATCH_JUMP(jend);
+	pop(1);
+
+	END_BUFFER;
+}
+
+static void jit_array_access( jit_ctx *ctx, int n ) {
+	INIT_BUFFER;
+	int *jslow1, *jslow2, *jbounds, *jend1, *jend2;
+
+	is_imm(ACC,jslow1);
+	XMov32_rp(TMP,ACC,0);
+	XMov32_rr(TMP2,TMP);
+	XAnd32_rc(TMP2,TAG_MASK);
+	XCmp32_rc(TMP2,VAL_ARRAY);
+	XJump(JNeq,jslow2);
+	XUShr32_rc(TMP,NEKO_TAG_BITS);
+	XCmp32_rc(TMP,n);
+	XJump(JLte,jbounds);
+	XMov_rp(ACC,ACC,FIELD(n + 1));
+	XJump(JAlways,jend1);
+
+	PATCH_JUMP(jbounds);
+	XMov_rc(ACC,CONST(val_null));
+	XJump(JAlways,jend2);
+
+	PATCH_JUMP(jslow1);
+	PATCH_JUMP(jslow2);
+	begin_call();
+	XMov_rr(Arg0,VM);
+	XMov_rr(Arg1,ACC);
+	XMov_rc(Arg2,n);
+	XMov_rc(Arg3,GET_PC());
+	call_c(generic_acc_index);
+	end_call();
+
+	PATCH_JUMP(jend1);
+	PATCH_JUMP(jend2);
+	END_BUFFER;
+}
+
+static void jit_opcode( jit_ctx *ctx, enum OPCODE op, int_val p ) {
+	INIT_BUFFER;
+	int *jok;
+	switch( op ) {
+	case AccNull:
+		XMov_rc(ACC,CONST(val_null));
+		break;
+	case AccTrue:
+		XMov_rc(ACC,CONST(val_true));
+		break;
+	case AccFalse:
+		XMov_rc(ACC,CONST(val_false));
+		break;
+	case AccThis:
+		get_var_r(ACC,VThis);
+		break;
+	case AccInt:
+		XMov_rc(ACC,CONST(p));
+		break;
+	case AccInt32:
+		XMov_rc(Arg0,(int)p);
+		call_c(alloc_int32);
+		break;
+	case AccStack:
+		XMov_rp(ACC,SP,FIELD(p));
+		break;
+	case AccStack0:
+		XMov_rp(ACC,SP,FIELD(0));
+		break;
+	case AccStack1:
+		XMov_rp(ACC,SP,FIELD(1));
+		break;
+	case AccBuiltin:
+		XMov_rc(ACC,CONST(p));
+		break;
+	case AccGlobal:
+		XMov_rc(TMP,CONST(p));
+		XMov_rp(ACC,TMP,0);
+		break;
+	case AccEnv:
+	case SetEnv:
+		get_var_r(TMP,VEnv);
+		XMov32_rp(TMP2,TMP,0);
+		if( p >= max_array_size ) {
+			jok = NULL;
+		} else {
+			XCmp32_rc(TMP2,(p << NEKO_TAG_BITS) | VAL_ARRAY);
+			XJump(JGt,jok);
+		}
+		runtime_error(op == AccEnv ? 1 : 2); // Reading/Writing Outside Env
+		if( jok != NULL ) {
+			PATCH_JUMP(jok);
+			if( op == AccEnv ) {
+				XMov_rp(ACC,TMP,FIELD(p + 1)); // acc = val_array_ptr(env)[p]
+			} else {
+				XMov_pr(TMP,FIELD(p + 1),ACC); // val_array_ptr(env)[p] = acc
+			}
+		}
+		break;
+	case AccArray: {
+		int *jslow1, *jslow2, *jslow3, *jbounds, *jend1, *jend2;
+		XMov_rp(TMP,SP,FIELD(0));
+		is_int(ACC,false,jslow1);
+		is_imm(TMP,jslow2);
+		XMov32_rp(Rsi,TMP,0);
+		XMov32_rr(Rdi,Rsi);
+		XAnd32_rc(Rdi,TAG_MASK);
+		XCmp32_rc(Rdi,VAL_ARRAY);
+		XJump(JNeq,jslow3);
+
+		// check bounds & access array
+		XUShr32_rc(Rsi,NEKO_TAG_BITS);
+		XMov_rr(TMP2,ACC);
+		XShr_rc(TMP2,1);
+		XCmp_rr(TMP2,Rsi);
+		XJump(JGte,jbounds);
+		XMov_rx(ACC,TMP,TMP2,FIELD(1)); // acc = val_array_ptr(tmp)[acc]
+		XJump(JAlways,jend1);
+
+		// outside bounds
+		PATCH_JUMP(jbounds);
+		XMov_rc(ACC,CONST(val_null));
+		XJump(JAlways,jend2);
+
+		// object, int32 index or error
+		PATCH_JUMP(jslow1);
+		PATCH_JUMP(jslow2);
+		PATCH_JUMP(jslow3);
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rr(Arg1,ACC);
+		XMov_rr(Arg2,TMP);
+		XMov_rc(Arg3,GET_PC());
+		call_c(generic_acc_array);
+		end_call();
+
+		PATCH_JUMP(jend1);
+		PATCH_JUMP(jend2);
+		pop(1);
+		break;
+		}
+	case AccIndex:
+		array_access((int)p);
+		break;
+	case AccIndex0:
+		array_access(0);
+		break;
+	case AccIndex1:
+		array_access(1);
+		break;
+	case AccField: {
+		int *jerr1, *jerr2, *jend;
+		is_imm(ACC,jerr1);
+		XMov32_rp(TMP,ACC,0);
+		XCmp32_rc(TMP,VAL_OBJECT);
+		XJump(JNeq,jerr2);
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rr(Arg1,ACC);
+		XMov_rc(Arg2,(int)p);
+		call_c(generic_acc_field);
+		end_call();
+		XJump(JAlways,jend);
+
+		PATCH_JUMP(jerr1);
+		PATCH_JUMP(jerr2);
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rc(Arg1,(int)p);
+		XMov_rc(Arg2,GET_PC());
+		call_c(generic_invalid_access);
+		PATCH_JUMP(jend);
+		break;
+		}
+	case SetStack:
+		XMov_pr(SP,FIELD(p),ACC);
+		break;
+	case SetGlobal:
+		XMov_rc(TMP,CONST(p));
+		XMov_pr(TMP,0,ACC);
+		break;
+	case SetThis:
+		set_var_r(VThis,ACC);
+		break;
+	case SetField: {
+		int *jerr1, *jerr2, *jend;
+		XMov_rp(TMP,SP,FIELD(0));
+		is_imm(TMP,jerr1);
+		XMov32_rp(TMP2,TMP,0);
+		XCmp32_rc(TMP2,VAL_OBJECT);
+		XJump(JNeq,jerr2);
+
+		// call obj_replace(obj,field,acc)
+		XPush_r(ACC);
+		XMov_rr(Arg0,TMP);
+		XMov_rc(Arg1,(int)p);
+		XMov_rr(Arg2,ACC);
+		XCall_m(obj_replace);
+		XPop_r(ACC);
+		XJump(JAlways,jend);
+
+		PATCH_JUMP(jerr1);
+		PATCH_JUMP(jerr2);
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rc(Arg1,(int)p);
+		XMov_rc(Arg2,GET_PC());
+		call_c(generic_invalid_access);
+		PATCH_JUMP(jend);
+		pop(1);
+		break;
+		}
+	case SetArray: {
+		int *jslow1, *jslow2, *jslow3, *jend1, *jend2;
+		XMov_rp(TMP,SP,FIELD(0)); // sp[0] : array/object
+		XMov_rp(TMP2,SP,FIELD(1)); // sp[1] : index
+		is_imm(TMP,jslow1);
+		is_int(TMP2,false,jslow2);
+		XMov32_rp(Rsi,TMP,0);
+		XMov32_rr(Rdi,Rsi);
+		XAnd32_rc(Rdi,TAG_MASK);
+		XCmp32_rc(Rdi,VAL_ARRAY);
+		XJump(JNeq,jslow3);
+
+		XUShr32_rc(Rsi,NEKO_TAG_BITS);
+		XShr_rc(TMP2,1);
+		XCmp_rr(TMP2,Rsi);
+		XJump(JGte,jend1);
+		XMov_xr(TMP,TMP2,FIELD(1),ACC);
+		XJump(JAlways,jend2);
+
+		PATCH_JUMP(jslow1);
+		PATCH_JUMP(jslow2);
+		PATCH_JUMP(jslow3);
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rr(Arg1,ACC);
+		XMov_rr(Arg4,TMP2);
+		XMov_rr(Arg2,TMP);
+		XMov_rr(Arg3,Arg4);
+		XMov_rc(Arg4,GET_PC());
+		call_c(generic_set_array);
+		end_call();
+
+		PATCH_JUMP(jend1);
+		PATCH_JUMP(jend2);
+		pop(2);
+		break;
+		}
+	case SetIndex: {
+		int *jslow1, *jslow2, *jend1, *jend2;
+		XMov_rp(TMP,SP,FIELD(0)); // sp[0] : array / object
+		is_imm(TMP,jslow1);
+		XMov32_rp(TMP2,TMP,0);
+		XMov32_rr(Rsi,TMP2);
+		XAnd32_rc(Rsi,TAG_MASK);
+		XCmp32_rc(Rsi,VAL_ARRAY);
+		XJump(JNeq,jslow2);
+		XUShr32_rc(TMP2,NEKO_TAG_BITS);
+		XCmp32_rc(TMP2,(int)p);
+		XJump(JLte,jend1);
+		XMov_pr(TMP,FIELD(p + 1),ACC);
+		XJump(JAlways,jend2);
+
+		PATCH_JUMP(jslow1);
+		PATCH_JUMP(jslow2);
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rr(Arg1,ACC);
+		XMov_rr(Arg2,TMP);
+		XMov_rc(Arg3,(int)p);
+		XMov_rc(Arg4,GET_PC());
+		call_c(generic_set_index);
+		end_call();
+
+		PATCH_JUMP(jend1);
+		PATCH_JUMP(jend2);
+		pop(1);
+		break;
+		}
+	case Push:
+		stack_push(SP,1);
+		XMov_pr(SP,FIELD(0),ACC);
+		break;
+	case Pop:
+		pop_any(p);
+		break;
+	case Jump:
+		jump(JAlways,p);
+		break;
+	case JumpIf:
+		XMov_rc(TMP,CONST(val_true));
+		XCmp_rr(ACC,TMP);
+		jump(JEq,p);
+		break;
+	case JumpIfNot:
+		XMov_rc(TMP,CONST(val_true));
+		XCmp_rr(ACC,TMP);
+		jump(JNeq,p);
+		break;
+	case Neq:
+		test(JNeq);
+		break;
+	case Eq:
+		test(JEq);
+		break;
+	case Gt:
+		test(JSignGt);
+		break;
+	case Gte:
+		test(JSignGte);
+		break;
+	case Lt:
+		test(JSignLt);
+		break;
+	case Lte:
+		test(JSignLte);
+		break;
+	case Bool:
+	case Not: {
+		int *jfalse1, *jfalse2, *jfalse3;
+		char *jend;
+		XMov_rc(TMP,CONST(val_false));
+		XCmp_rr(ACC,TMP);
+		XJump(JEq,jfalse1);
+		XMov_rc(TMP,CONST(val_null));
+		XCmp_rr(ACC,TMP);
+		XJump(JEq,jfalse2);
+		XCmp_rc(ACC,CONST(alloc_int(0)));
+		XJump(JEq,jfalse3);
+		XMov_rc(ACC,CONST((op == Bool)?val_true:val_false));
+		XJump_near(jend);
+		PATCH_JUMP(jfalse1);
+		PATCH_JUMP(jfalse2);
+		PATCH_JUMP(jfalse3);
+		XMov_rc(ACC,CONST((op == Bool)?val_false:val_true));
+		PATCH_JUMP(jend);
+		break;
+		}
+	case IsNull:
+	case IsNotNull: {
+		int *jnext;
+		char *jend;
+		XMov_rc(TMP,CONST(val_null));
+		XCmp_rr(ACC,TMP);
+		XJump(JNeq,jnext);
+		XMov_rc(ACC,CONST((op == IsNull)?val_true:val_false));
+		XJump_near(jend);
+		PATCH_JUMP(jnext);
+		XMov_rc(ACC,CONST((op == IsNull)?val_false:val_true));
+		PATCH_JUMP(jend);
+		break;
+		}
+	case Call:
+		call(NORMAL,(int)p);
+		break;
+	case ObjCall:
+		call(THIS_CALL,(int)p);
+		break;
+	case TailCall:
+		{
+			int stack = (int)(p >> 3);
+			int nargs = (int)(p & 7);
+			int i = nargs;
+			while( i > 0 ) {
+				i--;
+				XMov_rp(TMP,SP,FIELD(i));
+				XMov_pr(SP,FIELD(stack - nargs + i),TMP);
+			}
+			pop_any(stack - nargs);
+			call(TAIL_CALL,nargs);
+			// in case we return from a Primitive
+			XRet();
+		}
+		break;
+	case Ret:
+		pop_any(p);
+		XRet();
+		break;
+	case Add:
+		number_op(OP_ADD);
+		break;
+	case Sub:
+		number_op(OP_SUB);
+		break;
+	case Div:
+		number_op(OP_DIV);
+		break;
+	case Mult:
+		number_op(OP_MUL);
+		break;
+	case Mod:
+		number_op(OP_MOD);
+		break;
+	case Shl:
+		int_op(IOP_SHL);
+		break;
+	case Shr:
+		int_op(IOP_SHR);
+		break;
+	case UShr:
+		int_op(IOP_USHR);
+		break;
+	case And:
+		int_op(IOP_AND);
+		break;
+	case Or:
+		int_op(IOP_OR);
+		break;
+	case Xor:
+		int_op(IOP_XOR);
+		break;
+	case New:
+		begin_call();
+		XMov_rr(Arg0,ACC);
+		call_c(alloc_object);
+		break;
+	case MakeArray:
+	case MakeArray2:
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rr(Arg1,ACC);
+		XMov_rc(Arg2,(int)p);
+		XMov_rc(Arg3,op == MakeArray2);
+		call_c(generic_make_array);
+		end_call();
+		break;
+	case MakeEnv:
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rr(Arg1,ACC);
+		XMov_rc(Arg2,(int)p);
+		XMov_rc(Arg3,GET_PC());
+		call_c(generic_make_env);
+		end_call();
+		break;
+	case Last:
+		XRet();
+		break;
+	case Apply: {
+		int *jcall;
+		char *jend;
+		// acc = generic_apply(vm,acc,p,pc) or direct call
+		XPush_r(ACC);
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XMov_rr(Arg1,ACC);
+		XMov_rc(Arg2,(int)p);
+		XMov_rc(Arg3,GET_PC());
+		XCall_m(generic_apply);
+		end_call();
+		XPop_r(TMP);
+		XTest_rr(ACC,ACC);
+		XJump(JEq,jcall);
+		XJump_near(jend);
+		PATCH_JUMP(jcall);
+		XMov_rr(ACC,TMP);
+		call(NORMAL,(int)p);
+		PATCH_JUMP(jend);
+		break;
+		}
+	case Trap: {
+		// save some vm->start on the stack
+		XPush_p(VM,VMFIELD(start));
+		XPush_p(VM,VMFIELD(start)+FIELD(1));
+		XPush_p(VM,VMFIELD(start)+FIELD(2));
+		XPush_p(VM,VMFIELD(start)+FIELD(3));
+		// save magic, rbp , rsp and ret_pc
+		XMov_rc(TMP,CONST(jit_handle_trap));
+		XMov_pr(VM,VMFIELD(start),TMP);
+		XMov_pr(VM,VMFIELD(start)+FIELD(1),Rbp);
+		XMov_pr(VM,VMFIELD(start)+FIELD(2),Rsp);
+		REX(1,0,0,TMP);
+		B(0xB8 + TMP);
+		{
+			jlist *t = (jlist*)alloc(sizeof(jlist));
+			ctx->buf = buf;
+			t->pos = POS();
+			t->target = (int)((int_val*)p - ctx->module->code);
+			t->next = ctx->traps;
+			ctx->traps = t;
+		}
+		Q(0);
+		XMov_pr(VM,VMFIELD(start)+FIELD(3),TMP);
+		// neko_setup_trap(vm)
+		XPush_r(ACC);
+		begin_call();
+		XMov_rr(Arg0,VM);
+		XCall_m(neko_setup_trap);
+		end_call();
+		XPop_r(ACC);
+		break;
+		}
+	case EndTrap: {
+		// check spmax - trap = sp
+		get_var_r(TMP,VSpMax);
+		get_var_r(TMP2,VTrap);
+		XShl_rc(TMP2,3);
+		XSub_rr(TMP,TMP2);
+		XCmp_rr(TMP,SP);
+		XJump(JEq,jok);
+		runtime_error(9); // Invalid End Trap
+		PATCH_JUMP(jok);
+
+		// restore VM jmp_buf
+		XPop_r(TMP);
+		XMov_pr(VM,VMFIELD(start)+FIELD(3),TMP);
+		XPop_r(TMP);
+		XMov_pr(VM,VMFIELD(start)+FIELD(2),TMP);
+		XPop_r(TMP);
+		XMov_pr(VM,VMFIELD(start)+FIELD(1),TMP);
+		XPop_r(TMP);
+		XMov_pr(VM,VMFIELD(start),TMP);
+
+		// trap = val_int(sp[5])
+		XMov_rp(TMP,SP,FIELD(5));
+		XShr_rc(TMP,1);
+		set_var_r(VTrap,TMP);
+		pop(6);
+		break;
+		}
+	case TypeOf: {
+		int *jnot_int, *jfloat = NULL;
+		char *jend;
+		is_int(ACC,false,jnot_int);
+		XMov_rc(ACC,CONST(alloc_int(1))); // t_int != VAL_INT
+		XJump_near(jend);
+		PATCH_JUMP(jnot_int);
+#		ifdef NEKO_IMMEDIATE_FLOATS
+		XMov_rc(TMP,VAL_FLOAT);
+		XTest32_rc(ACC,2);
+		XJump(JNeq,jfloat);
+#		endif
+		XMov32_rp(TMP,ACC,0);
+		XAnd32_rc(TMP,TAG_MASK);
+		PATCH_JUMP(jfloat);
+		XMov_rc(TMP2,CONST(NEKO_TYPEOF));
+		XMov_rx(ACC,TMP2,TMP,0);
+		PATCH_JUMP(jend);
+		break;
+		}
+	case Compare: {
+		int *jint;
+		char *jend;
+		// val_compare(sp[0],acc)
+		XMov_rp(Arg0,SP,FIELD(0));
+		XMov_rr(Arg1,ACC);
+		begin_call();
+		call_c(val_compare);
+		end_call();
+
+		XCmp32_rc(ACC,invalid_comparison);
+		XJump(JNeq,jint);
+		XMov_rc(ACC,CONST(val_null));
+		XJump_near(jend);
+		PATCH_JUMP(jint);
+		XShl32_rc(ACC,1);
+		XOr32_rc(ACC,1);
+		XMovsxd_rr(ACC,ACC);
+		PATCH_JUMP(jend);
+		pop(1);
+		break;
+		}
+	case PhysCompare: {
+		int *jeq, *jlow;
+		char *jend1, *jend2;
+		XMov_rp(TMP,SP,FIELD(0));
+		pop(1);
+		XCmp_rr(ACC,TMP);
+		XJump(JEq,jeq);
+		XJump(JSignLt,jlow);
+		XMov_rc(ACC,CONST(alloc_int(-1)));
+		XJump_near(jend1);
+		PATCH_JUMP(jlow);
+		XMov_rc(ACC,CONST(alloc_int(1)));
+		XJump_near(jend2);
+		PATCH_JUMP(jeq);
+		XMov_rc(ACC,CONST(alloc_int(0)));
+		PATCH_JUMP(jend1);
+		PATCH_JUMP(jend2);
+		break;
+		}
+	case Hash: {
+		int *jerr1, *jerr2, *jend;
+		is_imm(ACC,jerr1);
+		XMov32_rp(TMP,ACC,0);
+		XAnd32_rc(TMP,TAG_MASK);
+		XCmp32_rc(TMP,VAL_STRING);
+		XJump(JNeq,jerr2);
+		begin_call();
+		XLea_rp(Arg0,ACC,4); // val_string(acc)
+		call_c(val_id);
+		XShl32_rc(ACC,1);
+		XOr32_rc(ACC,1);
+		XMovsxd_rr(ACC,ACC);
+		XJump(JAlways,jend);
+		PATCH_JUMP(jerr1);
+		PATCH_JUMP(jerr2);
+		runtime_error(10); // $hash
+		PATCH_JUMP(jend);
+		break;
+		}
+	case JumpTable: {
+		int njumps = (int)(p / 2);
+		int *jok1, *jok2;
+		char *jnext1, *jnext2;
+		is_int(ACC,true,jok1);
+		XMov_rc(TMP2,njumps);
+		XJump_near(jnext1);
+		PATCH_JUMP(jok1);
+		XCmp_rc(ACC,(int)p);
+		XJump(JLt,jok2);
+		XMov_rc(TMP2,njumps);
+		XJump_near(jnext2);
+		PATCH_JUMP(jok2);
+		XMov_rr(TMP2,ACC);
+		XShr_rc(TMP2,1);
+		PATCH_JUMP(jnext1);
+		PATCH_JUMP(jnext2);
+		// tmp = tmp2 * 5
+		B(0x48); B(0x8D); MOD_RM(0,TMP,4); SIB(2,TMP2,TMP2);
+		// tmp2 = rip of the first Jump (lea + add + jmp)
+		B(0x48); B(0x8D); MOD_RM(0,TMP2,5); W(3 + 2);
+		XAdd_rr(TMP,TMP2);
+		XJump_r(TMP);
+		break;
+		}
+	case Loop:
+		// nothing
+		break;
+	default:
+		ERROR;
+	}
+	END_BUFFER;
+}
+
+#define MAX_OP_SIZE		600
+#define MAX_BUF_SIZE	1000
+
+#define FILL_BUFFER(f,param,ptr) \
+	{ \
+		jit_ctx *ctx; \
+		char *buf = alloc_private(MAX_BUF_SIZE); \
+		int size; \
+		ctx = jit_init_context(buf,MAX_BUF_SIZE); \
+		f(ctx,param); \
+		size = POS(); \
+		buf = alloc_jit_mem(size); \
+		code->ptr = buf; \
+		memcpy(buf,ctx->baseptr,size); \
+		ctx->buf.p = buf + size; \
+		ctx->baseptr = buf; \
+		jit_finalize_context(ctx); \
+	}
+
+static void free_jit_mem( void *_p ) {
+	int_val *p = (int_val*)_p - 1;
+	munmap(p,*p);
+}
+
+static void free_jit_abstract( value v ) {
+	free_jit_mem(val_data(v));
+}
+
+static char *alloc_jit_mem( int size ) {
+	int_val *p;
+	// add space for size
+	size += sizeof(int_val);
+	// round to next page
+	size += (4096 - size%4096);
+	p = (int_val*)mmap(NULL,size,PROT_READ|PROT_WRITE|PROT_EXEC,(MAP_PRIVATE|MAP_ANON),-1,0);
+	if( p == (int_val*)-1 ) {
+		buffer b = alloc_buffer("Failed to allocate JIT memory ");
+		val_buffer(b,alloc_int(size>>10));
+		val_buffer(b,alloc_string("KB"));
+		val_throw(buffer_to_string(b));
+	}
+	*p = size;
+	return (char*)(p + 1);
+}
+
+void neko_init_jit() {
+	int nstrings = sizeof(cstrings) / sizeof(const char *);
+	int i;
+	strings = alloc_root(nstrings);
+	for(i=0;i<nstrings;i++)
+		strings[i] = alloc_string(cstrings[i]);
+	code = (jit_code*)alloc_root(sizeof(jit_code) / sizeof(char*));
+	FILL_BUFFER(jit_boot,NULL,boot);
+	FILL_BUFFER(jit_trap,0,handle_trap);
+	FILL_BUFFER(jit_stack_expand,0,stack_expand);
+	FILL_BUFFER(jit_runtime_error,0,runtime_error);
+	for(i=0;i<NARGS;i++) {
+		FILL_BUFFER(jit_call_jit_normal,i,call_normal_jit[i]);
+		FILL_BUFFER(jit_call_jit_this,i,call_this_jit[i]);
+		FILL_BUFFER(jit_call_jit_tail,i,call_tail_jit[i]);
+
+		FILL_BUFFER(jit_call_prim_normal,i,call_normal_prim[i]);
+		FILL_BUFFER(jit_call_prim_this,i,call_this_prim[i]);
+		FILL_BUFFER(jit_call_prim_tail,i,call_tail_prim[i]);
+
+		FILL_BUFFER(jit_call_fun_normal,i,call_normal_fun[i]);
+		FILL_BUFFER(jit_call_fun_this,i,call_this_fun[i]);
+		FILL_BUFFER(jit_call_fun_tail,i,call_tail_fun[i]);
+	}
+	jit_boot_seq = code->boot;
+	jit_handle_trap = code->handle_trap;
+}
+
+void neko_free_jit() {
+	int i;
+	for(i=0;i<sizeof(jit_code)/sizeof(char*);i++)
+		free_jit_mem(((char**)code)[i]);
+	free_root((value*)code);
+	free_root(strings);
+	code = NULL;
+	strings = NULL;
+	jit_boot_seq = NULL;
+}
+
+int neko_can_jit() {
+	return 1;
+}
+
+static unsigned int next_function( neko_module *m, unsigned int k, int_val *faddr ) {
+	while( k < m->nglobals && !val_is_function(m->globals[k]) )
+		k++;
+	if( k == m->nglobals ) {
+		*faddr = -1;
+		return 0;
+	}
+	*faddr = (int_val*)((vfunction*)m->globals[k])->addr - m->code;
+	return k;
+}
+
+static void jit_reserve( jit_ctx *ctx, unsigned int nops ) {
+	int curpos = POS();
+	if( curpos + MAX_OP_SIZE > ctx->size ) {
+		int nsize = ctx->size ? (ctx->size * 4) / 3 : (nops * 40);
+		char *buf2;
+		if( nsize - curpos < MAX_OP_SIZE ) nsize = curpos + MAX_OP_SIZE;
+		buf2 = tmp_alloc(nsize);
+		memcpy(buf2,ctx->baseptr,curpos);
+		tmp_free(ctx->baseptr);
+		ctx->baseptr = buf2;
+		ctx->buf.p = buf2 + curpos;
+		ctx->size = nsize;
+	}
+}
+
+static value jit_finalize_code( jit_ctx *ctx ) {
+	int csize = POS();
+	char *rbuf = alloc_jit_mem(csize);
+	value gc;
+	memcpy(rbuf,ctx->baseptr,csize);
+	tmp_free(ctx->baseptr);
+	ctx->baseptr = rbuf;
+	ctx->buf.p = rbuf + csize;
+	ctx->size = csize;
+	gc = alloc_abstract(NULL,rbuf);
+	val_gc(gc,free_jit_abstract);
+#	ifdef NEKO_JIT_DEBUG
+	printf("Jit size = %d\n",csize);
+#	endif
+	jit_finalize_context(ctx);
+	return gc;
+}
+
+void neko_module_jit( neko_module *m ) {
+	unsigned int i = 0;
+	int_val faddr;
+	unsigned int fcursor = next_function(m,0,&faddr);
+	jit_ctx *ctx = jit_init_context(NULL,0);
+	ctx->pos = (int*)tmp_alloc(sizeof(int)*(m->codesize + 1));
+	ctx->module = m;
+	while( i <= m->codesize ) {
+		enum OPCODE op;
+		int curpos;
+		jit_reserve(ctx,m->codesize + 1);
+		op = m->code[i];
+		curpos = POS();
+		ctx->pos[i] = curpos;
+		ctx->curpc = i + 2;
+
+		// begin of function or module : check stack overflow
+		if( faddr == i || i == 0 ) {
+			INIT_BUFFER;
+			label(code->stack_expand);
+			END_BUFFER;
+			if( faddr == i )
+				fcursor = next_function(m,fcursor+1,&faddr);
+		}
+
+		i++;
+		jit_opcode(ctx,op,m->code[i]);
+		if( POS() - curpos > MAX_OP_SIZE )
+			ERROR;
+		i += parameter_table[op];
+	}
+	m->jit_gc = jit_finalize_code(ctx);
+	// UPDATE GLOBALS
+	{
+		for(i=0;i<m->nglobals;i++) {
+			vfunction *f = (vfunction*)m->globals[i];
+			if( !val_is_int(f) && val_tag(f) == VAL_FUNCTION && f->module == m ) {
+				int pc = (int)((int_val*)f->addr - m->code);
+				f->t = VAL_JITFUN;
+				f->addr = (char*)ctx->baseptr + ctx->pos[pc];
+			}
+		}
+	}
+	m->jit = ctx->baseptr;
+	tmp_free(ctx->pos);
+}
+
+/*
+	Compiles the opcodes [start,end[ of a single function, read from ops
+	since the interpreter rewrites m->code in place. The native address of
+	each opcode is stored in native. Returns NULL if some jump leaves the
+	range, in which case the function stays interpreted.
+*/
+value neko_function_jit( neko_module *m, int_val *ops, unsigned int start, unsigned int end, void **native ) {
+	unsigned int i = start;
+	jlist *l;
+	value gc;
+	jit_ctx *ctx = jit_init_context(NULL,0);
+	ctx->pos = (int*)tmp_alloc(sizeof(int)*(m->codesize + 1));
+	ctx->module = m;
+	while( i < end ) {
+		enum OPCODE op;
+		int curpos;
+		jit_reserve(ctx,end - start);
+		op = ops[i];
+		curpos = POS();
+		ctx->pos[i] = curpos;
+		ctx->curpc = i + 2;
+		if( i == start ) {
+			INIT_BUFFER;
+			label(code->stack_expand);
+			END_BUFFER;
+		}
+		i++;
+		jit_opcode(ctx,op,ops[i]);
+		if( POS() - curpos > MAX_OP_SIZE )
+			ERROR;
+		// Last ends the global scope and has no parameter
+		if( op != Last )
+			i += parameter_table[op];
+	}
+	for(l=ctx->jumps;l!=NULL;l=l->next)
+		if( l->target < (int)start || l->target >= (int)end )
+			break;
+	if( l == NULL )
+		for(l=ctx->traps;l!=NULL;l=l->next)
+			if( l->target < (int)start || l->target >= (int)end )
+				break;
+	if( l != NULL || i != end ) {
+		tmp_free(ctx->pos);
+		tmp_free(ctx->baseptr);
+		return NULL;
+	}
+	gc = jit_finalize_code(ctx);
+	for(i=start;i<end;i++) {
+		native[i] = (char*)ctx->baseptr + ctx->pos[i];
+		if( ops[i] != Last )
+			i += parameter_table[ops[i]];
+	}
+	tmp_free(ctx->pos);
+	return gc;
+}
+
+#endif
+
+/* ************************************************************************ */
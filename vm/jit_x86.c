@@ -47,7 +47,7 @@
 
 #define TAG_MASK		((1<<NEKO_TAG_BITS)-1)
 
-#ifdef NEKO_JIT_ENABLE
+#if defined(NEKO_JIT_ENABLE) && !defined(NEKO_X64)
 
 #define PARAMETER_TABLE
 #include "opcodes.h"
@@ -1819,14 +1819,12 @@ static void jit_opcode( jit_ctx *ctx, enum OPCODE op, int p ) {
 		XMov_rr(VM,ACC);
 		XPush_c(p);
 		start = buf.c;
-		XMov_rr(TMP,VM);
-		XAdd_rc(TMP,FIELD(1));
-		XPush_r(TMP);
-		XCall_m(otable_find);
+		XPush_r(VM);
+		XCall_m(obj_find);
 		XCmp_rc(ACC,0);
 		XJump(JNeq,jend1);
 		stack_pop(Esp,1);
-		XMov_rp(VM,VM,FIELD(3)); // acc = acc->proto
+		XMov_rp(VM,VM,FIELD(4)); // acc = acc->proto
 		XCmp_rc(VM,0);
 		XJump(JNeq,loop);
 		*loop = (int)(start - buf.c);
@@ -1892,13 +1890,12 @@ static void jit_opcode( jit_ctx *ctx, enum OPCODE op, int p ) {
 		XCmp_rb(TMP2,VAL_OBJECT);
 		XJump(JNeq,jerr2);
 
-		// call otable_replace(table,field,acc)
+		// call obj_replace(obj,field,acc)
 		stack_pad(2);
 		XPush_r(ACC);
 		XPush_c(p);
-		XAdd_rc(TMP,FIELD(1));
 		XPush_r(TMP);
-		XCall_m(otable_replace);
+		XCall_m(obj_replace);
 		stack_pop(Esp,3);
 		XMov_rp(ACC,Esp,FIELD(-1));
 		stack_pad(-2);
@@ -2758,7 +2755,7 @@ void neko_module_jit( neko_module *m ) {
 	tmp_free(ctx->pos);
 }
 
-#else // NEKO_JIT_ENABLE
+#elif !defined(NEKO_JIT_ENABLE)
 
 char *jit_boot_seq = NULL;
 char *jit_handle_trap = (char*)&jit_boot_seq;
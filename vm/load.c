@@ -166,7 +166,7 @@ EXTERN value neko_select_file( value path, const char *file, const char *ext ) {
 }
 
 
-static void open_module( value path, const char *mname, reader *r, readp *p ) {
+static void open_module( value path, const char *mname, value *file, readp *p ) {
 	FILE *f;
 	value fname;
 	char *ext = strrchr(mname,'.');
@@ -180,7 +180,7 @@ static void open_module( value path, const char *mname, reader *r, readp *p ) {
 		buffer_append(b,mname);
 		bfailure(b);
 	}
-	*r = neko_file_reader;
+	*file = fname;
 	*p = f;
 }
 
@@ -377,7 +377,7 @@ static value loader_loadmodule( value mname, value vthis ) {
 	cache = val_field(o,id_cache);
 	val_check(cache,object);
 	{
-		reader r;
+		value fname;
 		readp p;
 		neko_module *m;
 		neko_vm *vm = NEKO_VM();
@@ -387,9 +387,9 @@ static value loader_loadmodule( value mname, value vthis ) {
 			m = (neko_module*)val_data(mv);
 			return m->exports;
 		}
-		open_module(val_field(o,id_path),val_string(mname),&r,&p);
+		open_module(val_field(o,id_path),val_string(mname),&fname,&p);
 		if( vm->fstats ) vm->fstats(vm,"neko_read_module",1);
-		m = neko_read_module(r,p,vthis);
+		m = neko_read_module_file(p,val_string(fname),vthis);
 		if( vm->fstats ) vm->fstats(vm,"neko_read_module",0);
 		close_module(p);
 		if( m == NULL ) {
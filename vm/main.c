@@ -40,6 +40,9 @@
 #endif
 #ifdef NEKO_POSIX
 #	include <signal.h>
+#	include <errno.h>
+#	include <sys/socket.h>
+#	include <sys/un.h>
 #endif
 
 #ifdef __GNUC__
@@ -233,6 +236,203 @@ static int execute_file( neko_vm *vm, char *file, value mload ) {
 	return 0;
 }
 
+#if defined(NEKO_POSIX) && !defined(NEKO_STANDALONE)
+
+/*
+	Zygote mode : "neko -zygote <socket> [modules...]" loads and initializes
+	the modules once, then forks an already warm VM for each job received
+	on the unix socket. A job is sent by "neko -connect <socket> <file> [args...]"
+	together with the client stdin/stdout/stderr and working directory, and
+	the client exits with the job exit code.
+*/
+
+#define ZYGOTE_MAX_JOB	0x10000
+
+static int zygote_socket( const char *path, struct sockaddr_un *addr ) {
+	int s;
+	if( strlen(path) >= sizeof(addr->sun_path) )
+		return -1;
+	memset(addr,0,sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	strcpy(addr->sun_path,path);
+	s = socket(AF_UNIX,SOCK_STREAM,0);
+	return s;
+}
+
+static int zygote_write( int s, const void *buf, int len ) {
+	while( len > 0 ) {
+		int n = (int)write(s,buf,len);
+		if( n <= 0 ) {
+			if( n < 0 && errno == EINTR )
+				continue;
+			return 0;
+		}
+		buf = (const char*)buf + n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int zygote_read( int s, void *buf, int len ) {
+	while( len > 0 ) {
+		int n = (int)read(s,buf,len);
+		if( n <= 0 ) {
+			if( n < 0 && errno == EINTR )
+				continue;
+			return 0;
+		}
+		buf = (char*)buf + n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int zygote_connect( const char *path, char **argv, int argc ) {
+	struct sockaddr_un addr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char ctrl[CMSG_SPACE(sizeof(int) * 3)];
+	char cwd[PATH_MAX];
+	char *job;
+	int i, len, code;
+	int s = zygote_socket(path,&addr);
+	if( s < 0 || connect(s,(struct sockaddr*)&addr,sizeof(addr)) != 0 ) {
+		fprintf(stderr,"Failed to connect to zygote %s\n",path);
+		return 1;
+	}
+	if( getcwd(cwd,sizeof(cwd)) == NULL )
+		strcpy(cwd,".");
+	len = (int)strlen(cwd) + 1;
+	for(i=0;i<argc;i++)
+		len += (int)strlen(argv[i]) + 1;
+	if( len > ZYGOTE_MAX_JOB ) {
+		fprintf(stderr,"Zygote job is too big\n");
+		return 1;
+	}
+	job = (char*)malloc(len);
+	strcpy(job,cwd);
+	len = (int)strlen(cwd) + 1;
+	for(i=0;i<argc;i++) {
+		strcpy(job + len,argv[i]);
+		len += (int)strlen(argv[i]) + 1;
+	}
+	// the job size goes with the standard descriptors, then comes the job
+	memset(&msg,0,sizeof(msg));
+	memset(ctrl,0,sizeof(ctrl));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+	for(i=0;i<3;i++)
+		((int*)CMSG_DATA(cm))[i] = i;
+	if( sendmsg(s,&msg,0) != sizeof(len) || !zygote_write(s,job,len) || !zygote_read(s,&code,sizeof(code)) )
+		code = 1;
+	free(job);
+	close(s);
+	return code;
+}
+
+static int zygote_job( neko_vm *vm, value mload, int s ) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char ctrl[CMSG_SPACE(sizeof(int) * 3)];
+	char *job, *p, *file;
+	value args;
+	int i, len, nargs, code;
+	memset(&msg,0,sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl;
+	msg.msg_controllen = sizeof(ctrl);
+	if( recvmsg(s,&msg,0) != sizeof(len) || len <= 0 || len > ZYGOTE_MAX_JOB )
+		return 1;
+	cm = CMSG_FIRSTHDR(&msg);
+	if( cm == NULL || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(int) * 3) )
+		return 1;
+	for(i=0;i<3;i++) {
+		int fd = ((int*)CMSG_DATA(cm))[i];
+		dup2(fd,i);
+		close(fd);
+	}
+	job = (char*)malloc(len + 1);
+	if( !zygote_read(s,job,len) )
+		return 1;
+	job[len] = 0;
+	if( chdir(job) != 0 )
+		return 1;
+	file = job + strlen(job) + 1;
+	if( file >= job + len )
+		return 1;
+	nargs = 0;
+	for(p = file + strlen(file) + 1; p < job + len; p += strlen(p) + 1)
+		nargs++;
+	args = alloc_array(nargs);
+	i = 0;
+	for(p = file + strlen(file) + 1; p < job + len; p += strlen(p) + 1)
+		val_array_ptr(args)[i++] = alloc_string(p);
+	alloc_field(mload,val_id("args"),args);
+	code = execute_file(vm,file,mload);
+	free(job);
+	fflush(stdout);
+	fflush(stderr);
+	zygote_write(s,&code,sizeof(code));
+	return code;
+}
+
+static int zygote_serve( neko_vm *vm, value mload, const char *path, char **mods, int nmods ) {
+	struct sockaddr_un addr;
+	int i;
+	int s = zygote_socket(path,&addr);
+	if( s < 0 ) {
+		fprintf(stderr,"Invalid zygote socket %s\n",path);
+		return 1;
+	}
+	for(i=0;i<nmods;i++)
+		if( execute_file(vm,mods[i],mload) )
+			return 1;
+	unlink(path);
+	if( bind(s,(struct sockaddr*)&addr,sizeof(addr)) != 0 || listen(s,64) != 0 ) {
+		fprintf(stderr,"Failed to listen on %s\n",path);
+		return 1;
+	}
+	// let the system reap the jobs
+	signal(SIGCHLD,SIG_IGN);
+	while( true ) {
+		int pid;
+		int c = accept(s,NULL,NULL);
+		if( c < 0 ) {
+			if( errno == EINTR || errno == ECONNABORTED )
+				continue;
+			return 1;
+		}
+		fflush(stdout);
+		fflush(stderr);
+		pid = neko_gc_fork();
+		if( pid == 0 ) {
+			int code;
+			close(s);
+			signal(SIGCHLD,SIG_DFL);
+			code = zygote_job(vm,mload,c);
+			close(c);
+			return code;
+		}
+		close(c);
+	}
+	return 0;
+}
+
+#endif
+
 #ifdef NEKO_VCC
 #	include <crtdbg.h>
 #else
@@ -253,6 +453,11 @@ int main( int argc, char *argv[] ) {
 	value mload;
 	int r;
 	_CrtSetDbgFlag ( _CRTDBG_ALLOC_MEM_DF | _CRTDBG_DELAY_FREE_MEM_DF | _CRTDBG_LEAK_CHECK_DF );
+#	if defined(NEKO_POSIX) && !defined(NEKO_STANDALONE)
+	// the client doesn't need a VM
+	if( argc > 3 && strcmp(argv[1],"-connect") == 0 )
+		return zygote_connect(argv[2],argv+3,argc-3);
+#	endif
 	neko_global_init();
 	vm = neko_vm_alloc(NULL);
 	neko_vm_select(vm);
@@ -270,6 +475,8 @@ int main( int argc, char *argv[] ) {
 	if( !neko_has_embedded_module(vm) ) {
 		int jit = 1;
 		int stats = 0;
+		char *zygote = NULL;
+		char *prof = NULL;
 		while( argc > 1 ) {
 			if( strcmp(argv[1],"-interp") == 0 ) {
 				argc--;
@@ -285,12 +492,28 @@ int main( int argc, char *argv[] ) {
 				neko_stats_measure(vm,"total",1);
 				continue;
 			}
+			if( strcmp(argv[1],"-prof") == 0 && argc > 2 ) {
+				// JIT code is not sampled
+				prof = argv[2];
+				argc -= 2;
+				argv += 2;
+				jit = 0;
+				continue;
+			}
 			if( strcmp(argv[1],"-version") == 0 ) {
 				argc--;
 				argv++;
 				printf("%d.%d.%d\n",NEKO_VERSION_MAJOR,NEKO_VERSION_MINOR,NEKO_VERSION_PATCH);
 				return 0;
 			}
+#			if defined(NEKO_POSIX) && !defined(NEKO_STANDALONE)
+			if( strcmp(argv[1],"-zygote") == 0 && argc > 2 ) {
+				zygote = argv[2];
+				argc -= 2;
+				argv += 2;
+				continue;
+			}
+#			endif
 			break;
 		}
 #		ifdef NEKO_POSIX
@@ -298,7 +521,16 @@ int main( int argc, char *argv[] ) {
 			sigaction(SIGSEGV,&act,NULL);
 #		endif
 		neko_vm_jit(vm,jit);
-		if( argc == 1 ) {
+		if( prof != NULL && !neko_profile_start(1000) ) {
+			fprintf(stderr,"Profiling is not supported on this platform\n");
+			prof = NULL;
+		}
+		if( zygote != NULL ) {
+#			if defined(NEKO_POSIX) && !defined(NEKO_STANDALONE)
+			mload = default_loader(NULL,0);
+			r = zygote_serve(vm,mload,zygote,argv+1,argc-1);
+#			endif
+		} else if( argc == 1 ) {
 #			ifdef NEKO_STANDALONE
 			report(vm,alloc_string("No embedded module in this executable"),0);
 #			else
@@ -310,6 +542,11 @@ int main( int argc, char *argv[] ) {
 			mload = default_loader(argv+2,argc-2);
 			r = execute_file(vm,argv[1],mload);
 		}
+		if( prof != NULL ) {
+			neko_profile_stop();
+			if( !neko_profile_dump(prof) )
+				fprintf(stderr,"Failed to write profile %s\n",prof);
+		}
 		if( stats ) {
 			value v;
 			neko_stats_measure(vm,"total",0);
@@ -22,61 +22,107 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 #include "neko_mod.h"
 #include "vm.h"
+#include "objtable.h"
 #define PARAMETER_TABLE
 #define STACK_TABLE
 #include "opcodes.h"
-
-DEFINE_KIND(neko_kind_module);
-
-/* Endianness macros. */
-#ifdef NEKO_BSD
-#	include <sys/endian.h>
-#endif
-
-/* *_TO_LE(X) converts (X) to little endian. */
-#ifdef NEKO_LITTLE_ENDIAN
-#	define LONG_TO_LE(X) (X)
-#	define SHORT_TO_LE(X) (X)
+#ifdef NEKO_WINDOWS
+#	include <process.h>
+#	define getpid _getpid
 #else
-#	define LONG_TO_LE(X) ((((X) >> 24) & 0xff) | \
-		(((X) >> 8) & 0xff00) | (((X) & 0xff00) << 8) | \
-	       	(((X) & 0xff) << 24))
-#	define SHORT_TO_LE(X) ((((X) >> 8) & 0xff) | (((X) & 0xff) << 8))
+#	include <sys/mman.h>
+#	include <unistd.h>
 #endif
 
+DEFINE_KIND(neko_kind_module);
+
 #define MAXSIZE 0x100
 #define ERROR() { free(tmp); return NULL; }
-#define READ(buf,len) if( r(p,buf,len) == -1 ) ERROR()
 
-#ifdef NEKO_64BITS
+/*
+	Modules are decoded from memory whenever the whole input is available
+	(a string or a mapped file) and through the reader callback otherwise.
+*/
+typedef struct {
+	const unsigned char *cur;
+	const unsigned char *end;
+	reader r;
+	readp p;
+	unsigned char *map;
+	size_t mapsize;
+	long mappos;
+	struct _module_image *image;
+} module_input;
+
+/*
+	A module image (.nc file) holds the module data followed by the code
+	already unpacked and verified : one little endian word per slot, then
+	the parameter flags used by the checks.
+*/
+typedef struct _module_image {
+	int load;
+	const unsigned char *data;
+	const unsigned char *code;
+	unsigned char *save;
+	int savesize;
+} module_image;
 
-static void read_long( reader r, readp p, unsigned int *i ) {
-	unsigned char c[4];
-	int n;
-	r(p,c,4);
-	n = c[0] | (c[1] << 8) | (c[2] << 16) | (c[3] << 24);
-	*i = LONG_TO_LE(n);
+static void save_image( module_image *im, neko_module *m, unsigned char *flags ) {
+	int datasize = (int)(im->code - im->data);
+	unsigned char *p;
+	unsigned int i;
+	im->savesize = datasize + m->codesize * 5 + 1;
+	im->save = (unsigned char*)alloc_private(im->savesize);
+	memcpy(im->save,im->data,datasize);
+	p = im->save + datasize;
+	for(i=0;i<m->codesize;i++) {
+		unsigned int c = (unsigned int)m->code[i];
+		p[0] = (unsigned char)c;
+		p[1] = (unsigned char)(c >> 8);
+		p[2] = (unsigned char)(c >> 16);
+		p[3] = (unsigned char)(c >> 24);
+		p += 4;
+	}
+	memcpy(p,flags,m->codesize + 1);
 }
 
-static void read_short( reader r, readp p, unsigned short *i ) {
-	unsigned char c[2];
-	int n;
-	r(p,c,2);
-	n = c[0] | (c[1] << 8);
-	*i = SHORT_TO_LE(n);
+static void input_release( module_input *in ) {
+	if( in->map == NULL )
+		return;
+#	ifdef NEKO_WINDOWS
+	free(in->map);
+#	else
+	munmap(in->map,in->mapsize);
+#	endif
+	in->map = NULL;
 }
 
-#	define READ_LONG(var) read_long(r,p,&(var))
-#	define READ_SHORT(var) read_short(r,p,&(var))
-
-#else
-
-#	define READ_LONG(var) READ(&(var), 4); var = LONG_TO_LE(var)
-#	define READ_SHORT(var) READ(&(var), 2); var = SHORT_TO_LE(var)
+static int input_read( module_input *in, void *buf, int len ) {
+	if( in->r != NULL )
+		return in->r(in->p,buf,len) != -1;
+	if( in->end - in->cur < len )
+		return 0;
+	memcpy(buf,in->cur,len);
+	in->cur += len;
+	return 1;
+}
 
-#endif
+#define READ(buf,len) if( !input_read(in,buf,len) ) ERROR()
+#define READ_BYTE(var) if( in->cur < in->end ) var = *in->cur++; else { READ(&var,1); }
+#define READ_LONG(var) { \
+		unsigned char _c[4]; \
+		READ(_c,4); \
+		var = _c[0] | (_c[1] << 8) | (_c[2] << 16) | ((unsigned int)_c[3] << 24); \
+	}
+#define READ_SHORT(var) { \
+		unsigned char _c[2]; \
+		READ(_c,2); \
+		var = (unsigned short)(_c[0] | (_c[1] << 8)); \
+	}
 
 extern field id_loader;
 extern field id_exports;
@@ -92,11 +138,21 @@ EXTERN int neko_is_big_endian() {
 #endif
 }
 
-static int read_string( reader r, readp p, char *buf ) {
+static int read_string( module_input *in, char *buf ) {
 	int i = 0;
 	char c;
+	if( in->r == NULL ) {
+		int max = (int)(in->end - in->cur);
+		const unsigned char *z = (const unsigned char*)memchr(in->cur,0,(max > MAXSIZE)?MAXSIZE:max);
+		if( z == NULL )
+			return -1;
+		i = (int)(z - in->cur) + 1;
+		memcpy(buf,in->cur,i);
+		in->cur += i;
+		return i;
+	}
 	while( i < MAXSIZE ) {
-		if( r(p,&c,1) == -1 )
+		if( in->r(in->p,&c,1) == -1 )
 			return -1;
 		buf[i++] = c;
 		if( c == 0 )
@@ -122,10 +178,10 @@ static value get_builtin( neko_module *m, field id ) {
 
 #define UNKNOWN  ((unsigned char)-1)
 
-static int neko_check_stack( neko_module *m, unsigned char *tmp, unsigned int i, int stack, int istack ) {
+static int neko_check_stack( neko_module *m, const unsigned char *ops, unsigned char *tmp, unsigned int i, int stack, int istack ) {
 	unsigned int itmp;
 	while( true ) {
-		int c = (int)m->code[i];
+		int c = ops[i];
 		int s = stack_table[c];
 		if( tmp[i] == UNKNOWN )
 			tmp[i] = stack;
@@ -151,7 +207,7 @@ static int neko_check_stack( neko_module *m, unsigned char *tmp, unsigned int i,
 			if( tmp[itmp] == UNKNOWN ) {
 				if( c == Trap )
 					stack -= s;
-				if( !neko_check_stack(m,tmp,itmp,stack,istack) )
+				if( !neko_check_stack(m,ops,tmp,itmp,stack,istack) )
 					return 0;
 				if( c == Trap )
 					stack += s;
@@ -166,9 +222,9 @@ static int neko_check_stack( neko_module *m, unsigned char *tmp, unsigned int i,
 			i += itmp;
 			while( itmp > 0 ) {
 				itmp -= 2;
-				if( m->code[i - itmp] != Jump )
+				if( ops[i - itmp] != Jump )
 					return 0;
-				if( !neko_check_stack(m,tmp,i - itmp,stack,istack) )
+				if( !neko_check_stack(m,ops,tmp,i - itmp,stack,istack) )
 					return 0;
 			}
 			break;
@@ -228,7 +284,7 @@ static void append_array( value *arr, int pos, value v ) {
 	i++; \
 }
 
-static void *read_debug_infos( reader r, readp p, char *tmp, neko_module *m  ) {
+static void *read_debug_infos( module_input *in, char *tmp, neko_module *m  ) {
 	unsigned int i;
 	int curline = 0;
 	value curfile;
@@ -240,9 +296,9 @@ static void *read_debug_infos( reader r, readp p, char *tmp, neko_module *m  ) {
 	neko_debug *bits;
 	int pos_index = -1;
 	int lot_of_files = 0;
-	READ(&c,1);
+	READ_BYTE(c);
 	if( c >= 0x80 ) {
-		READ(&c2,1);
+		READ_BYTE(c2);
 		nfiles = ((c & 0x7F) << 8) | c2;
 		lot_of_files = 1;
 	} else
@@ -251,7 +307,7 @@ static void *read_debug_infos( reader r, readp p, char *tmp, neko_module *m  ) {
 		ERROR();
 	files = alloc_array(nfiles);
 	for(i=0;i<nfiles;i++) {
-		if( read_string(r,p,tmp) == -1 )
+		if( read_string(in,tmp) == -1 )
 			ERROR();
 		val_array_ptr(files)[i] = alloc_string(tmp);
 	}
@@ -266,11 +322,11 @@ static void *read_debug_infos( reader r, readp p, char *tmp, neko_module *m  ) {
 	i = 0;
 	pp = NULL;
 	while( i < npos ) {
-		READ(&c,1);
+		READ_BYTE(c);
 		if( c & 1 ) {
 			c >>= 1;
 			if( lot_of_files ) {
-				READ(&c2,1);
+				READ_BYTE(c2);
 				nfiles = (c << 8) | c2;
 			} else
 				nfiles = c;
@@ -307,8 +363,8 @@ static void *read_debug_infos( reader r, readp p, char *tmp, neko_module *m  ) {
 		} else {
 			unsigned char b2;
 			unsigned char b3;
-			READ(&b2,1);
-			READ(&b3,1);
+			READ_BYTE(b2);
+			READ_BYTE(b3);
 			curline = (c >> 3) | (b2 << 5) | (b3 << 13);
 			pp = alloc_array(2);
 			val_array_ptr(pp)[0] = curfile;
@@ -324,7 +380,206 @@ static void *read_debug_infos( reader r, readp p, char *tmp, neko_module *m  ) {
 	return m;
 }
 
-neko_module *neko_read_module( reader r, readp p, value loader ) {
+/*
+	Lazy verification : the stack check of each function is delayed until
+	its first call. The first opcode of the function is replaced by Verify,
+	which runs the check and puts the original opcode back. Opcodes are kept
+	aside since the code gets fused, quickened and threaded in the meantime.
+	NEKO_LAZY_VERIFY=0 checks every function at load time.
+*/
+
+typedef struct {
+	unsigned int pos;
+	int nargs;
+	int failed;
+	int_val op;
+} lazy_function;
+
+typedef struct {
+	unsigned char *ops;
+	unsigned char *stack;
+	int_val verify;
+	int nfuns;
+	lazy_function *funs;
+} lazy_module;
+
+extern mt_lock *neko_verify_lock;
+extern mt_lock *neko_tier_lock;
+
+static int lazy_enabled() {
+	const char *c = getenv("NEKO_LAZY_VERIFY");
+	return c == NULL || strcmp(c,"0") != 0;
+}
+
+static void lazy_install( neko_module *m ) {
+	lazy_module *l = (lazy_module*)m->lazy;
+	unsigned int i;
+	int n = 0;
+#	ifdef NEKO_DIRECT_THREADED
+	l->verify = neko_get_ttable()[Verify];
+#	else
+	l->verify = Verify;
+#	endif
+	for(i=0;i<m->nglobals;i++) {
+		vfunction *f = (vfunction*)m->globals[i];
+		if( val_type(f) == VAL_FUNCTION ) {
+			int_val *pc = (int_val*)f->addr;
+			lazy_function *lf = l->funs + n;
+			if( n > 0 && lf[-1].pos == (unsigned int)(pc - m->code) )
+				continue;
+			lf->pos = (unsigned int)(pc - m->code);
+			lf->nargs = f->nargs;
+			lf->failed = 0;
+			lf->op = *pc;
+			*pc = l->verify;
+			n++;
+		}
+	}
+	l->nfuns = n;
+}
+
+void neko_module_verify( neko_module *m, int_val *pc ) {
+	lazy_module *l = (lazy_module*)m->lazy;
+	unsigned int pos = (unsigned int)(pc - m->code);
+	lazy_function *f = NULL;
+	int min = 0, max = l->nfuns;
+	int ok;
+	while( min < max ) {
+		int mid = (min + max) >> 1;
+		if( l->funs[mid].pos < pos )
+			min = mid + 1;
+		else if( l->funs[mid].pos > pos )
+			max = mid;
+		else {
+			f = l->funs + mid;
+			break;
+		}
+	}
+	if( f == NULL )
+		failure("Invalid function entry");
+	lock_acquire(neko_verify_lock);
+	if( *pc == l->verify && !f->failed ) {
+		// a failed check leaves marks that would let a second one pass
+		f->failed = !neko_check_stack(m,l->ops,l->stack,pos,f->nargs,f->nargs);
+		if( !f->failed )
+			*pc = f->op;
+	}
+	ok = !f->failed;
+	lock_release(neko_verify_lock);
+	if( !ok )
+		failure("Stack check failed for function scope");
+}
+
+/*
+	Tiered JIT : instead of compiling the whole module at load time, calls
+	and backward jumps are counted while the code runs interpreted. A
+	function is compiled once it has been called TIER_CALLS times or one of
+	its loops has run TIER_LOOPS iterations ; the loop then continues in the
+	native code. The global scope is handled as a function. The JIT reads
+	the opcodes from a copy taken before the interpreter rewrites the code.
+	NEKO_JIT_TIER=0 compiles everything at load time.
+*/
+
+#ifdef NEKO_JIT_TIER
+
+extern value neko_function_jit( neko_module *m, int_val *ops, unsigned int start, unsigned int end, void **native );
+
+static int tier_enabled() {
+	const char *c = getenv("NEKO_JIT_TIER");
+	return c == NULL || strcmp(c,"0") != 0;
+}
+
+static void tier_init( neko_module *m ) {
+	neko_tier *t = (neko_tier*)alloc(sizeof(neko_tier));
+	unsigned int size = m->codesize + 1;
+	unsigned int i;
+	int n = 0;
+	t->code = (int_val*)alloc_private(size * sizeof(int_val));
+	memcpy(t->code,m->code,size * sizeof(int_val));
+	t->counts = (int*)alloc_private(size * sizeof(int));
+	memset(t->counts,0,size * sizeof(int));
+	t->native = (void**)alloc_private(size * sizeof(void*));
+	memset(t->native,0,size * sizeof(void*));
+	// functions are sorted and the global scope follows them
+	t->main = (m->code[0] == Jump) ? (unsigned int)((int_val*)m->code[1] - m->code) : 0;
+	t->starts = (unsigned int*)alloc_private(sizeof(unsigned int) * (m->nglobals + 1));
+	for(i=0;i<m->nglobals;i++) {
+		vfunction *f = (vfunction*)m->globals[i];
+		if( val_type(f) == VAL_FUNCTION ) {
+			unsigned int pos = (unsigned int)((int_val*)f->addr - m->code);
+			if( t->main < pos && (n == 0 || t->starts[n-1] < t->main) )
+				t->starts[n++] = t->main;
+			if( n == 0 || t->starts[n-1] != pos )
+				t->starts[n++] = pos;
+		}
+	}
+	if( n == 0 || t->starts[n-1] < t->main )
+		t->starts[n++] = t->main;
+	t->nstarts = n;
+	t->main_end = size;
+	for(i=0;i<(unsigned int)n;i++)
+		if( t->starts[i] > t->main ) {
+			t->main_end = t->starts[i];
+			break;
+		}
+	t->blocks = (value*)alloc(sizeof(value) * n);
+	m->tier = t;
+}
+
+#endif
+
+void *neko_tier_hot( void *_m, int_val *pc ) {
+#	ifdef NEKO_JIT_TIER
+	neko_module *m = (neko_module*)_m;
+	neko_tier *t = (neko_tier*)m->tier;
+	unsigned int pos = (unsigned int)(pc - m->code);
+	unsigned int start, end;
+	int min = 0, max = t->nstarts;
+	int k, compile;
+	value gc;
+	while( min < max ) {
+		int mid = (min + max) >> 1;
+		if( t->starts[mid] <= pos )
+			min = mid + 1;
+		else
+			max = mid;
+	}
+	k = min - 1;
+	if( k < 0 )
+		return NULL;
+	// val_null marks a function being compiled or that can't be
+	lock_acquire(neko_tier_lock);
+	compile = t->blocks[k] == NULL;
+	if( compile )
+		t->blocks[k] = val_null;
+	lock_release(neko_tier_lock);
+	if( !compile )
+		return t->native[pos];
+	start = t->starts[k];
+	end = (k + 1 < t->nstarts) ? t->starts[k+1] : m->codesize + 1;
+	gc = neko_function_jit(m,t->code,start,end,t->native);
+	if( gc == NULL )
+		return NULL;
+	t->blocks[k] = gc;
+	// calls through the function values skip the interpreter, which is only
+	// safe to change while no other VM can be using them
+	if( neko_vm_count == 1 ) {
+		unsigned int i;
+		for(i=0;i<m->nglobals;i++) {
+			vfunction *f = (vfunction*)m->globals[i];
+			if( val_type(f) == VAL_FUNCTION && f->module == m && (int_val*)f->addr == m->code + start ) {
+				f->addr = t->native[start];
+				f->t = VAL_JITFUN;
+			}
+		}
+	}
+	return t->native[pos];
+#	else
+	return NULL;
+#	endif
+}
+
+static neko_module *read_module( module_input *in, value loader ) {
 	register unsigned int i;
 	unsigned int itmp;
 	unsigned char t;
@@ -333,6 +588,8 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 	unsigned char version = 1;
 	register neko_module *m = (neko_module*)alloc(sizeof(neko_module));
 	neko_vm *vm = NEKO_VM();
+	int verified = in->image != NULL && in->image->load;
+	unsigned char *ops;
 	READ_LONG(itmp);
 	if( itmp != 0x4F4B454E )
 		ERROR();
@@ -344,6 +601,9 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 	tmp = (char*)malloc(sizeof(char)*(((m->codesize+1)>MAXSIZE)?(m->codesize+1):MAXSIZE));
 	m->jit = NULL;
 	m->jit_gc = NULL;
+	m->caches = NULL;
+	m->lazy = NULL;
+	m->tier = NULL;
 	m->dbgtbl = val_null;
 	m->dbgidxs = NULL;
 	m->globals = (value*)alloc(m->nglobals * sizeof(value));
@@ -354,10 +614,10 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 	alloc_field(m->exports,neko_id_module,alloc_abstract(neko_kind_module,m));
 	// Init global table
 	for(i=0;i<m->nglobals;i++) {
-		READ(&t,1);
+		READ_BYTE(t);
 		switch( t ) {
 		case 1:
-			if( read_string(r,p,tmp) == -1 )
+			if( read_string(in,tmp) == -1 )
 				ERROR();
 			m->globals[i] = val_null;
 			break;
@@ -373,19 +633,19 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 			READ(val_string(m->globals[i]),stmp);
 			break;
 		case 4:
-			if( read_string(r,p,tmp) == -1 )
+			if( read_string(in,tmp) == -1 )
 				ERROR();
 			m->globals[i] = alloc_float( atof(tmp) );
 			break;
 		case 5:
-			if( !read_debug_infos(r,p,tmp,m) ) {
+			if( !read_debug_infos(in,tmp,m) ) {
 				tmp = NULL; // already free in read_debug_infos
 				ERROR();
 			}
 			m->globals[i] = val_null;
 			break;
 		case 6:
-			READ(&version,1);
+			READ_BYTE(version);
 			m->globals[i] = val_null;
 			break;
 		default:
@@ -394,7 +654,7 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 		}
 	}
 	for(i=0;i<m->nfields;i++) {
-		if( read_string(r,p,tmp) == -1 )
+		if( read_string(in,tmp) == -1 )
 			ERROR();
 		m->fields[i] = alloc_string(tmp);
 	}
@@ -410,51 +670,71 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 	#else
 		m->code = (int_val*)alloc_private(sizeof(int_val)*(m->codesize+1));
 	#endif
-	i = 0;
-	// Unpack opcodes
-	while( i < m->codesize ) {
-		READ(&t,1);
-		tmp[i] = 1;
-		switch( t & 3 ) {
-		case 0:
-			m->code[i++] = (t >> 2);
-			break;
-		case 1:
-			m->code[i++] = (t >> 3);
-			tmp[i] = 0;
-			m->code[i++] = (t >> 2) & 1;
-			break;
-		case 2:
-			m->code[i++] = (t >> 2);
-			if( t == 2 ) {
-				// extra opcodes
-				READ(&t,1);
-				m->code[i-1] = t;
-			} else {
-				READ(&t,1);
+	if( in->image != NULL )
+		in->image->code = in->cur;
+	if( verified ) {
+		const unsigned char *c = in->cur;
+		if( in->end - c < (int)m->codesize * 5 + 1 )
+			ERROR();
+		for(i=0;i<m->codesize;i++) {
+			m->code[i] = (int)(c[0] | (c[1] << 8) | (c[2] << 16) | ((unsigned int)c[3] << 24));
+			c += 4;
+		}
+		memcpy(tmp,c,m->codesize + 1);
+		in->cur = c + m->codesize + 1;
+	} else {
+		i = 0;
+		// Unpack opcodes
+		while( i < m->codesize ) {
+			READ_BYTE(t);
+			tmp[i] = 1;
+			switch( t & 3 ) {
+			case 0:
+				m->code[i++] = (t >> 2);
+				break;
+			case 1:
+				m->code[i++] = (t >> 3);
+				tmp[i] = 0;
+				m->code[i++] = (t >> 2) & 1;
+				break;
+			case 2:
+				m->code[i++] = (t >> 2);
+				if( t == 2 ) {
+					// extra opcodes
+					READ_BYTE(t);
+					m->code[i-1] = t;
+				} else {
+					READ_BYTE(t);
+					tmp[i] = 0;
+					m->code[i++] = t;
+				}
+				break;
+			case 3:
+				m->code[i++] = (t >> 2);
+				READ_LONG(itmp);
 				tmp[i] = 0;
-				m->code[i++] = t;
+				m->code[i++] = (int)itmp;
+				break;
 			}
-			break;
-		case 3:
-			m->code[i++] = (t >> 2);
-			READ_LONG(itmp);
-			tmp[i] = 0;
-			m->code[i++] = (int)itmp;
-			break;
 		}
 	}
 	tmp[i] = 1;
 	m->code[i] = Last;
+	if( in->image != NULL && !in->image->load )
+		save_image(in->image,m,(unsigned char*)tmp);
+	// the checks below can raise exceptions and don't need the input anymore
+	input_release(in);
 	if( vm->fstats ) {
 		vm->fstats(vm,"neko_read_module_code",0);
 		vm->fstats(vm,"neko_read_module_check",1);
 	}
 	// Check bytecode
+	ops = (unsigned char*)alloc_private(m->codesize+1);
 	for(i=0;i<m->codesize;i++) {
 		register int c = (int)m->code[i];
 		itmp = (unsigned int)m->code[i+1];
-		if( c >= Last || tmp[i+1] == parameter_table[c] )
+		// opcodes after AccInt32 are only created by the loader
+		if( c > AccInt32 || tmp[i+1] == parameter_table[c] )
 			ERROR();
 		// Additional checks and optimizations
 		switch( m->code[i] ) {
@@ -535,16 +815,24 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 			m->code[i+1] <<= 1;
 			break;
 		}
-		if( !tmp[i+1] )
+		ops[i] = (unsigned char)m->code[i];
+		if( !tmp[i+1] ) {
+			ops[i+1] = Last;
 			i++;
+		}
 	}
+	ops[m->codesize] = Last;
 	// Check stack preservation
 	{
-		unsigned char *stmp = (unsigned char*)malloc(m->codesize+1);
+		int check = !vm->trusted_code && !verified;
+		// an image must only hold fully verified code
+		int lazy = check && !vm->run_jit && in->image == NULL && lazy_enabled();
+		unsigned char *stmp = lazy ? (unsigned char*)alloc_private(m->codesize+1) : (unsigned char*)malloc(m->codesize+1);
 		unsigned int prev = 0;
+		int nfuns = 0;
 		memset(stmp,UNKNOWN,m->codesize+1);
-		if( !vm->trusted_code && !neko_check_stack(m,stmp,0,0,0) ) {
-			free(stmp);
+		if( check && !neko_check_stack(m,ops,stmp,0,0,0) ) {
+			if( !lazy ) free(stmp);
 			failure("Stack check failed for global scope");
 		}
 		for(i=0;i<m->nglobals;i++) {
@@ -552,10 +840,12 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 			if( val_type(f) == VAL_FUNCTION ) {
 				itmp = (unsigned int)(int_val)f->addr;
 				if( itmp >= m->codesize || !tmp[itmp] || itmp < prev ) {
-					free(stmp);
+					if( !lazy ) free(stmp);
 					ERROR();
 				}
-				if( !vm->trusted_code && !neko_check_stack(m,stmp,itmp,f->nargs,f->nargs) ) {
+				if( lazy )
+					nfuns++;
+				else if( check && !neko_check_stack(m,ops,stmp,itmp,f->nargs,f->nargs) ) {
 					free(stmp);
 					failure("Stack check failed for function scope");
 				}
@@ -563,16 +853,107 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 				prev = itmp;
 			}
 		}
-		free(stmp);
+		if( lazy && nfuns ) {
+			lazy_module *l = (lazy_module*)alloc(sizeof(lazy_module));
+			l->ops = ops;
+			l->stack = stmp;
+			l->nfuns = nfuns;
+			l->funs = (lazy_function*)alloc_private(sizeof(lazy_function) * nfuns);
+			m->lazy = l;
+		}
+		if( !lazy )
+			free(stmp);
 	}
 	free(tmp);
 	if( vm->fstats ) vm->fstats(vm,"neko_read_module_check",0);
 	// jit ?
+#	ifdef NEKO_JIT_TIER
+	if( vm->run_jit && tier_enabled() )
+		tier_init(m);
+	else
+#	endif
 	if( vm->run_jit ) {
 		if( vm->fstats ) vm->fstats(vm,"neko_read_module_jit",1);
 		neko_module_jit(m);
 		if( vm->fstats ) vm->fstats(vm,"neko_read_module_jit",0);
 	}
+	// field caches
+	if( m->jit == NULL ) {
+		obj_cache *c;
+		int ncaches = 0;
+		for(i=0;i<m->codesize;i++) {
+			int_val op = m->code[i];
+			if( op == AccField || op == SetField )
+				ncaches++;
+			i += parameter_table[op];
+		}
+		if( ncaches ) {
+			c = (obj_cache*)alloc(sizeof(obj_cache) * ncaches);
+			m->caches = c;
+			for(i=0;i<m->codesize;i++) {
+				int_val op = m->code[i];
+				if( op == AccField || op == SetField ) {
+					obj_cache_init(c,(field)m->code[i+1]);
+					m->code[i+1] = (int_val)c++;
+				}
+				i += parameter_table[op];
+			}
+		}
+#		if !defined(NEKO_PROF) && !defined(NEKO_NO_FUSION)
+		// fuse common pairs of instructions : the second instruction is kept
+		// in place so that jumps to it and fallback paths still work
+		for(i=0;i<m->codesize;i++) {
+			int_val op = m->code[i];
+			int_val next = m->code[i + parameter_table[op] + 1];
+			switch( op ) {
+			case AccStack:
+				if( next == Push ) m->code[i] = AccStackPush;
+				break;
+			case AccStack0:
+				if( next == Push ) m->code[i] = AccStack0Push;
+				break;
+			case AccStack1:
+				if( next == Push ) m->code[i] = AccStack1Push;
+				break;
+			case AccInt:
+				if( next == Add ) m->code[i] = AddInt;
+				else if( next == Sub ) m->code[i] = SubInt;
+				break;
+			case Eq:
+				if( next == JumpIfNot ) m->code[i] = EqJumpIfNot;
+				break;
+			case Neq:
+				if( next == JumpIfNot ) m->code[i] = NeqJumpIfNot;
+				break;
+			case Lt:
+				if( next == JumpIfNot ) m->code[i] = LtJumpIfNot;
+				break;
+			case Lte:
+				if( next == JumpIfNot ) m->code[i] = LteJumpIfNot;
+				break;
+			case Gt:
+				if( next == JumpIfNot ) m->code[i] = GtJumpIfNot;
+				break;
+			case Gte:
+				if( next == JumpIfNot ) m->code[i] = GteJumpIfNot;
+				break;
+			case AccField:
+				if( next == ObjCall ) m->code[i] = AccFieldObjCall;
+				break;
+			}
+			i += parameter_table[op];
+		}
+#		endif
+		// count loop iterations
+		if( m->tier != NULL ) {
+			for(i=0;i<m->codesize;i++) {
+				int_val op = m->code[i];
+				if( op == Jump && (int_val*)m->code[i+1] <= m->code + i )
+					m->code[i] = TierJump;
+				i += parameter_table[op];
+			}
+		}
+	}
 #	ifdef NEKO_DIRECT_THREADED
 	{
 		int_val *jtbl = neko_get_ttable();
@@ -585,6 +966,240 @@ neko_module *neko_read_module( reader r, readp p, value loader ) {
 		if( vm->fstats ) vm->fstats(vm,"neko_read_module_thread",0);
 	}
 #	endif
+	if( m->lazy != NULL )
+		lazy_install(m);
+	return m;
+}
+
+static void input_init( module_input *in, reader r, readp p, const unsigned char *data, int len ) {
+	in->cur = data;
+	in->end = data + len;
+	in->r = r;
+	in->p = p;
+	in->map = NULL;
+	in->mapsize = 0;
+	in->mappos = 0;
+	in->image = NULL;
+}
+
+/*
+	Regular files are mapped (or read at once) from the current position
+	and the stream is moved past the module once it has been decoded.
+*/
+static int read_module_file( module_input *in, FILE *f ) {
+	struct stat st;
+	long start = ftell(f);
+	int size;
+	unsigned char *data;
+	if( start < 0 || fstat(fileno(f),&st) != 0 || (st.st_mode & S_IFMT) != S_IFREG || st.st_size <= start || st.st_size > 0x7FFFFFFF )
+		return 0;
+	size = (int)(st.st_size - start);
+#	ifdef NEKO_WINDOWS
+	data = (unsigned char*)malloc(size);
+	if( data == NULL )
+		return 0;
+	if( (int)fread(data,1,size,f) != size ) {
+		free(data);
+		fseek(f,start,SEEK_SET);
+		return 0;
+	}
+	input_init(in,NULL,NULL,data,size);
+	in->map = data;
+	in->mappos = start;
+#	else
+	data = (unsigned char*)mmap(NULL,(size_t)st.st_size,PROT_READ,MAP_PRIVATE,fileno(f),0);
+	if( data == (unsigned char*)MAP_FAILED )
+		return 0;
+	input_init(in,NULL,NULL,data + start,size);
+	in->map = data;
+	in->mapsize = (size_t)st.st_size;
+	in->mappos = start;
+#	endif
+	return 1;
+}
+
+neko_module *neko_read_module( reader r, readp p, value loader ) {
+	module_input in;
+	neko_module *m;
+	if( r == neko_string_reader ) {
+		string_pos *sp = (string_pos*)p;
+		int consumed;
+		input_init(&in,NULL,NULL,(unsigned char*)sp->p,sp->len);
+		m = read_module(&in,loader);
+		consumed = (int)(in.cur - (unsigned char*)sp->p);
+		sp->p += consumed;
+		sp->len -= consumed;
+		return m;
+	}
+	if( r == neko_file_reader && read_module_file(&in,(FILE*)p) ) {
+		const unsigned char *start = in.cur;
+		m = read_module(&in,loader);
+		input_release(&in);
+		fseek((FILE*)p,in.mappos + (long)(in.cur - start),SEEK_SET);
+		return m;
+	}
+	input_init(&in,r,p,NULL,0);
+	return read_module(&in,loader);
+}
+
+/*
+	Module images : when NEKO_MODULE_CACHE is set, loading "file.n" writes
+	"file.nc" next to it and later loads reuse it as long as the size and
+	digest of "file.n" match the ones recorded in the image. The image is
+	trusted without verification, so it also records the digest of its own
+	content, and it is written to a temporary file that is then renamed :
+	other processes can be reading or mapping the previous one.
+*/
+
+#define IMAGE_MAGIC		0x434B454E
+#define IMAGE_VERSION	(NEKO_VERSION * 100 + 2)
+#define IMAGE_HEADER	8
+
+static void module_digest( const unsigned char *data, int len, unsigned int d[2] ) {
+	unsigned int a = 0x811C9DC5 ^ (unsigned int)len;
+	unsigned int b = 0x9E3779B9;
+	unsigned int w;
+	while( len >= 4 ) {
+		memcpy(&w,data,4);
+		a = (a ^ w) * 0x01000193;
+		a ^= a >> 15;
+		b = (b + w) * 0x85EBCA6B;
+		b ^= b >> 13;
+		data += 4;
+		len -= 4;
+	}
+	while( len-- ) {
+		a = (a ^ *data) * 0x01000193;
+		b = (b + *data++) * 0x85EBCA6B;
+	}
+	d[0] = a;
+	d[1] = b;
+}
+
+static int image_enabled() {
+	const char *c = getenv("NEKO_MODULE_CACHE");
+	return c != NULL && *c != 0 && strcmp(c,"0") != 0;
+}
+
+static neko_module *image_load( const char *iname, unsigned int size, unsigned int d[2], value loader ) {
+	module_input in;
+	module_image im;
+	unsigned int h[IMAGE_HEADER];
+	unsigned int pd[2];
+	neko_module *m;
+	int i;
+	FILE *f = fopen(iname,"rb");
+	if( f == NULL )
+		return NULL;
+	if( !read_module_file(&in,f) ) {
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	for(i=0;i<IMAGE_HEADER;i++) {
+		const unsigned char *c = in.cur;
+		if( in.end - in.cur < 4 ) {
+			input_release(&in);
+			return NULL;
+		}
+		h[i] = c[0] | (c[1] << 8) | (c[2] << 16) | ((unsigned int)c[3] << 24);
+		in.cur += 4;
+	}
+	if( h[0] != IMAGE_MAGIC || h[1] != IMAGE_VERSION || h[2] != size || h[3] != d[0] || h[4] != d[1] || h[5] != (unsigned int)(in.end - in.cur) ) {
+		input_release(&in);
+		return NULL;
+	}
+	module_digest(in.cur,(int)h[5],pd);
+	if( h[6] != pd[0] || h[7] != pd[1] ) {
+		input_release(&in);
+		return NULL;
+	}
+	memset(&im,0,sizeof(im));
+	im.load = 1;
+	in.image = &im;
+	m = read_module(&in,loader);
+	input_release(&in);
+	return m;
+}
+
+static void image_save( const char *iname, unsigned int size, unsigned int d[2], module_image *im ) {
+	unsigned int h[IMAGE_HEADER];
+	unsigned char head[IMAGE_HEADER * 4];
+	unsigned int pd[2];
+	char *tname;
+	int i, len;
+	FILE *f;
+	len = (int)strlen(iname);
+	tname = (char*)alloc_private(len + 16);
+	sprintf(tname,"%s.%d.tmp",iname,(int)getpid());
+	f = fopen(tname,"wb");
+	if( f == NULL )
+		return;
+	module_digest(im->save,im->savesize,pd);
+	h[0] = IMAGE_MAGIC;
+	h[1] = IMAGE_VERSION;
+	h[2] = size;
+	h[3] = d[0];
+	h[4] = d[1];
+	h[5] = (unsigned int)im->savesize;
+	h[6] = pd[0];
+	h[7] = pd[1];
+	for(i=0;i<IMAGE_HEADER;i++) {
+		head[i*4] = (unsigned char)h[i];
+		head[i*4+1] = (unsigned char)(h[i] >> 8);
+		head[i*4+2] = (unsigned char)(h[i] >> 16);
+		head[i*4+3] = (unsigned char)(h[i] >> 24);
+	}
+	if( fwrite(head,1,sizeof(head),f) != sizeof(head) || (int)fwrite(im->save,1,im->savesize,f) != im->savesize ) {
+		fclose(f);
+		remove(tname);
+		return;
+	}
+	if( fclose(f) != 0 ) {
+		remove(tname);
+		return;
+	}
+#	ifdef NEKO_WINDOWS
+	// rename does not replace files, but images are not mapped there
+	remove(iname);
+#	endif
+	if( rename(tname,iname) != 0 )
+		remove(tname);
+}
+
+neko_module *neko_read_module_file( readp p, const char *fname, value loader ) {
+	FILE *f = (FILE*)p;
+	module_input in;
+	module_image im;
+	neko_module *m;
+	unsigned int size;
+	unsigned int d[2];
+	char *iname;
+	int len;
+	if( fname == NULL || !image_enabled() || !read_module_file(&in,f) )
+		return neko_read_module(neko_file_reader,f,loader);
+	size = (unsigned int)(in.end - in.cur);
+	module_digest(in.cur,(int)size,d);
+	input_release(&in);
+	fseek(f,in.mappos,SEEK_SET);
+	len = (int)strlen(fname);
+	iname = (char*)alloc_private(len + 2);
+	memcpy(iname,fname,len);
+	iname[len] = 'c';
+	iname[len+1] = 0;
+	m = image_load(iname,size,d,loader);
+	if( m != NULL )
+		return m;
+	if( !read_module_file(&in,f) )
+		return neko_read_module(neko_file_reader,f,loader);
+	memset(&im,0,sizeof(im));
+	im.data = in.cur;
+	// trusted code skips the checks, so it must not produce a verified image
+	in.image = NEKO_VM()->trusted_code ? NULL : &im;
+	m = read_module(&in,loader);
+	input_release(&in);
+	if( m != NULL && in.image != NULL )
+		image_save(iname,size,d,&im);
 	return m;
 }
 
@@ -42,6 +42,9 @@ typedef struct _neko_module {
 	neko_debug *dbgidxs;
 	int_val *code;
 	value jit_gc;
+	void *caches;
+	void *lazy;
+	void *tier;
 } neko_module;
 
 typedef void *readp;
@@ -57,6 +60,7 @@ C_FUNCTION_BEGIN
 VEXTERN field neko_id_module;
 VEXTERN vkind neko_kind_module;
 EXTERN neko_module *neko_read_module( reader r, readp p, value loader );
+EXTERN neko_module *neko_read_module_file( readp p, const char *fname, value loader ); // FILE *
 EXTERN int neko_file_reader( readp p, void *buf, int size ); // FILE *
 EXTERN int neko_string_reader( readp p, void *buf, int size ); // string_pos *
 EXTERN value neko_select_file( value path, const char *file, const char *ext );
@@ -30,13 +30,25 @@ typedef struct _neko_vm neko_vm;
 
 typedef void (*neko_stat_func)( neko_vm *vm, const char *kind, int start );
 
+#define NEKO_GC_PAUSE_BUCKETS	12
+
+#define NEKO_FIBER_NEW			0
+#define NEKO_FIBER_SUSPENDED	1
+#define NEKO_FIBER_RUNNING		2
+#define NEKO_FIBER_DEAD			3
+
 C_FUNCTION_BEGIN
 
+VEXTERN vkind neko_kind_fiber;
+
 EXTERN void neko_global_init();
 EXTERN void neko_global_free();
 EXTERN void neko_gc_major();
 EXTERN void neko_gc_loop();
+EXTERN int neko_gc_fork();
 EXTERN void neko_gc_stats( int *heap, int *free );
+EXTERN void neko_gc_pause_stats( int *pauses, int *max_pause );
+EXTERN void neko_gc_vm_stats( neko_vm *vm, int *allocs, int *refills );
 EXTERN int neko_thread_create( thread_main_func init, thread_main_func main, void *param, void **handle );
 EXTERN void neko_thread_blocking( thread_main_func f, void *p );
 EXTERN bool neko_thread_register( bool t );
@@ -55,9 +67,31 @@ EXTERN value neko_default_loader( char **argv, int argc );
 EXTERN void neko_vm_redirect( neko_vm *vm, neko_printer print, void *param );
 EXTERN void neko_vm_set_stats( neko_vm *vm, neko_stat_func fstats, neko_stat_func pstats );
 EXTERN void neko_vm_dump_stack( neko_vm *vm );
+EXTERN int neko_profile_start( int hz );
+EXTERN void neko_profile_stop();
+EXTERN int neko_profile_dump( const char *file );
+EXTERN value neko_fiber_alloc( value f, int stack_size );
+EXTERN value neko_fiber_resume( value fiber, value v );
+EXTERN value neko_fiber_yield( value v );
+EXTERN void neko_fiber_dispose( value fiber );
+EXTERN value neko_fiber_current();
+EXTERN int neko_fiber_status( value fiber );
 
 EXTERN int neko_is_big_endian();
 
+EXTERN vhash *neko_hash_alloc( int size );
+EXTERN int neko_hash_find( vhash *h, int hkey, value key, value cmp );
+EXTERN bool neko_hash_set( vhash *h, int hkey, value key, value val, value cmp );
+EXTERN void neko_hash_add( vhash *h, int hkey, value key, value val, bool below );
+EXTERN bool neko_hash_remove( vhash *h, int hkey, value key, value cmp );
+EXTERN int neko_hash_find_string( vhash *h, int hkey, const char *s, int len );
+EXTERN int neko_hash_find_int( vhash *h, int k );
+EXTERN void neko_hash_insert( vhash *h, int hkey, value key, value val );
+EXTERN void neko_hash_remove_slot( vhash *h, int i );
+EXTERN void neko_hash_resize( vhash *h, int size );
+EXTERN int neko_hash_string( const char *s, int len );
+EXTERN int neko_val_hash_compat( value v );
+
 C_FUNCTION_END
 
 #endif
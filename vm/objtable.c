@@ -22,14 +22,36 @@
 #include <string.h>
 #include "objtable.h"
 
-int otable_remove( objtable *t, field id ) {
+// objects with more fields, or shapes with more transitions, use private shapes
+#define SHAPE_MAX_FIELDS	64
+#define SHAPE_MAX_TRANS		64
+
+typedef struct {
+	field id;
+	objshape *next;
+} shape_link;
+
+struct _shape_trans {
+	int count;
+	shape_link links[1];
+};
+
+static objshape *root_shape = NULL;
+static mt_lock *shapes_lock = NULL;
+
+static objshape *oshape_alloc( int count ) {
+	objshape *s = (objshape*)alloc(sizeof(objshape) + (count ? count - 1 : 0) * sizeof(shape_cell));
+	s->count = count;
+	s->trans = NULL;
+	return s;
+}
+
+static int oshape_search( objshape *s, field id, int *pos ) {
 	int min = 0;
-	int max = t->count;
+	int max = s->count;
 	int mid;
 	field cid;
-	objcell *c = t->cells;
-	if( !max )
-		return 0;
+	shape_cell *c = s->cells;
 	while( min < max ) {
 		mid = (min + max) >> 1;
 		cid = c[mid].id;
@@ -38,72 +60,200 @@ int otable_remove( objtable *t, field id ) {
 		else if( cid > id )
 			max = mid;
 		else {
-			t->count--;
-			memmove(&c[mid], &c[mid + 1], (t->count - mid) * sizeof(objcell));
-			c[t->count].v = val_null;
+			*pos = mid;
 			return 1;
 		}
 	}
+	*pos = min;
 	return 0;
 }
 
-void otable_optimize( objtable *t ) {
-	int max = t->count;
-	int i;
-	int cur = 0;
-	objcell *c = t->cells;
-	for(i=0;i<max;i++) {
-		value v = c[i].v;
-		if( v != val_null )
-			c[cur++] = c[i];
-	}
-	for(i=cur;i<max;i++)
-		c[i].v = NULL;
-	t->count = cur;
+static objshape *oshape_add( objshape *s, field id, int shared ) {
+	objshape *n = oshape_alloc(s->count + 1);
+	int k;
+	oshape_search(s,id,&k);
+	memcpy(n->cells,s->cells,k * sizeof(shape_cell));
+	n->cells[k].id = id;
+	n->cells[k].slot = s->nslots;
+	memcpy(&n->cells[k+1],&s->cells[k],(s->count - k) * sizeof(shape_cell));
+	n->nslots = s->nslots + 1;
+	n->shared = shared;
+	return n;
 }
 
-void otable_replace( objtable *t, field id, value data ) {
-	int min = 0;
-	int max = t->count;
-	int mid;
-	field cid;
-	objcell *c = t->cells;
-	const size_t objcell_size = sizeof(objcell);
-	while( min < max ) {
-		mid = (min + max) >> 1;
-		cid = c[mid].id;
-		if( cid < id )
-			min = mid + 1;
-		else if( cid > id )
-			max = mid;
-		else {
-			c[mid].v = data;
-			return;
+objshape *oshape_next( objshape *s, field id ) {
+	shape_trans *t;
+	shape_trans *t2;
+	objshape *n;
+	int i, count;
+	if( !s->shared || s->count >= SHAPE_MAX_FIELDS )
+		return oshape_add(s,id,0);
+	t = s->trans;
+	count = t ? t->count : 0;
+	for(i=0;i<count;i++)
+		if( t->links[i].id == id )
+			return t->links[i].next;
+	lock_acquire(shapes_lock);
+	// another thread might have added it
+	t = s->trans;
+	count = t ? t->count : 0;
+	for(i=0;i<count;i++)
+		if( t->links[i].id == id ) {
+			lock_release(shapes_lock);
+			return t->links[i].next;
 		}
+	if( count >= SHAPE_MAX_TRANS ) {
+		lock_release(shapes_lock);
+		return oshape_add(s,id,0);
+	}
+	n = oshape_add(s,id,1);
+	t2 = (shape_trans*)alloc(sizeof(shape_trans) + count * sizeof(shape_link));
+	if( count )
+		memcpy(t2->links,t->links,count * sizeof(shape_link));
+	t2->links[count].id = id;
+	t2->links[count].next = n;
+	t2->count = count + 1;
+	s->trans = t2;
+	lock_release(shapes_lock);
+	return n;
+}
+
+void neko_init_shapes() {
+	root_shape = (objshape*)alloc_root(sizeof(objshape) / sizeof(value) + 1);
+	root_shape->count = 0;
+	root_shape->nslots = 0;
+	root_shape->shared = 1;
+	root_shape->trans = NULL;
+	shapes_lock = alloc_lock();
+}
+
+void neko_free_shapes() {
+	free_root((value*)root_shape);
+	free_lock(shapes_lock);
+	root_shape = NULL;
+}
+
+void obj_init( vobject *o ) {
+	o->shape = root_shape;
+	o->size = 0;
+	o->slots = NULL;
+}
+
+void obj_add( vobject *o, objshape *s, value data ) {
+	int slot = s->nslots - 1;
+	if( slot >= o->size ) {
+		int size = o->size ? o->size << 1 : 4;
+		value *slots = (value*)alloc(sizeof(value) * size);
+		memcpy(slots,o->slots,o->size * sizeof(value));
+		o->slots = slots;
+		o->size = size;
 	}
-	mid = (min + max) >> 1;
-	c = (objcell*)alloc(objcell_size * (t->count + 1));
-	memcpy(c, t->cells, mid * objcell_size);
-	c[mid].id = id;
-	c[mid].v = data;
-	memcpy(&c[mid + 1], &t->cells[mid], (t->count - mid) * objcell_size);
-	t->cells = c;
-	t->count++;
+	o->slots[slot] = data;
+	o->shape = s;
 }
 
-void otable_copy( objtable *t, objtable *target ) {
-	const size_t size = sizeof(objcell) * t->count;
-	target->count = t->count;
-	target->cells = (objcell*)alloc(size);
-	memcpy(target->cells,t->cells,size);
+void obj_replace( vobject *o, field id, value data ) {
+	int k = oshape_find(o->shape,id);
+	if( k >= 0 )
+		o->slots[k] = data;
+	else
+		obj_add(o,oshape_next(o->shape,id),data);
 }
 
-void otable_iter(objtable *t, void f( value data, field id, void *), void *p ) {
+int obj_remove( vobject *o, field id ) {
+	objshape *s = o->shape;
+	objshape *n;
+	int k;
+	if( !oshape_search(s,id,&k) )
+		return 0;
+	n = oshape_alloc(s->count - 1);
+	memcpy(n->cells,s->cells,k * sizeof(shape_cell));
+	memcpy(&n->cells[k],&s->cells[k+1],(s->count - k - 1) * sizeof(shape_cell));
+	n->nslots = s->nslots;
+	n->shared = 0;
+	o->slots[s->cells[k].slot] = val_null;
+	o->shape = n;
+	return 1;
+}
+
+void obj_copy( vobject *o, vobject *target ) {
+	int n = o->shape->nslots;
+	target->shape = o->shape;
+	target->size = n;
+	if( n ) {
+		target->slots = (value*)alloc(sizeof(value) * n);
+		memcpy(target->slots,o->slots,sizeof(value) * n);
+	} else
+		target->slots = NULL;
+}
+
+void obj_iter( vobject *o, void f( value data, field id, void *), void *p ) {
 	int i;
-	const int n = (const int)t->count;
-	objcell *c = t->cells;
+	objshape *s = o->shape;
+	const int n = s->count;
 	for(i=0;i<n;i++)
-		f(c[i].v,c[i].id,p);
+		f(o->slots[s->cells[i].slot],s->cells[i].id,p);
+}
+
+void obj_cache_init( obj_cache *c, field id ) {
+	int w;
+	c->id = id;
+	c->updates = 0;
+	for(w=0;w<OBJ_CACHE_WAYS;w++)
+		c->ways[w] = NULL;
+}
+
+static void obj_cache_insert( obj_cache *c, obj_cache_entry *e ) {
+	int w;
+	for(w=OBJ_CACHE_WAYS-1;w>0;w--)
+		c->ways[w] = c->ways[w-1];
+	c->ways[0] = e;
+	c->updates++;
+}
+
+value *obj_cache_update( obj_cache *c, vobject *o ) {
+	objshape *shapes[OBJ_CACHE_DEPTH];
+	int d = 0;
+	while( o ) {
+		int k = oshape_find(o->shape,c->id);
+		if( d < OBJ_CACHE_DEPTH )
+			shapes[d] = o->shape;
+		if( k >= 0 ) {
+			if( d < OBJ_CACHE_DEPTH && c->updates < OBJ_CACHE_UPDATES ) {
+				obj_cache_entry *e = (obj_cache_entry*)alloc(sizeof(obj_cache_entry));
+				memcpy(e->shapes,shapes,(d + 1) * sizeof(objshape*));
+				e->next = NULL;
+				e->depth = d;
+				e->slot = k;
+				obj_cache_insert(c,e);
+			}
+			return &o->slots[k];
+		}
+		o = o->proto;
+		d++;
+	}
+	return NULL;
+}
+
+void obj_cache_update_set( obj_cache *c, vobject *o, value data ) {
+	objshape *s = o->shape;
+	objshape *next = NULL;
+	int k = oshape_find(s,c->id);
+	if( k >= 0 )
+		o->slots[k] = data;
+	else {
+		next = oshape_next(s,c->id);
+		k = next->nslots - 1;
+		obj_add(o,next,data);
+	}
+	if( c->updates < OBJ_CACHE_UPDATES ) {
+		obj_cache_entry *e = (obj_cache_entry*)alloc(sizeof(obj_cache_entry));
+		e->shapes[0] = s;
+		e->next = next;
+		e->depth = 0;
+		e->slot = k;
+		obj_cache_insert(c,e);
+	}
 }
 
 /* ************************************************************************ */
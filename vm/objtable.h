@@ -23,20 +23,39 @@
 #define __OBJTABLE_H
 #include "neko.h"
 
-static INLINE void otable_init(objtable *t) {
-	t->count = 0;
-	t->cells = NULL;
-}
+/*
+	Objects are described by a shape which maps each field id to a slot of
+	the object value array. Objects built by adding the same fields in the
+	same order share their shapes through a transition tree rooted at the
+	empty shape. Shapes are never modified once created, so two objects
+	with the same shape pointer have the same layout. Cells are sorted by
+	field id, which gives the fields iteration order.
+*/
+
+typedef struct {
+	field id;
+	int slot;
+} shape_cell;
+
+typedef struct _shape_trans shape_trans;
 
-static INLINE value *otable_find(objtable *t,field id) {
+typedef struct _objshape {
+	int count;
+	int nslots;
+	int shared;
+	shape_trans *trans;
+	shape_cell cells[1];
+} objshape;
+
+static INLINE int oshape_find(objshape *s,field id) {
 	int min;
 	int max;
 	int mid;
-	objcell *c;
+	const shape_cell *c;
 	field cid;
 	min = 0;
-	max = t->count;
-	c = t->cells;
+	max = s->count;
+	c = s->cells;
 	while( min < max ) {
 		mid = (min + max) >> 1;
 		cid = c[mid].id;
@@ -45,40 +64,96 @@ static INLINE value *otable_find(objtable *t,field id) {
 		else if( cid > id )
 			max = mid;
 		else
-			return &c[mid].v;
+			return c[mid].slot;
 	}
-	return NULL;
+	return -1;
 }
 
-static INLINE value otable_get(objtable *t,field id) {
-	int min;
-	int max;
-	int mid;
-	const objcell *c;
-	field cid;
-	min = 0;
-	max = t->count;
-	c = (const objcell*)t->cells;
-	while( min < max ) {
-		mid = (min + max) >> 1;
-		cid = c[mid].id;
-		if( cid < id )
-			min = mid + 1;
-		else if( cid > id )
-			max = mid;
-		else
-			return c[mid].v;
+static INLINE value *obj_find(vobject *o,field id) {
+	int k = oshape_find(o->shape,id);
+	return (k < 0) ? NULL : &o->slots[k];
+}
+
+#define obj_count(o)	(o)->shape->count
+
+void obj_init(vobject *o);
+void obj_add(vobject *o, objshape *s, value data);
+void obj_replace(vobject *o, field id, value data);
+int obj_remove(vobject *o, field id);
+void obj_copy(vobject *o, vobject *target);
+void obj_iter(vobject *o, void f( value data, field id, void *), void *p );
+objshape *oshape_next(objshape *s, field id);
+
+/*
+	Per call-site field cache used by the interpreter. Each entry records
+	the shapes of the prototype chain up to the object holding the field,
+	and the slot of the field. For SetField, [next] is the shape reached
+	by adding the field (NULL if the field already exists). Entries are
+	immutable so they can be read without locking ; a site that keeps
+	missing eventually stops being updated.
+*/
+
+#define OBJ_CACHE_WAYS		2
+#define OBJ_CACHE_DEPTH		4
+#define OBJ_CACHE_UPDATES	64
+
+typedef struct {
+	objshape *shapes[OBJ_CACHE_DEPTH];
+	objshape *next;
+	int depth;
+	int slot;
+} obj_cache_entry;
+
+typedef struct {
+	field id;
+	int updates;
+	obj_cache_entry *ways[OBJ_CACHE_WAYS];
+} obj_cache;
+
+value *obj_cache_update(obj_cache *c, vobject *o);
+void obj_cache_update_set(obj_cache *c, vobject *o, value data);
+
+static INLINE value *obj_cache_find(obj_cache *c,vobject *o) {
+	int w, d;
+	for(w=0;w<OBJ_CACHE_WAYS;w++) {
+		obj_cache_entry *e = c->ways[w];
+		vobject *cur = o;
+		if( e == NULL )
+			break;
+		d = 0;
+		while( cur->shape == e->shapes[d] ) {
+			if( d == e->depth )
+				return &cur->slots[e->slot];
+			cur = cur->proto;
+			if( cur == NULL )
+				break;
+			d++;
+		}
 	}
-	return val_null;
+	return obj_cache_update(c,o);
 }
 
-void otable_replace(objtable *t, field id, value data);
-int otable_remove(objtable *t, field id);
-void otable_optimize(objtable *t);
-#define otable_count(t)	(t)->count
+static INLINE void obj_cache_set(obj_cache *c,vobject *o,value data) {
+	int w;
+	for(w=0;w<OBJ_CACHE_WAYS;w++) {
+		obj_cache_entry *e = c->ways[w];
+		if( e == NULL )
+			break;
+		if( o->shape == e->shapes[0] ) {
+			if( e->next == NULL )
+				o->slots[e->slot] = data;
+			else if( e->slot < o->size ) {
+				o->slots[e->slot] = data;
+				o->shape = e->next;
+			} else
+				obj_add(o,e->next,data);
+			return;
+		}
+	}
+	obj_cache_update_set(c,o,data);
+}
 
-void otable_copy(objtable *t, objtable *target);
-void otable_iter(objtable *t, void f( value data, field id, void *), void *p );
+void obj_cache_init(obj_cache *c, field id);
 
 #endif
 /* ************************************************************************ */
@@ -96,6 +96,50 @@ OPBEGIN
 
 	OP(MakeArray2),
 	OP(AccInt32),
+
+	OP(AccStackPush),
+	OP(AccStack0Push),
+	OP(AccStack1Push),
+	OP(AddInt),
+	OP(SubInt),
+	OP(EqJumpIfNot),
+	OP(NeqJumpIfNot),
+	OP(LtJumpIfNot),
+	OP(LteJumpIfNot),
+	OP(GtJumpIfNot),
+	OP(GteJumpIfNot),
+	OP(AccFieldObjCall),
+
+	OP(AddGen),
+	OP(AddII),
+	OP(AddFF),
+	OP(SubGen),
+	OP(SubII),
+	OP(SubFF),
+	OP(MultGen),
+	OP(MultII),
+	OP(MultFF),
+	OP(EqGen),
+	OP(EqII),
+	OP(EqFF),
+	OP(NeqGen),
+	OP(NeqII),
+	OP(NeqFF),
+	OP(LtGen),
+	OP(LtII),
+	OP(LtFF),
+	OP(LteGen),
+	OP(LteII),
+	OP(LteFF),
+	OP(GtGen),
+	OP(GtII),
+	OP(GtFF),
+	OP(GteGen),
+	OP(GteII),
+	OP(GteFF),
+
+	OP(Verify),
+	OP(TierJump),
 	OP(Last),
 OPEND
 
@@ -168,6 +212,47 @@ static int parameter_table[] = {
 	0, // Loop
 	1, // MakeArray2
 	1, // AccInt32
+	1, // AccStackPush
+	0, // AccStack0Push
+	0, // AccStack1Push
+	1, // AddInt
+	1, // SubInt
+	0, // EqJumpIfNot
+	0, // NeqJumpIfNot
+	0, // LtJumpIfNot
+	0, // LteJumpIfNot
+	0, // GtJumpIfNot
+	0, // GteJumpIfNot
+	1, // AccFieldObjCall
+	0, // AddGen
+	0, // AddII
+	0, // AddFF
+	0, // SubGen
+	0, // SubII
+	0, // SubFF
+	0, // MultGen
+	0, // MultII
+	0, // MultFF
+	0, // EqGen
+	0, // EqII
+	0, // EqFF
+	0, // NeqGen
+	0, // NeqII
+	0, // NeqFF
+	0, // LtGen
+	0, // LtII
+	0, // LtFF
+	0, // LteGen
+	0, // LteII
+	0, // LteFF
+	0, // GtGen
+	0, // GtII
+	0, // GtFF
+	0, // GteGen
+	0, // GteII
+	0, // GteFF
+	0, // Verify
+	1, // TierJump
 };
 #endif
 
@@ -242,6 +327,47 @@ static int stack_table[] = {
 	0, // Loop
 	-P, // MakeArray2
 	0, // AccInt32
+	1, // AccStackPush
+	1, // AccStack0Push
+	1, // AccStack1Push
+	-1, // AddInt
+	-1, // SubInt
+	-1, // EqJumpIfNot
+	-1, // NeqJumpIfNot
+	-1, // LtJumpIfNot
+	-1, // LteJumpIfNot
+	-1, // GtJumpIfNot
+	-1, // GteJumpIfNot
+	-P, // AccFieldObjCall
+	-1, // AddGen
+	-1, // AddII
+	-1, // AddFF
+	-1, // SubGen
+	-1, // SubII
+	-1, // SubFF
+	-1, // MultGen
+	-1, // MultII
+	-1, // MultFF
+	-1, // EqGen
+	-1, // EqII
+	-1, // EqFF
+	-1, // NeqGen
+	-1, // NeqII
+	-1, // NeqFF
+	-1, // LtGen
+	-1, // LtII
+	-1, // LtFF
+	-1, // LteGen
+	-1, // LteII
+	-1, // LteFF
+	-1, // GtGen
+	-1, // GtII
+	-1, // GtFF
+	-1, // GteGen
+	-1, // GteII
+	-1, // GteFF
+	0, // Verify
+	0, // TierJump
 	0, // Last
 };
 #endif
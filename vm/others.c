@@ -29,9 +29,9 @@
 #define FLOAT_FMT	"%.15g"
 
 DEFINE_KIND(k_hash);
+DEFINE_KIND(neko_kind_rope);
 
 extern mt_lock *neko_fields_lock;
-extern objtable *neko_fields;
 extern field id_compare;
 extern field id_string;
 extern char *jit_handle_trap;
@@ -53,6 +53,10 @@ static INLINE int scmp( const char *s1, int l1, const char *s2, int l2 ) {
 
 EXTERN int val_compare( value a, value b ) {
 	char tmp_buf[32];
+	if( val_is_rope(a) )
+		a = neko_rope_flatten(a);
+	if( val_is_rope(b) )
+		b = neko_rope_flatten(b);
 	switch( C(val_type(a),val_type(b)) ) {
 	case C(VAL_INT,VAL_INT):
 		return icmp(val_int(a),val_int(b));
@@ -111,65 +115,56 @@ EXTERN int val_compare( value a, value b ) {
 	}
 }
 
-typedef struct _stringitem {
-	char *str;
-	int size;
-	int len;
-	struct _stringitem *next;
-} * stringitem;
+/*
+	The buffer is a single string that grows geometrically. Its capacity is
+	kept across buffer_clear, and buffer_to_string returns the string itself
+	when it is exactly full ; the buffer then has to copy it before writing.
+*/
 
 struct _buffer {
-	int totlen;
-	int blen;
-	stringitem data;
+	int len;
+	int size;
+	int capacity;
+	value str;
 };
 
 EXTERN buffer alloc_buffer( const char *init ) {
 	buffer b = (buffer)alloc(sizeof(struct _buffer));
-	b->totlen = 0;
-	b->blen = 16;
-	b->data = NULL;
+	b->len = 0;
+	b->size = 0;
+	b->capacity = 16;
+	b->str = NULL;
 	if( init )
 		buffer_append(b,init);
 	return b;
 }
 
-static void buffer_append_new( buffer b, const char *s, int len ) {
-	int size;
-	stringitem it;
-	while( b->totlen >= (b->blen << 2) )
-		b->blen <<= 1;
-	size = (len < b->blen)?b->blen:len;
-	it = (stringitem)alloc(sizeof(struct _stringitem));
-	it->str = alloc_private(size);
-	memcpy(it->str,s,len);
-	it->size = size;
-	it->len = len;
-	it->next = b->data;
-	b->data = it;
+static void buffer_grow( buffer b, int len ) {
+	unsigned int need = (unsigned int)b->len + len;
+	unsigned int size = b->capacity;
+	value s;
+	if( need > max_string_size )
+		failure("max_string_size reached");
+	while( size < need )
+		size <<= 1;
+	if( size > max_string_size )
+		size = max_string_size;
+	s = alloc_empty_string(size);
+	if( b->len )
+		memcpy((char*)val_string(s),val_string(b->str),b->len);
+	b->str = s;
+	b->size = size;
+	b->capacity = size;
 }
 
 EXTERN void buffer_append_sub( buffer b, const char *s, int_val _len ) {
-	stringitem it;
 	int len = (int)_len;
 	if( s == NULL || len <= 0 )
 		return;
-	b->totlen += len;
-	it = b->data;
-	if( it ) {
-		int free = it->size - it->len;
-		if( free >= len ) {
-			memcpy(it->str + it->len,s,len);
-			it->len += len;
-			return;
-		} else {
-			memcpy(it->str + it->len,s,free);
-			it->len += free;
-			s += free;
-			len -= free;
-		}
-	}
-	buffer_append_new(b,s,len);
+	if( b->size - b->len < len )
+		buffer_grow(b,len);
+	memcpy((char*)val_string(b->str) + b->len,s,len);
+	b->len += len;
 }
 
 EXTERN void buffer_append( buffer b, const char *s ) {
@@ -179,32 +174,25 @@ EXTERN void buffer_append( buffer b, const char *s ) {
 }
 
 EXTERN void buffer_append_char( buffer b, char c ) {
-	stringitem it;
-	b->totlen++;
-	it = b->data;
-	if( it && it->len != it->size ) {
-		it->str[it->len++] = c;
-		return;
-	}
-	buffer_append_new(b,&c,1);
+	if( b->len == b->size )
+		buffer_grow(b,1);
+	((char*)val_string(b->str))[b->len++] = c;
 }
 
 EXTERN value buffer_to_string( buffer b ) {
-	value v = alloc_empty_string(b->totlen);
-	stringitem it = b->data;
-	char *s = (char*)val_string(v) + b->totlen;
-	while( it != NULL ) {
-		stringitem tmp;
-		s -= it->len;
-		memcpy(s,it->str,it->len);
-		tmp = it->next;
-		it = tmp;
+	if( b->len == b->size && b->len > 0 ) {
+		b->size = 0;
+		return b->str;
 	}
-	return v;
+	return copy_string(b->len ? val_string(b->str) : "",b->len);
 }
 
 EXTERN int buffer_length( buffer b ) {
-	return b->totlen;
+	return b->len;
+}
+
+EXTERN void buffer_clear( buffer b ) {
+	b->len = 0;
 }
 
 typedef struct vlist {
@@ -309,7 +297,10 @@ static void val_buffer_rec( buffer b, value v, vlist *stack ) {
 		buffer_append_sub(b,buf,sprintf(buf,"%d",val_int32(v)));
 		break;
 	case VAL_ABSTRACT:
-		buffer_append_sub(b,"#abstract",9);
+		if( val_is_rope(v) )
+			buffer_append_sub(b,rope_data((vrope*)v),((vrope*)v)->len);
+		else
+			buffer_append_sub(b,"#abstract",9);
 		break;
 	default:
 		buffer_append_sub(b,"#unknown",8);
@@ -350,6 +341,108 @@ value neko_append_strings( value s1, value s2 ) {
 	return v;
 }
 
+/*
+	Ropes are the result of adding something to a long string. The
+	characters are kept in a buffer with some spare space, so that
+	appending to the rope that ends at the buffer's end is done in place
+	and [s = s + x] loops are linear. Ropes never leave the interpreter :
+	they are flattened when passed to a primitive or stored in the heap.
+*/
+
+static rope_buffer *rope_buffer_alloc( int size ) {
+	rope_buffer *b = (rope_buffer*)alloc_private(sizeof(rope_buffer) + size);
+	b->size = size;
+	b->used = 0;
+	return b;
+}
+
+static value rope_alloc( rope_buffer *b, int len ) {
+	vrope *r = (vrope*)alloc(sizeof(vrope));
+	r->t = VAL_ABSTRACT;
+	r->kind = neko_kind_rope;
+	r->buf = b;
+	r->flat = NULL;
+	r->len = len;
+	return (value)r;
+}
+
+static const char *rope_chars( neko_vm *vm, value v, int *len ) {
+	buffer b;
+	if( val_is_int(v) ) {
+		*len = sprintf(vm->tmp,"%d",val_int(v));
+		return vm->tmp;
+	}
+	if( val_short_tag(v) == VAL_STRING ) {
+		*len = val_strlen(v);
+		return val_string(v);
+	}
+	if( val_is_rope(v) ) {
+		*len = ((vrope*)v)->len;
+		return rope_data((vrope*)v);
+	}
+	// objects can overload the operation
+	if( val_tag(v) == VAL_OBJECT )
+		return NULL;
+	b = alloc_buffer(NULL);
+	val_buffer(b,v);
+	v = buffer_to_string(b);
+	*len = val_strlen(v);
+	return val_string(v);
+}
+
+value neko_rope_flatten( value v ) {
+	vrope *r = (vrope*)v;
+	if( !val_is_rope(v) )
+		return v;
+	if( r->flat == NULL )
+		r->flat = copy_string(r->buf->data,r->len);
+	return r->flat;
+}
+
+value neko_rope_add( neko_vm *vm, value a, value b ) {
+	const char *sa, *sb;
+	int la, lb, size;
+	rope_buffer *buf;
+	// the buffer of a flattened rope is stale if the string was modified
+	if( val_is_rope(a) && ((vrope*)a)->flat != NULL )
+		a = ((vrope*)a)->flat;
+	if( val_is_rope(a) ) {
+		vrope *r = (vrope*)a;
+		sb = rope_chars(vm,b,&lb);
+		if( sb == NULL )
+			return NULL;
+		if( (unsigned int)r->len + lb > max_string_size )
+			failure("max_string_size reached");
+		buf = r->buf;
+		// reserve the space after the rope if no one else did
+		if( buf->used == r->len && buf->size - r->len >= lb && neko_cas_int(&buf->used,r->len,r->len + lb) ) {
+			memcpy(buf->data + r->len,sb,lb);
+			return rope_alloc(buf,r->len + lb);
+		}
+		sa = buf->data;
+		la = r->len;
+	} else {
+		if( !val_is_rope(b) && (val_is_int(a) || val_short_tag(a) != VAL_STRING || val_strlen(a) < ROPE_MIN_LENGTH) )
+			return NULL;
+		sa = rope_chars(vm,a,&la);
+		if( sa == NULL )
+			return NULL;
+		sb = rope_chars(vm,b,&lb);
+		if( sb == NULL )
+			return NULL;
+		if( (unsigned int)la + lb > max_string_size )
+			failure("max_string_size reached");
+	}
+	size = (la + lb) << 1;
+	if( size < 0 || size > max_string_size )
+		size = la + lb;
+	buf = rope_buffer_alloc(size);
+	memcpy(buf->data,sa,la);
+	memcpy(buf->data + la,sb,lb);
+	buf->used = la + lb;
+	return rope_alloc(buf,la + lb);
+}
+
 int neko_stack_expand( int_val *sp, int_val *csp, neko_vm *vm ) {
 	int i;
 	int size = (int)((((int_val)vm->spmax - (int_val)vm->spmin) / sizeof(int_val)) << 1);
@@ -377,9 +470,139 @@ int neko_stack_expand( int_val *sp, int_val *csp, neko_vm *vm ) {
 	return 1;
 }
 
+/*
+	Field names are interned in an open-addressing table of immutable
+	entries. Lookups never lock, and inserts publish a new entry with a
+	single compare-and-swap. When the table is half full it is copied to a
+	bigger one while holding neko_fields_lock : the empty cells of the old
+	table are marked as moved first, so any lookup or insert that reaches
+	one of them waits for the copy to finish and retries in the new table.
+*/
+
+typedef struct {
+	field id;
+	value name;
+} field_entry;
+
+typedef struct {
+	int bits;
+	int count;
+	field_entry *cells[1];
+} field_table;
+
+#define FIELDS_INIT_BITS	10
+#define FIELD_MOVED			(&moved_entry)
+#define FIELD_HASH(t,id)	((((unsigned int)(id)) * 0x9E3779B1) >> (32 - (t)->bits))
+
+static field_entry moved_entry;
+static field_table **neko_fields = NULL;
+
+static field_table *fields_alloc( int bits ) {
+	int size = 1 << bits;
+	field_table *t = (field_table*)alloc(sizeof(field_table) + (size - 1) * sizeof(field_entry*));
+	t->bits = bits;
+	t->count = 0;
+	memset(t->cells,0,size * sizeof(field_entry*));
+	return t;
+}
+
+void neko_init_fields() {
+	neko_fields = (field_table**)alloc_root(1);
+	*neko_fields = fields_alloc(FIELDS_INIT_BITS);
+}
+
+void neko_free_fields() {
+	free_root((value*)neko_fields);
+	neko_fields = NULL;
+}
+
+static void fields_wait_resize() {
+	lock_acquire(neko_fields_lock);
+	lock_release(neko_fields_lock);
+}
+
+static field_entry *fields_find( field id ) {
+	while( true ) {
+		field_table *t = *neko_fields;
+		unsigned int mask = (1 << t->bits) - 1;
+		unsigned int h = FIELD_HASH(t,id);
+		field_entry *e;
+		while( true ) {
+			e = t->cells[h];
+			if( e == NULL )
+				return NULL;
+			if( e == FIELD_MOVED )
+				break;
+			if( e->id == id )
+				return e;
+			h = (h + 1) & mask;
+		}
+		fields_wait_resize();
+	}
+}
+
+static void fields_grow( field_table *t ) {
+	lock_acquire(neko_fields_lock);
+	if( *neko_fields == t ) {
+		int size = 1 << t->bits;
+		field_table *t2 = fields_alloc(t->bits + 1);
+		unsigned int mask = (1 << t2->bits) - 1;
+		int i;
+		for(i=0;i<size;i++) {
+			field_entry *e = t->cells[i];
+			while( e == NULL ) {
+				if( neko_cas_ptr(&t->cells[i],NULL,FIELD_MOVED) )
+					break;
+				e = t->cells[i];
+			}
+			if( e != NULL ) {
+				unsigned int h = FIELD_HASH(t2,e->id);
+				while( t2->cells[h] != NULL )
+					h = (h + 1) & mask;
+				t2->cells[h] = e;
+				t2->count++;
+			}
+		}
+		neko_cas_ptr(neko_fields,t,t2);
+	}
+	lock_release(neko_fields_lock);
+}
+
+static field_entry *fields_insert( field id, const char *name, int len ) {
+	field_entry *e = NULL;
+	while( true ) {
+		field_table *t = *neko_fields;
+		unsigned int mask = (1 << t->bits) - 1;
+		unsigned int h = FIELD_HASH(t,id);
+		field_entry *cur;
+		while( true ) {
+			cur = t->cells[h];
+			if( cur == NULL ) {
+				if( e == NULL ) {
+					e = (field_entry*)alloc(sizeof(field_entry));
+					e->id = id;
+					e->name = copy_string(name,len);
+				}
+				if( neko_cas_ptr(&t->cells[h],NULL,e) ) {
+					if( (unsigned int)neko_atomic_inc(&t->count) > (mask >> 1) )
+						fields_grow(t);
+					return e;
+				}
+				// lost the race for this cell, look at it again
+				continue;
+			}
+			if( cur == FIELD_MOVED )
+				break;
+			if( cur->id == id )
+				return cur;
+			h = (h + 1) & mask;
+		}
+		fields_wait_resize();
+	}
+}
+
 EXTERN field val_id( const char *name ) {
-	objtable *t;
-	value fdata;
+	field_entry *e;
 	field f;
 	value acc = alloc_int(0);
 	const char *oname = name;
@@ -388,53 +611,12 @@ EXTERN field val_id( const char *name ) {
 		name++;
 	}
 	f = val_int(acc);
-	t = &neko_fields[f&NEKO_FIELDS_MASK];
-	fdata = otable_get(t,f);
-	if( fdata == val_null ) {
-		// insert in the table, but by using a larger table that grows faster
-		// since we don't want to resize the table for each insert
-		int min;
-		int max;
-		int mid;
-		field cid;
-		objcell *c;
-		lock_acquire(neko_fields_lock);
-		min = 0;
-		max = t->count;
-		c = t->cells;
-		while( min < max ) {
-			mid = (min + max) >> 1;
-			cid = c[mid].id;
-			if( cid < f )
-				min = mid + 1;
-			else if( cid > f )
-				max = mid;
-			else {
-				fdata = c[mid].v;
-				break;
-			}
-		}
-		// in case we found it, it means that it's been inserted by another thread
-		if( fdata == val_null ) {
-			const size_t objcell_size = sizeof(objcell);
-			objcell *c2 = (objcell*)alloc(objcell_size * (t->count + 1));
-
-			// copy the whole table
-			mid = (min + max) >> 1;
-			memcpy(c2, c, mid * objcell_size);
-			c2[mid].id = f;
-			c2[mid].v = copy_string(oname,name - oname);
-			memcpy(&c2[mid + 1], &c[mid], (t->count - mid) * objcell_size);
-
-			// update
-			t->cells = c2;
-			t->count++;
-		}
-		lock_release(neko_fields_lock);
-	}
-	if( fdata != val_null && scmp(val_string(fdata),val_strlen(fdata),oname,(int)(name - oname)) != 0 ) {
+	e = fields_find(f);
+	if( e == NULL )
+		e = fields_insert(f,oname,(int)(name - oname));
+	if( scmp(val_string(e->name),val_strlen(e->name),oname,(int)(name - oname)) != 0 ) {
 		buffer b = alloc_buffer("Field conflict between ");
-		val_buffer(b,fdata);
+		val_buffer(b,e->name);
 		buffer_append(b," and ");
 		buffer_append(b,oname);
 		bfailure(b);
@@ -443,14 +625,15 @@ EXTERN field val_id( const char *name ) {
 }
 
 EXTERN value val_field_name( field id ) {
-	return otable_get(&neko_fields[id&NEKO_FIELDS_MASK],id);
+	field_entry *e = fields_find(id);
+	return e ? e->name : val_null;
 }
 
 EXTERN value val_field( value _o, field id ) {
 	value *f;
 	vobject *o = (vobject*)_o;
 	do {
-		f = otable_find(&o->table,id);
+		f = obj_find(o,id);
 		if( f != NULL )
 			return *f;
 		o = o->proto;
@@ -459,7 +642,7 @@ EXTERN value val_field( value _o, field id ) {
 }
 
 EXTERN void val_iter_fields( value o, void f( value , field, void * ) , void *p ) {
-	otable_iter( &((vobject*)o)->table, f, p );
+	obj_iter( (vobject*)o, f, p );
 }
 
 EXTERN void val_print( value v ) {
@@ -0,0 +1,225 @@
+/*
+ * Copyright (C)2005-2022 Haxe Foundation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "vm.h"
+#include "neko_mod.h"
+#ifdef NEKO_POSIX
+#	include <signal.h>
+#	include <sys/time.h>
+#endif
+
+/*
+	Sampling profiler : a SIGPROF timer only increments neko_prof_ticks.
+	The interpreter compares it with the last value seen by the VM on
+	calls and jumps, and records the call stack when it changed. Each
+	sample is weighted by the number of ticks elapsed, so time spent in
+	primitives is charged to the next safepoint. Stacks are kept as
+	collapsed "file:line;file:line" strings, ready for flamegraph.pl
+*/
+
+typedef struct {
+	char *stack;
+	unsigned int hash;
+	int count;
+} prof_entry;
+
+volatile int neko_prof_ticks = 0;
+
+static mt_lock *prof_lock = NULL;
+static prof_entry *prof_table = NULL;
+static int prof_size = 0;
+static int prof_count = 0;
+static char *prof_buf = NULL;
+static int prof_buf_size = 0;
+static int prof_buf_len = 0;
+
+static void prof_append( const char *s, int len ) {
+	if( prof_buf_len + len + 1 > prof_buf_size ) {
+		int size = prof_buf_size ? prof_buf_size : 256;
+		while( prof_buf_len + len + 1 > size )
+			size <<= 1;
+		prof_buf = (char*)realloc(prof_buf,size);
+		prof_buf_size = size;
+	}
+	memcpy(prof_buf + prof_buf_len,s,len);
+	prof_buf_len += len;
+}
+
+// optimized for sparse bits
+static int bitcount( unsigned int k ) {
+	int b = 0;
+	while( k ) {
+		b++;
+		k &= (k - 1);
+	}
+	return b;
+}
+
+static void prof_frame( neko_module *m, int_val *pc ) {
+	unsigned int ppc = (unsigned int)(pc - m->code);
+	const char *file;
+	char tmp[32];
+	int line, i, start;
+	if( prof_buf_len )
+		prof_append(";",1);
+	if( m->dbgidxs && ppc < m->codesize ) {
+		int idx = m->dbgidxs[ppc>>5].base + bitcount(m->dbgidxs[ppc>>5].bits >> (31 - (ppc & 31)));
+		value *p = val_array_ptr(val_array_ptr(m->dbgtbl)[idx]);
+		file = val_string(p[0]);
+		line = val_int(p[1]);
+	} else {
+		file = val_is_string(m->name) ? val_string(m->name) : "?";
+		line = -(int)ppc;
+	}
+	start = prof_buf_len;
+	prof_append(file,(int)strlen(file));
+	// keep the collapsed format parseable
+	for(i=start;i<prof_buf_len;i++)
+		if( prof_buf[i] == ';' || prof_buf[i] == '\n' )
+			prof_buf[i] = '_';
+	if( line >= 0 )
+		sprintf(tmp,":%d",line);
+	else
+		sprintf(tmp,"+%d",-line);
+	prof_append(tmp,(int)strlen(tmp));
+}
+
+static void prof_add( const char *s, int len, int count ) {
+	unsigned int h = 2166136261u;
+	int i;
+	prof_entry *e;
+	for(i=0;i<len;i++)
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	if( prof_count * 2 >= prof_size ) {
+		int size = prof_size ? prof_size * 2 : 256;
+		prof_entry *t = (prof_entry*)calloc(size,sizeof(prof_entry));
+		for(i=0;i<prof_size;i++) {
+			prof_entry *o = prof_table + i;
+			if( o->stack ) {
+				int k = o->hash & (size - 1);
+				while( t[k].stack )
+					k = (k + 1) & (size - 1);
+				t[k] = *o;
+			}
+		}
+		free(prof_table);
+		prof_table = t;
+		prof_size = size;
+	}
+	i = h & (prof_size - 1);
+	while( 1 ) {
+		e = prof_table + i;
+		if( e->stack == NULL )
+			break;
+		if( e->hash == h && strcmp(e->stack,s) == 0 ) {
+			e->count += count;
+			return;
+		}
+		i = (i + 1) & (prof_size - 1);
+	}
+	e->stack = (char*)malloc(len + 1);
+	memcpy(e->stack,s,len + 1);
+	e->hash = h;
+	e->count = count;
+	prof_count++;
+}
+
+void neko_prof_sample( neko_vm *vm, void *m, int_val *pc ) {
+	int ticks = neko_prof_ticks;
+	int count = ticks - vm->prof_tick;
+	int_val *csp;
+	vm->prof_tick = ticks;
+	if( count <= 0 || prof_lock == NULL )
+		return;
+	lock_acquire(prof_lock);
+	prof_buf_len = 0;
+	for(csp = vm->spmin - 1; csp != vm->csp; csp += 4) {
+		neko_module *cm = (neko_module*)csp[4];
+		// calls from C have no module
+		if( cm )
+			prof_frame(cm,((int_val**)csp)[1] - 2);
+	}
+	prof_frame((neko_module*)m,pc);
+	prof_append("",1);
+	prof_add(prof_buf,prof_buf_len - 1,count);
+	lock_release(prof_lock);
+}
+
+#ifdef NEKO_POSIX
+static void prof_signal( int s ) {
+	neko_prof_ticks++;
+}
+
+static int prof_timer( int hz ) {
+	struct itimerval t;
+	t.it_interval.tv_sec = 0;
+	t.it_interval.tv_usec = hz ? 1000000 / hz : 0;
+	t.it_value = t.it_interval;
+	return setitimer(ITIMER_PROF,&t,NULL) == 0;
+}
+#endif
+
+EXTERN int neko_profile_start( int hz ) {
+#	ifdef NEKO_POSIX
+	struct sigaction act;
+	if( hz <= 0 || hz > 1000000 )
+		return 0;
+	if( prof_lock == NULL )
+		prof_lock = alloc_lock();
+	memset(&act,0,sizeof(act));
+	act.sa_handler = prof_signal;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&act.sa_mask);
+	if( sigaction(SIGPROF,&act,NULL) != 0 )
+		return 0;
+	return prof_timer(hz);
+#	else
+	return 0;
+#	endif
+}
+
+EXTERN void neko_profile_stop() {
+#	ifdef NEKO_POSIX
+	prof_timer(0);
+#	endif
+}
+
+EXTERN int neko_profile_dump( const char *file ) {
+	FILE *f;
+	int i;
+	if( prof_lock == NULL )
+		return 0;
+	f = fopen(file,"wb");
+	if( f == NULL )
+		return 0;
+	lock_acquire(prof_lock);
+	for(i=0;i<prof_size;i++)
+		if( prof_table[i].stack )
+			fprintf(f,"%s %d\n",prof_table[i].stack,prof_table[i].count);
+	lock_release(prof_lock);
+	fclose(f);
+	return 1;
+}
+
+/* ************************************************************************ */
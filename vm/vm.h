@@ -29,7 +29,9 @@
 #define MAX_STACK_PER_FUNCTION	128
 #define PROF_SIZE		(1 << 20)
 #define CALL_MAX_ARGS	5
-#define NEKO_FIELDS_MASK 63
+#define TIER_CALLS		100
+#define TIER_LOOPS		1000
+#define NEKO_CELL_CLASSES	16
 
 typedef struct _custom_list {
 	vkind tag;
@@ -58,8 +60,73 @@ struct _neko_vm {
 	int trusted_code;
 	neko_stat_func fstats;
 	neko_stat_func pstats;
+	void *cells[NEKO_CELL_CLASSES];
+	unsigned int cell_allocs;
+	unsigned int cell_refills;
+	int prof_tick;
+	void *fiber;
 };
 
+#if defined(NEKO_VCC)
+#	include <intrin.h>
+#	define neko_cas_ptr(p,old,v)	(_InterlockedCompareExchangePointer((void * volatile *)(p),(v),(old)) == (void*)(old))
+#	define neko_cas_int(p,old,v)	(_InterlockedCompareExchange((volatile long*)(p),(v),(old)) == (long)(old))
+#	define neko_atomic_inc(p)		_InterlockedIncrement((volatile long*)(p))
+#	define neko_atomic_dec(p)		_InterlockedDecrement((volatile long*)(p))
+#else
+#	define neko_cas_ptr(p,old,v)	__sync_bool_compare_and_swap((p),(old),(v))
+#	define neko_cas_int(p,old,v)	__sync_bool_compare_and_swap((p),(old),(v))
+#	define neko_atomic_inc(p)		__sync_add_and_fetch((p),1)
+#	define neko_atomic_dec(p)		__sync_sub_and_fetch((p),1)
+#endif
+
+#if defined(NEKO_JIT_ENABLE) && defined(NEKO_X64)
+#	define NEKO_JIT_TIER
+#endif
+
+typedef struct {
+	int_val *code;
+	int *counts;
+	void **native;
+	unsigned int *starts;
+	value *blocks;
+	int nstarts;
+	unsigned int main;
+	unsigned int main_end;
+} neko_tier;
+
+// a C stack which is not running and must be scanned by the GC
+typedef struct _neko_stack {
+	void *lo;
+	void *hi;
+	struct _neko_stack *prev;
+	struct _neko_stack *next;
+} neko_stack;
+
+#define ROPE_MIN_LENGTH	128
+
+typedef struct {
+	int size;
+	int used;
+	char data[1];
+} rope_buffer;
+
+typedef struct {
+	val_type t;
+	vkind kind;
+	rope_buffer *buf;
+	value flat;
+	int len;
+} vrope;
+
+extern vkind neko_kind_rope;
+#define val_is_rope(v)	val_is_kind(v,neko_kind_rope)
+// once flattened, the flat string is the one that can be modified
+#define rope_data(r)	((r)->flat ? val_string((r)->flat) : (r)->buf->data)
+
+extern value neko_rope_add( neko_vm *vm, value a, value b );
+extern value neko_rope_flatten( value v );
+
 extern int_val *callback_return;
 extern mt_local *neko_vm_context;
 
@@ -68,6 +135,16 @@ extern mt_local *neko_vm_context;
 extern value neko_alloc_apply( int nargs, value env );
 extern value neko_interp( neko_vm *vm, void *m, int_val acc, int_val *pc );
 extern int_val *neko_get_ttable();
+extern volatile int neko_prof_ticks;
+extern int neko_vm_count;
+extern void *neko_tier_hot( void *m, int_val *pc );
+extern void neko_prof_sample( neko_vm *vm, void *m, int_val *pc );
+extern int neko_gc_can_switch();
+extern void neko_gc_lock();
+extern void neko_gc_unlock();
+extern void *neko_gc_stack_bottom( void *bottom );
+extern void neko_gc_add_stack( neko_stack *s );
+extern void neko_gc_remove_stack( neko_stack *s );
 
 #endif
 /* ************************************************************************ */